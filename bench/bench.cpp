@@ -0,0 +1,142 @@
+#include "huffman.h"
+#include "bwt.h"
+#include "context.h"
+#include "pipeline.h"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+
+
+using namespace Huffman;
+using namespace std;
+
+
+// Текст, похожий на лог: повторяющиеся строки с меняющимися числами
+static string generate_text(size_t size){
+    string text;
+    for(int i = 0; text.size() < size; i++)
+        text += "2026-10-19T12:" + to_string(i % 60) + " INFO worker-" + to_string(i % 8)
+            + " request " + to_string(i * 7919 % 100000) + " served in " + to_string(i % 13) + " ms\n";
+    text.resize(size);
+    return text;
+}
+
+
+// Выполняет f и печатает скорость этапа в МБ/с относительно size байт
+template<class F>
+static void measure(const char* name, size_t size, F f){
+    auto begin = chrono::steady_clock::now();
+    f();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    cout << name << ": " << seconds * 1000 << " ms, " << size / seconds / 1e6 << " MB/s" << endl;
+}
+
+
+int main(int argc, char* argv[]){
+    string text;
+    if(argc > 1){
+        ifstream in(argv[1]);
+        if(!in){
+            cout << "source file does not exist: " << argv[1] << endl;
+            return 1;
+        }
+        text.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    }
+    else{
+        text = generate_text(8 << 20);
+    }
+    string block = text.substr(0, 900000);
+    cout << "block of " << block.size() << " bytes" << endl;
+
+    uint32_t primary;
+    string last, mtf, restored;
+    vector<uint16_t> symbols;
+    size_t additional_size = 0;
+    string payload;
+
+    measure("bwt forward", block.size(), [&](){ last = bwt_forward(block, primary); });
+    measure("mtf encode", block.size(), [&](){ mtf = mtf_encode(last); });
+    measure("zero runs encode", block.size(), [&](){ symbols = zrle_encode(mtf); });
+    measure("block encode (all stages)", block.size(), [&](){ payload = bwt_encode_block(block, additional_size); });
+    measure("block decode (all stages)", block.size(), [&](){ restored = bwt_decode_block(payload, block.size(), additional_size); });
+    measure("zero runs decode", block.size(), [&](){ mtf = zrle_decode(symbols, block.size()); });
+    measure("mtf decode", block.size(), [&](){ last = mtf_decode(mtf); });
+    measure("bwt inverse", block.size(), [&](){ restored = bwt_inverse(last, primary); });
+    if(restored != block){
+        cout << "round trip failed" << endl;
+        return 1;
+    }
+    cout << "block ratio: " << (double)payload.size() / block.size() << endl;
+
+    {
+        stringstream text_src(text);
+        HuffmanTree tree(counts(text_src));
+        vector<byte_t> bits;
+        vector<char> decoded;
+        size_t size = 0;
+        measure("huffman encode", text.size(), [&](){ size = tree.encode(text.data(), text.size(), bits); });
+        measure("huffman decode", text.size(), [&](){ tree.decode(bits.data(), size, decoded); });
+        if(string(decoded.begin(), decoded.end()) != text){
+            cout << "round trip failed" << endl;
+            return 1;
+        }
+    }
+
+    {
+        stringstream text_src(text);
+        ContextModel model(text_src, ContextModel::MAX_TABLES);
+        stringstream encoded;
+        stringstream decoded;
+        measure("order1 encode", text.size(), [&](){ model.encode(text_src, encoded); });
+        measure("order1 decode", text.size(), [&](){ model.decode(encoded, decoded); });
+        if(decoded.str() != text){
+            cout << "round trip failed" << endl;
+            return 1;
+        }
+    }
+
+    cout << "whole input of " << text.size() << " bytes" << endl;
+    for(int threads : {1, 0}){
+        stringstream src(text);
+        stringstream dst;
+        stringstream decoded;
+        string name = threads == 1 ? "1 thread" : "all cores";
+        measure(("encode, " + name).c_str(), text.size(), [&](){ bwt_encode(src, dst, 900000, threads); });
+        measure(("decode, " + name).c_str(), text.size(), [&](){ bwt_decode(dst, decoded, threads); });
+        if(decoded.str() != text){
+            cout << "round trip failed" << endl;
+            return 1;
+        }
+    }
+
+    // Чтение и конвейерное сжатие файла на диске разными способами ввода-вывода
+    auto dir = filesystem::temp_directory_path();
+    string src_path = (dir / "huffman_bench_src.bin").string();
+    string dst_path = (dir / "huffman_bench_dst.bin").string();
+    {
+        ofstream file(src_path, ios::binary);
+        for(size_t written = 0; written < (64 << 20); written += text.size())
+            file.write(text.data(), text.size());
+    }
+    size_t file_size = filesystem::file_size(src_path);
+    cout << "file of " << file_size << " bytes" << endl;
+    encode_options opt;
+    opt.block_size = 1 << 20;
+    for(auto [io, name] : {pair{io_backend::stream, "iostream"}, pair{io_backend::pread, "pread"}, pair{io_backend::uring, "io_uring"}}){
+        if(io == io_backend::uring && !uring_available())
+            cout << "io_uring is not available, pread is used" << endl;
+        vector<char> buffer(1 << 20);
+        measure((string("read, ") + name).c_str(), file_size, [&](){
+            auto reader = open_reader(src_path.c_str(), io);
+            while(reader->read(buffer.data(), buffer.size()) > 0);
+        });
+        measure((string("pipeline encode, ") + name).c_str(), file_size, [&](){
+            pipeline_encode_file(src_path.c_str(), dst_path.c_str(), opt, io);
+        });
+    }
+    filesystem::remove(src_path);
+    filesystem::remove(dst_path);
+}
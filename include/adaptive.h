@@ -0,0 +1,68 @@
+#pragma once
+
+#include "huffman.h"
+
+
+namespace Huffman{
+
+/*
+Адаптивное дерево Хаффмана (алгоритм FGK).
+Кодер и декодер начинают с одинакового дерева из единственного узла NYT
+("not yet transmitted") и после каждого символа одинаково его обновляют,
+поэтому дерево не нужно ни строить заранее, ни записывать в поток:
+сжатие идёт в один проход.
+Новый символ кодируется как код NYT и 8 бит самого символа.
+*/
+class AdaptiveHuffmanTree{
+public:
+    AdaptiveHuffmanTree();
+
+    // Кодирует один символ и обновляет дерево
+    void encode(char symb, bit_oseq& dst);
+
+    // Декодирует один символ и обновляет дерево
+    char decode(bit_iseq& src);
+
+    // Кодирует весь поток src, читая его один раз
+    void encode(std::istream& src, std::ostream& dst);
+
+    // Декодирует поток, записанный encode
+    void decode(std::istream& src, std::ostream& dst);
+
+protected:
+    /*
+    Узлы устроены как в HuffmanTree: ссылки на детей и родителя - индексы в векторе nodes.
+    Индекс узла - его порядковый номер в FGK: веса не убывают с ростом индекса,
+    корень всегда последний. Новые узлы занимают индексы ниже NYT.
+    */
+    struct Node{
+        uint16_t i0; // индекс потомка по биту 0 (-1, если узел - лист)
+        uint16_t i1; // индекс потомка по биту 1 (-1, если узел - лист)
+        uint16_t ip; // индекс родителя, -1 если узел - корень
+        bool v;      // это правый или левый потомок родителя?
+        char symb;   // символ листа
+        uint32_t weight; // сколько раз встречались символы поддерева
+
+        bool is_leaf() const;
+    };
+
+    static constexpr uint16_t MAX_NODES = 2 * 257 - 1;  // 256 символов и NYT
+
+    // Записывает в dst код узла node
+    void write_code(uint16_t node, bit_oseq& dst);
+
+    // Добавляет лист для нового символа, разбивая NYT. Возвращает индекс листа
+    uint16_t add_symbol(char symb);
+
+    // Увеличивает вес листа и восстанавливает свойство соседства
+    void update(uint16_t leaf);
+
+    // Меняет местами поддеревья в позициях a и b
+    void swap_nodes(uint16_t a, uint16_t b);
+
+    std::vector<Node> nodes;
+    uint16_t leaves[256];  // индекс листа для каждого символа, -1 если символ ещё не встречался
+    uint16_t nyt;
+};
+
+}
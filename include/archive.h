@@ -0,0 +1,82 @@
+#pragma once
+
+#include "huffman.h"
+#include <map>
+#include <string>
+#include <vector>
+
+
+namespace Huffman{
+
+/*
+Архив из нескольких сжатых файлов (членов) с центральным каталогом в конце:
+
+    "HUFA" версия
+    член 1: сжатые данные, как их пишет encode (со своим способом, деревом, блоками)
+    член 2: ...
+    каталог: число членов, затем для каждого имя, смещение, размеры и контрольные суммы
+    хвост: смещение каталога, его размер и CRC-32, "HUFA"
+
+Чтобы извлечь один член, достаточно прочитать хвост и каталог и перейти
+к смещению члена, остальные члены не читаются и не декодируются.
+*/
+struct ArchiveEntry{
+    std::string name;
+    uint64_t offset = 0;       // от начала архива
+    uint64_t packed_size = 0;
+    uint64_t raw_size = 0;
+    uint32_t packed_crc = 0;   // CRC-32 сжатых данных: порча обнаруживается до декодирования
+    uint32_t raw_crc = 0;      // CRC-32 исходных данных: проверка после декодирования
+};
+
+
+// Пишет архив в dst. Поток только дописывается
+class ArchiveWriter{
+public:
+    explicit ArchiveWriter(std::ostream& dst);
+    ~ArchiveWriter();
+
+    // Сжимает src как член name. Поток src должен поддерживать seekg. Возвращает объём дополнительных данных
+    std::size_t add(const std::string& name, std::istream& src, const encode_options& opt = encode_options());
+
+    // Записывает каталог. Возвращает его размер вместе с заголовком и хвостом архива
+    std::size_t close();
+
+    const std::vector<ArchiveEntry>& entries() const { return _entries; }
+
+private:
+    std::ostream& dst;
+    uint64_t offset;
+    std::vector<ArchiveEntry> _entries;
+    bool closed = false;
+};
+
+
+// Читает каталог архива и извлекает члены по одному. Поток src должен поддерживать seekg
+class ArchiveReader{
+public:
+    explicit ArchiveReader(std::istream& src);
+
+    const std::vector<ArchiveEntry>& entries() const { return _entries; }
+
+    // Член с именем name или nullptr
+    const ArchiveEntry* find(const std::string& name) const;
+
+    /*
+    Разжимает член в dst, проверяя обе контрольные суммы и размер.
+    Возвращает объём дополнительных данных члена.
+    */
+    std::size_t extract(const ArchiveEntry& entry, std::ostream& dst, int threads = 0);
+    std::size_t extract(const std::string& name, std::ostream& dst, int threads = 0);
+
+    // Размер заголовка, каталога и хвоста архива
+    std::size_t additional_data_size() const { return directory_size; }
+
+private:
+    std::istream& src;
+    std::vector<ArchiveEntry> _entries;
+    std::map<std::string, std::size_t> index;
+    std::size_t directory_size = 0;
+};
+
+}
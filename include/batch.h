@@ -0,0 +1,54 @@
+#pragma once
+
+#include "huffman.h"
+#include <string>
+#include <vector>
+
+
+namespace Huffman{
+
+// Параметры пакетной обработки файлов
+struct batch_options{
+    encode_options options;          // способ сжатия; потоки каждого файла не используются - всё делает пул
+    bool decode = false;             // разжимать, а не сжимать
+    std::string output_dir;          // куда писать результаты
+    int threads = 0;                 // размер пула, 0 - по числу ядер
+    std::size_t pack_size = 1 << 20; // файлы меньше этого объединяются в одну задачу до такого общего размера
+};
+
+struct batch_result{
+    std::size_t files = 0;
+    std::size_t size_in = 0;
+    std::size_t size_out = 0;
+    std::size_t additional_size = 0;
+    std::vector<std::pair<std::string, std::string>> errors;  // путь и текст ошибки
+};
+
+/*
+Сжимает или разжимает все файлы paths в одном пуле потоков с перехватом работы
+(ThreadPool). Крупные файлы идут отдельными задачами, начиная с самых больших,
+мелкие собираются в задачи общим размером около pack_size, чтобы накладные
+расходы на задачу не превышали саму работу. Ошибка в одном файле не
+останавливает остальные, она попадает в batch_result::errors. Если у нескольких
+файлов один путь результата (batch_output_path), обрабатывается только первый,
+остальные тоже попадают в errors: иначе они писали бы один файл одновременно.
+*/
+batch_result run_batch(const std::vector<std::string>& paths, const batch_options& opt);
+
+// Путь без корня и без ведущих "..", чтобы его можно было безопасно приписать к каталогу
+std::string safe_relative_path(const std::string& path);
+
+/*
+Путь результата для файла path: относительные пути сохраняют каталоги внутри
+output_dir, у абсолютных отбрасывается корень. При сжатии добавляется ".huf",
+при разжатии он снимается (или добавляется ".out", если его нет).
+*/
+std::string batch_output_path(const std::string& path, const std::string& output_dir, bool decode);
+
+// Список путей: по одному в строке (пустые строки пропускаются)
+std::vector<std::string> read_path_list(std::istream& src);
+
+// Пути по шаблону оболочки (*, ?, [...]) в порядке сортировки
+std::vector<std::string> expand_glob(const std::string& pattern);
+
+}
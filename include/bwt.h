@@ -0,0 +1,57 @@
+#pragma once
+
+#include "huffman.h"
+#include <string>
+
+
+namespace Huffman{
+
+/*
+Блочная сортировка, как в bzip2: вход делится на блоки, и каждый блок проходит
+    преобразование Барроуза - Уилера (через суффиксный массив, SA-IS),
+    move-to-front,
+    кодирование серий нулей символами RUNA/RUNB,
+    код Хаффмана над алфавитом из 257 символов.
+Блоки независимы и обрабатываются параллельно.
+Этапы доступны по отдельности, чтобы их можно было измерять и проверять.
+*/
+
+// Суффиксный массив строки s длины n (алгоритм SA-IS)
+std::vector<int32_t> suffix_array(const byte_t* s, std::size_t n);
+
+// Преобразование Барроуза - Уилера. Возвращает последний столбец, в primary - номер строки, равной исходной
+std::string bwt_forward(const std::string& block, uint32_t& primary);
+std::string bwt_inverse(const std::string& last, uint32_t primary);
+
+// Move-to-front: каждый байт заменяется его номером в списке недавно встреченных байтов
+std::string mtf_encode(const std::string& data);
+std::string mtf_decode(const std::string& data);
+
+/*
+Серии нулей записываются в биективной двоичной системе цифрами RUNA = 0 и RUNB = 1,
+остальные байты v - символами v + 1
+*/
+constexpr uint16_t ZRLE_RUNA = 0;
+constexpr uint16_t ZRLE_RUNB = 1;
+constexpr int ZRLE_SYMBOL_BITS = 9;
+std::vector<uint16_t> zrle_encode(const std::string& data);
+// expected_size - размер блока: серия или символ за его пределами - ошибка формата
+std::string zrle_decode(const std::vector<uint16_t>& symbols, std::size_t expected_size);
+
+/*
+Сжимает и разжимает один блок всеми этапами. В additional_size прибавляется объём
+дополнительных данных блока. expected_size - размер исходного блока из заголовка
+*/
+std::string bwt_encode_block(const std::string& block, std::size_t& additional_size);
+std::string bwt_decode_block(const std::string& payload, std::size_t expected_size, std::size_t& additional_size);
+
+/*
+Сжимает src блоками по block_size байт, используя threads потоков (0 - по числу ядер).
+Возвращает объём дополнительных данных.
+*/
+std::size_t bwt_encode(std::istream& src, std::ostream& dst, std::size_t block_size, int threads);
+
+// Разжимает данные, записанные bwt_encode. Возвращает объём дополнительных данных
+std::size_t bwt_decode(std::istream& src, std::ostream& dst, int threads);
+
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "huffman.h"
+#include <streambuf>
+
+
+namespace Huffman{
+
+// CRC-32 (полином 0xEDB88320, как в zip и gzip). crc - значение для уже обработанной части данных
+uint32_t crc32(const void* data, std::size_t size, uint32_t crc = 0);
+
+
+/*
+Буфер потока вывода, который передаёт всё в другой буфер и по дороге считает
+CRC-32 и число байт. Позволяет посчитать контрольную сумму того, что пишет
+encode или decode, без копии данных в памяти.
+*/
+class crc_ostreambuf : public std::streambuf{
+public:
+    explicit crc_ostreambuf(std::streambuf* dst): dst(dst) {}
+
+    uint32_t crc() const { return _crc; }
+    uint64_t size() const { return _size; }
+
+protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char* s, std::streamsize n) override;
+    int sync() override;
+
+private:
+    std::streambuf* dst;
+    uint32_t _crc = 0;
+    uint64_t _size = 0;
+};
+
+}
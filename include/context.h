@@ -0,0 +1,50 @@
+#pragma once
+
+#include "huffman.h"
+
+
+namespace Huffman{
+
+/*
+Модель первого порядка: код символа зависит от предыдущего байта.
+256 контекстов (значений предыдущего байта) объединяются в несколько групп
+с похожими распределениями, и на каждую группу строится своё дерево Хаффмана.
+Данные идут блоками по BLOCK_SIZE байт: символы блока раскладываются по деревьям
+их контекстов (по таблице context_table), и у каждого дерева своя последовательность
+бит, которую кодирует и разжимает табличный кодер HuffmanTree. Декодер разжимает
+все последовательности блока, а потом собирает символы в исходном порядке,
+беря каждый следующий из группы дерева предыдущего байта.
+Формат: [uint32 n][последовательность bit_oseq на каждое дерево]..., в конце n = 0.
+*/
+class ContextModel{
+public:
+    ContextModel(){}
+
+    // Строит модель по тексту src, объединяя контексты не более чем в tables групп. Оставляет курсор потока на месте
+    ContextModel(std::istream& src, int tables = 8);
+
+    void construct(std::istream& src, int tables = 8);
+
+    // Кодирует сообщение src и записывает результат в dst
+    void encode(std::istream& src, std::ostream& dst);
+
+    // Декодирует сообщение src и записывает результат в dst
+    void decode(std::istream& src, std::ostream& dst);
+
+    // Запись в файл и чтение из файла: число групп, таблица контекстов и компактно записанные деревья
+    void save(std::ostream& dst);
+    void load(std::istream& src);
+
+    std::size_t additional_data_size();
+
+    static constexpr int MAX_TABLES = 16;
+    static constexpr uint32_t BLOCK_SIZE = 1 << 20;
+
+protected:
+    byte_t context_table[256] = {};  // номер дерева для каждого значения предыдущего байта
+    std::vector<HuffmanTree> trees;
+    std::size_t header_size = 0;         // запись модели
+    std::size_t stream_header_size = 0;  // заголовки блоков и последовательностей бит в последнем encode или decode
+};
+
+}
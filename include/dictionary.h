@@ -0,0 +1,69 @@
+#pragma once
+
+#include "huffman.h"
+#include <string>
+
+
+namespace Huffman{
+
+/*
+Заранее обученное дерево Хаффмана ("словарь") для коротких сообщений.
+Дерево строится один раз по корпусу примеров и хранится отдельно от сообщений,
+поэтому сжатое сообщение не содержит ни дерева, ни длины - только коды символов.
+В дереве словаря есть все 256 байтов, так что закодировать можно любое сообщение.
+Последний байт дополняется началом самого длинного кода (как EOS в HPACK):
+такой хвост короче 8 бит и не доходит до листа, и декодер его отбрасывает.
+*/
+class Dictionary: public HuffmanTree{
+public:
+    Dictionary(): id(0) {}
+
+    // Строит словарь по частотам m. Символы, которых нет в m, получают малую частоту
+    Dictionary(uint16_t id, const std::map<char, double>& m);
+
+    // Обучает словарь на корпусе corpus
+    static Dictionary train(uint16_t id, std::istream& corpus);
+
+    // Кодирует сообщение src целиком, без заголовка
+    void encode_message(std::istream& src, std::ostream& dst) const;
+
+    // Декодирует сообщение, записанное encode_message. Читает src до конца
+    void decode_message(std::istream& src, std::ostream& dst) const;
+
+    // Запись и чтение словаря: идентификатор и дерево
+    void save(std::ostream& dst);
+    void load(std::istream& src);
+
+    uint16_t id;
+
+private:
+    // Строит коды символов и хвост для дополнения последнего байта
+    void build_codes();
+
+    std::vector<bool> codes[256];  // код каждого байта, первый бит - от корня
+    std::vector<bool> padding;     // первые 7 бит самого длинного кода
+};
+
+
+/*
+Набор словарей, загружаемых при запуске.
+Сообщение сжимается и разжимается словарём с указанным идентификатором.
+*/
+class DictionaryRegistry{
+public:
+    void add(const Dictionary& dict);
+
+    // Читает словарь из потока (в формате Dictionary::save) и добавляет его
+    void load(std::istream& src);
+
+    bool contains(uint16_t id) const;
+    const Dictionary& get(uint16_t id) const;
+
+    void encode(uint16_t id, std::istream& src, std::ostream& dst) const;
+    void decode(uint16_t id, std::istream& src, std::ostream& dst) const;
+
+private:
+    std::map<uint16_t, Dictionary> dicts;
+};
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "huffman.h"
+#include <memory>
+
+
+namespace Huffman{
+
+// Способ чтения и записи файлов конвейером (pipeline_encode_file)
+enum class io_backend{
+    stream,  // std::ifstream / std::ofstream
+    pread,   // pread / pwrite большими блоками, без буферов iostream
+    uring,   // io_uring: несколько чтений и записей одновременно в зарегистрированные буферы
+};
+
+
+// Последовательное чтение: заполняет dst целиком, меньше - только в конце данных
+class FileReader{
+public:
+    virtual ~FileReader(){}
+    virtual std::size_t read(char* dst, std::size_t size) = 0;
+};
+
+// Последовательная запись. close дожидается окончания всех записей и сообщает об ошибках
+class FileWriter{
+public:
+    virtual ~FileWriter(){}
+    virtual void write(const char* data, std::size_t size) = 0;
+    virtual void close() = 0;
+};
+
+
+// Обёртки над потоками, чтобы конвейер работал одинаково с потоками и файлами
+class StreamReader : public FileReader{
+public:
+    explicit StreamReader(std::istream& src): src(src) {}
+    std::size_t read(char* dst, std::size_t size) override;
+private:
+    std::istream& src;
+};
+
+class StreamWriter : public FileWriter{
+public:
+    explicit StreamWriter(std::ostream& dst): dst(dst) {}
+    void write(const char* data, std::size_t size) override;
+    void close() override;
+private:
+    std::ostream& dst;
+};
+
+
+// Есть ли io_uring в ядре (может быть выключен или запрещён в контейнере)
+bool uring_available();
+
+/*
+Открывают файл для чтения или записи выбранным способом. chunk_size - размер одного
+чтения или записи, depth - сколько их выполняется одновременно (для io_uring).
+Если io_uring недоступен, используются pread и pwrite. Каналы и устройства
+(/dev/stdin) читаются подряд, пока данные не кончатся.
+Бросают HuffmanException, если файл не открывается или не удаётся узнать его размер.
+*/
+std::unique_ptr<FileReader> open_reader(const char* path, io_backend io, std::size_t chunk_size = 1 << 20, int depth = 4);
+std::unique_ptr<FileWriter> open_writer(const char* path, io_backend io, std::size_t chunk_size = 1 << 20, int depth = 4);
+
+}
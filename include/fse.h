@@ -0,0 +1,62 @@
+#pragma once
+
+#include "huffman.h"
+
+
+namespace Huffman{
+
+/*
+Табличный кодер на асимметричных системах счисления (tANS, как FSE в zstd).
+В отличие от кода Хаффмана, символ может стоить дробное число бит,
+поэтому на сильно перекошенных распределениях сжатие близко к энтропии.
+Частоты берутся из тех же counts, что и для HuffmanTree.
+
+Частоты нормируются так, чтобы их сумма была равна L = 2^table_log.
+Состояние кодера - число из [L, 2L), состояние декодера - из [0, L).
+Кодер проходит сообщение с конца, декодер читает его с начала,
+поэтому кодер сначала собирает порции бит, а записывает их в обратном порядке.
+Чтобы для этого не держать в памяти всё сообщение, оно кодируется пакетами
+по BATCH символов, и у каждого пакета своё начальное состояние.
+*/
+class FseTable{
+public:
+    FseTable(){}
+
+    // Строит таблицы по частотам символов
+    FseTable(const std::map<char, double>& m, int table_log = 11);
+
+    void construct(const std::map<char, double>& m, int table_log = 11);
+
+    // Кодирует сообщение src (не длиннее UINT32_MAX, src должен поддерживать seekg) и записывает результат в dst
+    void encode(std::istream& src, std::ostream& dst);
+
+    // Декодирует сообщение src и записывает результат в dst
+    void decode(std::istream& src, std::ostream& dst);
+
+    // Запись в файл и чтение из файла нормированных частот
+    void save(std::ostream& dst);
+    void load(std::istream& src);
+
+    std::size_t additional_data_size();
+
+    static constexpr uint32_t BATCH = 1 << 16;
+
+protected:
+    // Строит таблицы кодера и декодера по нормированным частотам norm
+    void build_tables();
+
+    // Строка таблицы декодера
+    struct DNode{
+        char symb;         // символ, который декодируется в этом состоянии
+        uint8_t nb_bits;   // сколько бит дочитать
+        uint16_t base;     // новое состояние = base + дочитанные биты
+    };
+
+    int table_log = 0;
+    uint16_t norm[256] = {};       // нормированные частоты, сумма равна 1 << table_log
+    uint16_t first[256] = {};      // начало строк символа в enc_states
+    std::vector<uint16_t> enc_states;  // для символа s и m из [norm[s], 2*norm[s]) - состояние кодера после s
+    std::vector<DNode> dnodes;
+};
+
+}
@@ -1,11 +1,14 @@
 #pragma once 
 
 #include <iostream>
+#include <string>
 #include <vector>
 #include <map>
 #include <set>
 #include <stddef.h>
 #include <cassert>
+#include <algorithm>
+#include <type_traits>
 
 
 namespace Huffman{
@@ -21,49 +24,119 @@ struct HuffmanException{
 };
 
 
+// Итог декодирования для функций try_decode, которые не бросают исключений
+enum class decode_status : byte_t{
+    ok = 0,
+    truncated,       // данные кончились посреди кода или заголовка
+    corrupt,         // недопустимые данные: ссылка за пределы дерева, неполный код
+    unknown_method,  // неизвестный способ кодирования в первом байте
+};
+
+struct decode_result{
+    decode_status status = decode_status::ok;
+    std::size_t position = 0;  // номер бита от начала разбираемых данных, на котором обнаружена ошибка
+
+    decode_result(){}
+    decode_result(decode_status status, std::size_t position): status(status), position(position) {}
+
+    bool ok() const { return status == decode_status::ok; }
+
+    // Текст ошибки для HuffmanException
+    std::string message() const;
+};
+
+
+/*
+Последовательность бит в потоке, первый бит - младший в байте. Она пишется
+кусками: перед каждым куском - поле seq_size_t с числом бит в нём. Если в поле
+поднят старший бит (BIT_SEQ_MORE), за куском идут ещё куски, а его биты - целые
+байты; иначе это последний кусок. Последовательность из одного куска - это
+просто [размер в битах][биты], как в первой версии формата.
+Биты копятся в памяти, пока не наберётся BIT_SEQ_CHUNK байт, и выводятся
+одной записью вместе с заголовком куска, поэтому поток только дописывается
+(им может быть и канал, в котором нельзя вызвать seekp), а память ограничена
+одним куском.
+*/
+constexpr seq_size_t BIT_SEQ_MORE = seq_size_t(1) << 31;
+constexpr std::size_t BIT_SEQ_CHUNK = 1 << 16;
+
 class bit_oseq{
 public:
     bit_oseq(std::ostream& os);
 
     void write(bool value);
 
+    // Дописывает n целых байт; уже записанных бит должно быть кратно 8
+    void write_bytes(const byte_t* data, std::size_t n);
+
+    /*
+    Выводит накопленные целые байты отдельным куском и сбрасывает поток, не
+    дожидаясь BIT_SEQ_CHUNK байт: декодер получит всё, кроме последних (меньше 8) бит.
+    Для потоковой передачи, когда следующих данных придётся ждать.
+    */
+    void sync();
+
+    // Записывает последний кусок. Дальнейшие биты в поток уже не попадут
     void flush();
 
     void destroy();
 
-    seq_size_t size();
+    // Сколько всего бит записано
+    std::size_t size();
 
     ~bit_oseq();
 
 private:
-    void write_size();
-
-    void next_byte();
+    // Выводит целые байты буфера кусков с флагом BIT_SEQ_MORE
+    void write_chunk();
 
     std::ostream* _os;
-    std::streampos _begin;
-    seq_size_t _size;
-    byte_t _byte;
-    int _offset;
+    std::vector<byte_t> _bytes;  // биты текущего куска
+    std::size_t _size;
+    seq_size_t _chunk_bits;
 };
 
 
+/*
+Читает последовательность bit_oseq из src целиком: биты всех кусков подряд
+дописываются в bytes, их число - в nbits. Память выделяется по мере чтения,
+так что поддельный размер в заголовке не заставит выделить больше, чем есть
+данных. При truncated в bytes остаются прочитанные байты, а nbits - их число
+бит; corrupt - у куска с продолжением не целое число байт.
+*/
+decode_status read_bit_seq(std::istream& src, std::vector<byte_t>& bytes, std::size_t& nbits);
+
+// Сколько бит заголовков кусков приходится на первые pos бит данных последовательности (для позиций ошибок)
+std::size_t bit_seq_header_bits(std::size_t pos);
+
+
 class bit_iseq{
 public:
     bit_iseq(std::istream& is);
 
     bool read();
+
+    // Как read, но без исключений: false, если последовательность кончилась или поток оборван
+    bool try_read(bool& bit);
     
     bool end_of_seq();
 
-    seq_size_t size();
+    // Число бит в уже прочитанных заголовках кусков (после последнего куска - во всей последовательности)
+    std::size_t size();
+
+    // Сколько бит уже прочитано
+    std::size_t position();
 
 private:
-    void next_byte();
+    bool next_byte();
+
+    // Читает заголовок следующего куска. false, если поток оборван или заголовок неверен
+    bool next_chunk();
 
     std::istream& _is;
-    seq_size_t _size;
+    std::size_t _size;
     std::size_t _pos;
+    bool _last;  // прочитан заголовок последнего куска
     byte_t _byte;
     int _offset;
 };
@@ -71,37 +144,147 @@ private:
 
 
 
-class HuffmanTree{
+/*
+Дерево Хаффмана над символами типа Symbol.
+Для байтов это char (HuffmanTree), для потоков токенов (длины LZ77, номера
+токенов, квантованные отсчёты) - uint16_t (TokenHuffmanTree): такие символы
+кодируются напрямую, без разбиения на байты. Листьев не больше 2^15,
+так как узлы ссылаются друг на друга 16-битными индексами.
+*/
+template<class Symbol>
+class BasicHuffmanTree{
+    static_assert(sizeof(Symbol) <= sizeof(uint16_t), "node indices are 16-bit, symbols must fit into uint16_t");
+
 public:
-    HuffmanTree(){}
+    static constexpr std::size_t MAX_LEAVES = std::min<std::size_t>(std::size_t(1) << (8 * sizeof(Symbol)), 1 << 15);
+
+    BasicHuffmanTree(){}
 
     /*
     Строит дерево Хаффмана.
     Принимает на вход используемые символы и их частоты
     */
-    HuffmanTree(const std::map<char, double>& m);
+    BasicHuffmanTree(const std::map<Symbol, double>& m);
 
 
-    // Кодирует сообщение m и записывает результат в cm
+    // Кодирует сообщение m и записывает результат в cm. Символы читаются из потока по sizeof(Symbol) байт
     void encode(std::istream& src, std::ostream& dst);
 
+    /*
+    Кодирует n символов из памяти и дописывает биты в конец dst подряд, как в
+    кусках bit_oseq (без заголовков). Возвращает число бит. Коды берутся из таблицы, и если они
+    не длиннее MAX_UNROLLED_CODE_LENGTH, в 64-битный накопитель складываются по 4
+    кода за одну запись слова в dst.
+    */
+    std::size_t encode(const Symbol* src, std::size_t n, std::vector<byte_t>& dst);
+
     // Декодирует сообщение cm и записывает результат в m 
     void decode(std::istream& src, std::ostream& dst);
 
+    /*
+    Декодирует последовательность из size бит, лежащую в памяти (биты подряд,
+    без заголовков кусков bit_oseq), и дописывает символы в конец dst. Пока до конца данных
+    остаётся не меньше 8 байт, символы декодируются по таблице без проверок границ;
+    конец буфера и коды длиннее таблицы разбираются побитово, с проверками.
+    При повреждённых данных бросает HuffmanException.
+    */
+    void decode(const byte_t* data, std::size_t size, std::vector<Symbol>& dst);
+
+    /*
+    То же без исключений: ошибка возвращается вместе с позицией. Для данных в памяти
+    позиция отсчитывается от начала битовой последовательности, для потока - от его
+    текущего места, вместе с заголовками кусков. Символы до ошибки остаются в dst.
+    */
+    decode_result try_decode(std::istream& src, std::ostream& dst);
+    decode_result try_decode(const byte_t* data, std::size_t size, std::vector<Symbol>& dst);
+
+    // Коды всех символов дерева, первый бит кода - от корня
+    std::map<Symbol, std::vector<bool>> codes();
+
+    // Кодирует один символ
+    void encode(Symbol symb, bit_oseq& dst);
+
+    // Декодирует один символ из src
+    Symbol decode(bit_iseq& src);
+
+    // То же без исключений: false, если src кончился или код не ведёт к листу
+    bool try_decode(bit_iseq& src, Symbol& symb);
+
 
     // Алгоритм создания дерева. Принимает на вход используемые символы и их частоты
-    void construct(const std::map<char, double>& m);
+    void construct(const std::map<Symbol, double>& m);
 
     
     // Запись в файл и чтение из файла в бинарном виде  
     void save(std::ostream& dst);
     void load(std::istream& src);
 
+    /*
+    Чтение с проверкой записи (validate_saved): truncated, если данных не хватило,
+    corrupt, если запись не задаёт дерево. При ошибке дерево не меняется.
+    Вариант для памяти проверяет узлы прямо в data и только потом копирует их в дерево.
+    */
+    decode_status try_load(std::istream& src);
+    decode_status try_load(const byte_t* data, std::size_t size);
+
+    /*
+    Проверяет запись save в data за один линейный проход по узлам, ничего не копируя:
+    число узлов нечётное и не больше 2 * MAX_LEAVES - 1, первые (n + 1) / 2 узлов -
+    листья без потомков, у остальных оба потомка с меньшими номерами, и каждый
+    потомок ссылается на родителя обратно (ip и v). Потомок меньше родителя, значит
+    циклов нет, а обратная ссылка одна, значит у каждого узла, кроме корня, ровно один
+    родитель. Такое дерево можно разжимать без проверок ссылок.
+    */
+    static decode_status validate_saved(const byte_t* data, std::size_t size);
+
+    /*
+    Компактная запись: обход дерева в прямом порядке, бит 0 - внутренний узел,
+    бит 1 и symbol_bits бит символа - лист. Для байтов это около 10 бит на символ
+    вместо 16 байт у save. Если символы меньше своего типа (например, 9-битные
+    токены в uint16_t), symbol_bits можно уменьшить.
+    */
+    void save_compact(bit_oseq& dst, int symbol_bits = 8 * sizeof(Symbol));
+    void load_compact(bit_iseq& src, int symbol_bits = 8 * sizeof(Symbol));
+
     std::size_t additional_data_size();
 
-    bool operator==(const HuffmanTree& t) const;
+    // Длины кодов всех значений Symbol, индекс - символ как беззнаковое число (0 - символа нет в дереве)
+    std::vector<uint8_t> code_lengths();
+
+    /*
+    Строит каноническое дерево по длинам кодов: символы одной длины получают
+    коды подряд в порядке возрастания символов, как в deflate. Такое дерево
+    зависит только от длин, поэтому вместо узлов достаточно записать их.
+    false, если длины не задают полный префиксный код хотя бы из двух символов
+    или длиннее 64 бит.
+    */
+    bool try_construct_canonical(const std::vector<uint8_t>& lengths);
+
+    // Размер записи save для дерева с leaves листьями
+    static std::size_t saved_size(std::size_t leaves);
+
+    /*
+    Точный размер кода в битах для символов с количествами count (индекс - символ
+    как беззнаковое число). SIZE_MAX, если символа с ненулевым количеством нет в дереве.
+    */
+    std::size_t cost(const std::vector<std::size_t>& count);
+
+    /*
+    Таблицы кодирования и декодирования строятся при первом encode или decode
+    и переиспользуются, пока дерево не изменится. Эти функции строят их сразу:
+    после этого encode или decode блоков в памяти ничего не меняют в дереве, и
+    одно дерево можно без блокировок использовать из нескольких потоков.
+    Дерево, прочитанное из файла, проверено при загрузке, так что обе таблицы
+    строятся по нему без проверок ссылок.
+    */
+    void prepare_encode_table();
+    void prepare_decode_table();
+
+    bool operator==(const BasicHuffmanTree& t) const;
 
 protected:
+    using USymbol = typename std::make_unsigned<Symbol>::type;
+
     /*
     Узел или лист в префиксном дереве.
     Все они хранятся в векторе nodes.
@@ -114,12 +297,14 @@ protected:
         uint16_t i1; // индекс следующего узла в векторе nodes, если новый бит в коде символа равен 1 (i1 = -1, если такого нет)
         uint16_t ip; // индекс родительского узла в векторе nodes, -1 если данный узел корень
         bool v;      // это правый или левый потомок родителя?
-        char symb; // если i1 = i2 = -1, то этот узел - лист, и symb - символ в нём 
+        Symbol symb; // если i1 = i2 = -1, то этот узел - лист, и symb - символ в нём 
 
-        bool is_leaf();
-        uint16_t next_node_index(bool bit);
+        bool is_leaf() const;
+        uint16_t next_node_index(bool bit) const;  // (uint16_t)-1, если перехода нет
         bool operator==(const Node& n) const;
     };
+    // save пишет узлы как есть: у дерева байтов узел в 8 байт, как в файлах первой версии
+    static_assert(sizeof(Symbol) != 1 || sizeof(Node) == 8, "byte tree nodes must keep the saved layout");
 
 
     /*
@@ -134,23 +319,155 @@ protected:
         CNode(uint16_t index, float p): p(p), index(index) {}
     };
 
-    Node& find_leaf_with_symbol(char symb);
+    /*
+    Элемент таблицы быстрого декодирования. Индекс таблицы - следующие
+    DECODE_TABLE_BITS бит потока (первый бит - младший). node - узел, в который
+    они приводят, len - сколько бит для этого нужно. Если node не лист,
+    код длиннее таблицы, и его окончание читается побитово.
+    */
+    struct DecodeEntry{
+        uint16_t node;
+        uint8_t len;
+    };
+    static constexpr int DECODE_TABLE_BITS = 11;
+
+    /*
+    Элемент таблицы кодирования: code - биты кода в порядке записи (первый бит -
+    младший), len - длина, 0 у символов, которых нет в дереве.
+    */
+    struct EncodeEntry{
+        uint64_t code;
+        uint8_t len;
+    };
+    // Длина кода, при которой 4 кода и 7 оставшихся бит помещаются в 64-битный накопитель
+    static constexpr int MAX_UNROLLED_CODE_LENGTH = 14;
+    static_assert(4 * MAX_UNROLLED_CODE_LENGTH + 7 <= 64, "4 codes must fit into the accumulator");
+
+    // Заполняет таблицу для всех значений Symbol. Возвращает длину самого длинного кода
+    int build_encode_table(std::vector<EncodeEntry>& table);
+
+    /*
+    Кодирует n символов, записывая по U кодов за раз в out целыми 64-битными словами
+    (после out должно быть 8 байт запаса). В acc и nbits остаются недописанные биты,
+    их меньше 8. Возвращает false, если встретился символ, которого нет в дереве.
+    */
+    template<int U>
+    static bool encode_kernel(const EncodeEntry* table, const Symbol* src, std::size_t n, byte_t*& out, uint64_t& acc, int& nbits);
+    static bool encode_chunk(int unroll, const EncodeEntry* table, const Symbol* src, std::size_t n, byte_t*& out, uint64_t& acc, int& nbits);
+
+    // Строит таблицу на bits бит, bits - не больше DECODE_TABLE_BITS и глубины дерева
+    int build_decode_table(std::vector<DecodeEntry>& table);
+
+    // Спускается от узла node по битам data начиная с pos до листа, проверяя конец данных. В node остаётся лист
+    decode_status walk_to_leaf(const byte_t* data, std::size_t size, std::size_t& pos, uint16_t& node);
+
+    // Проверка count записей Node подряд в records (validate_saved без заголовка)
+    static decode_status validate_nodes(const byte_t* records, std::size_t count);
+
+    Node& find_leaf_with_symbol(Symbol symb);
+
+    // Заполняет leaf_index по листьям из nodes и сбрасывает таблицы, построенные по старому дереву
+    void index_leaves();
 
     /*
     Узлы дерева Хаффмана. Корневой узел всегда последний, листья идут в начале.
     Если число листьев N, то nodes.size() = 2*N-1.
     */
     std::vector<Node> nodes;
+
+    // Индекс листа каждого символа в nodes (-1, если символа нет), чтобы не искать лист перебором
+    std::vector<uint16_t> leaf_index;
+
+    // Построенные таблицы; пустые - ещё не строились
+    std::vector<EncodeEntry> encode_table;
+    int max_code_length = 0;
+    std::vector<DecodeEntry> decode_table;
+    int decode_bits = 0;
 };
 
+using HuffmanTree = BasicHuffmanTree<char>;
+using TokenHuffmanTree = BasicHuffmanTree<uint16_t>;
+
+
+/*
+Подсчитывает количества всех входящих в текст src символов. Осталяет курсор потока на месте.
+Символы читаются по sizeof(Symbol) байт.
+*/
+template<class Symbol = char>
+std::map<Symbol, double> counts(std::istream& src);
+
+/*
+Оценивает частоты символов по выборке: читает не весь поток, а blocks блоков
+размера block_size, расположенных с равным шагом. Если поток короче выборки,
+считает точно, как counts. Иначе всем 256 значениям байта, не попавшим в выборку,
+назначается малая частота, так что в построенном дереве код есть у любого байта.
+Оставляет курсор потока на месте. Поток должен поддерживать seekg.
+*/
+std::map<char, double> sampled_counts(std::istream& src, std::size_t block_size, std::size_t blocks);
+
+
+// Способ кодирования. Записывается первым байтом сжатых данных, по нему decode выбирает декодер
+enum class method : byte_t{
+    huffman = 0,   // статическое дерево Хаффмана, записанное перед данными
+    adaptive = 1,  // адаптивный Хаффман (AdaptiveHuffmanTree), сжатие в один проход
+    fse = 2,       // асимметричные системы счисления (FseTable), дробная длина кода
+    order1 = 3,    // деревья Хаффмана по предыдущему байту (ContextModel)
+    lz77 = 4,      // поиск повторов LZ77 и три потока Хаффмана (lz77_encode)
+    rle = 5,       // серии повторов как символы расширенного алфавита (rle_encode)
+    bwt = 6,       // блочная сортировка: BWT, move-to-front, серии нулей, Хаффман (bwt_encode)
+    static_text = 7,  // встроенный код для текста (text_code), дерево не записывается
+    blocks = 8,    // независимые блоки, сжатые в конвейере чтение/сжатие/запись (pipeline_encode)
+    huffman_block = 9,  // блок Хаффмана внутри blocks, может повторять дерево предыдущего блока (huffman_block.h)
+    stored = 10,   // данные без сжатия: [uint64 размер][данные], если код Хаффмана почти ничего не даёт
+    run = 11,      // один повторённый байт: [uint64 длина][байт]
+};
 
-// Подсчитывает количества всех входящих в текст src символов. Осталяет курсор потока на месте.
-std::map<char, double> counts(std::istream& src);
+// Параметры сжатия
+struct encode_options{
+    method coder = method::huffman;
+    bool sample = false;            // строить дерево по выборке (sampled_counts) вместо полного прохода
+    std::size_t sample_block = 4096;  // размер одного блока выборки
+    std::size_t sample_blocks = 256;  // число блоков выборки
+    int context_tables = 8;         // для method::order1 - на сколько групп делить контексты (1..16)
+    int level = 6;                  // для method::lz77 - уровень сжатия (1..9)
+    std::size_t block_size = 900000;  // для method::bwt и конвейера - размер блока
+    int threads = 0;                // для method::bwt и конвейера - число потоков, 0 - по числу ядер
+    bool pipeline = false;          // сжимать блоками способом coder в конвейере (method::blocks)
+    bool split = false;             // для конвейера с method::huffman - делить блоки там, где меняются частоты (split_block)
+    double split_min_speed = 50;    // скорость поиска точек деления не ниже этой, МБ/с; 0 - без ограничения
+    double min_gain = 0.01;         // для method::huffman - хранить данные без сжатия, если код короче меньше чем на эту долю
+};
 
 // Сжимает информацию. Возвращает объём дополнительных данных
-std::size_t encode(std::istream& src, std::ostream& dst);
-
-// Разжимает информацию. Возвращает объём дополнительных данных
-std::size_t decode(std::istream& src, std::ostream& dst);
+std::size_t encode(std::istream& src, std::ostream& dst, const encode_options& opt = encode_options());
+
+// Разжимает информацию. Возвращает объём дополнительных данных. threads - число потоков для блочных способов
+std::size_t decode(std::istream& src, std::ostream& dst, int threads = 0);
+
+/*
+Разжимает информацию без исключений. Объём дополнительных данных записывается в additional_size.
+Способ huffman разбирается целиком без исключений, ошибки остальных способов
+(HuffmanException и любые std::exception, например bad_alloc из-за размера
+в заголовке) перехватываются и возвращаются как decode_status::corrupt.
+*/
+decode_result try_decode(std::istream& src, std::ostream& dst, std::size_t& additional_size, int threads = 0);
+
+/*
+Сжатый файл начинается с подписи FILE_MAGIC и версии формата FILE_VERSION, за ними
+идут данные encode. В файлах первой версии заголовка и байта способа нет: сразу
+записано дерево Хаффмана (число узлов uint16 - всегда нечётное) и код. Их первый
+байт не бывает равен 'H' (0x48 - чётное), поэтому decode_file разжимает и их.
+*/
+constexpr char FILE_MAGIC[3] = {'H', 'U', 'F'};
+constexpr byte_t FILE_VERSION = 2;
+constexpr std::size_t FILE_HEADER_SIZE = sizeof(FILE_MAGIC) + sizeof(FILE_VERSION);
+
+// Записывает заголовок файла; проверяет прочитанные FILE_HEADER_SIZE байт заголовка, бросает HuffmanException
+void write_file_header(std::ostream& dst);
+void check_file_header(const char* header);
+
+// Сжимают и разжимают файл целиком, с заголовком. Возвращают объём дополнительных данных вместе с заголовком
+std::size_t encode_file(std::istream& src, std::ostream& dst, const encode_options& opt = encode_options());
+std::size_t decode_file(std::istream& src, std::ostream& dst, int threads = 0);
 
 }
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "huffman.h"
+#include <memory>
+
+
+namespace Huffman{
+
+/*
+Блок Хаффмана внутри method::blocks (method::huffman_block). Соседние блоки
+обычно похожи по частотам, поэтому блок может не записывать своё дерево,
+а повторить дерево предыдущего блока:
+
+    [method::huffman_block][block_type][длины кодов, если block_type::tree][uint32 число бит][биты]
+    [method::huffman_block][block_type::stored][данные без сжатия]
+    [method::huffman_block][block_type::single][байт][uint32 длина]
+    [method::huffman_block][block_type::small][k][2^k символов][uint32 число символов][номера символов по k бит]
+
+Повтор зависит от предыдущих блоков, так что такой блок нельзя разжать сам по себе,
+только в потоке блоков (pipeline_decode, decode_range).
+*/
+enum class block_type : byte_t{
+    tree = 0,    // своё каноническое дерево, записаны только длины кодов
+    repeat = 1,  // дерево предыдущего блока (блоки stored пропускаются)
+    stored = 2,  // данные без сжатия, дерево для следующих блоков не меняется
+    single = 3,  // один повторённый байт (нули, заполнение), разжимается memset
+    small = 4,   // не больше 16 разных байтов: номер в списке символов по 1, 2 или 4 бита
+};
+
+// Дерево, общее для блоков, которые его повторяют. Нужная таблица построена заранее, дерево только читается
+using SharedTree = std::shared_ptr<HuffmanTree>;
+
+// Количества байтов блока, индекс - байт как беззнаковое число
+std::vector<std::size_t> byte_counts(const char* data, std::size_t size);
+
+// Длина кода Хаффмана по частотам count в битах (сумма весов внутренних узлов), без записи дерева
+std::size_t huffman_code_bits(const std::size_t* count);
+
+/*
+Длины кодов дерева блока по частотам count (индекс - байт, 0 - байта нет).
+Коды не длиннее 32 бит: если дерево Хаффмана глубже, частоты делятся пополам,
+пока оно не станет мельче. Меньше двух байтов - добавляются фиктивные 0 и 1.
+*/
+std::vector<uint8_t> block_code_lengths(const std::size_t* count);
+
+/*
+Размер записи длин кодов lengths в заголовке блока: разреженная карта
+присутствующих байтов (длины серий) и разности соседних длин постоянным
+префиксным кодом с повторами, как в deflate. Для блока текста в 4 КиБ
+это около 30 байт вместо ~800 у HuffmanTree::save.
+*/
+std::size_t block_tree_header_size(const std::vector<uint8_t>& lengths);
+
+/*
+Размер блока в битах, если закодировать его новым деревом по частотам count:
+точная длина кода, запись длин кодов и заголовки блока в потоке.
+*/
+std::size_t estimate_block_bits(const std::size_t* count);
+
+// Наименьшая часть, на которые split_block делит блок
+constexpr std::size_t SPLIT_UNIT = 4096;
+
+/*
+Делит блок на части, которые выгоднее кодировать разными деревьями (например,
+двоичный заголовок и текст за ним). Возвращает размеры частей.
+Границы ищутся жадно: часть делится в точке, где сумма оценок estimate_block_bits
+двух половин меньше всего, и половины делятся дальше, пока это даёт выигрыш.
+Частоты любого отрезка - разность накопленных частот по кускам SPLIT_UNIT.
+Поиск прекращается, когда скорость падает ниже min_speed МБ/с (0 - не ограничена).
+*/
+std::vector<std::size_t> split_block(const char* data, std::size_t size, double min_speed);
+
+// Каноническое дерево для блока с количествами count (длины - block_code_lengths)
+SharedTree make_block_tree(const std::vector<std::size_t>& count);
+
+/*
+Хранить ли данные размера size без сжатия (уже сжатые или зашифрованные) вместо
+method::huffman: код с деревом HuffmanTree::save короче method::stored меньше
+чем на долю min_gain. Решение принимается по частотам, до построения дерева.
+*/
+bool should_store_block(const std::vector<std::size_t>& count, std::size_t size, double min_gain);
+
+/*
+Способ кодирования блока по частотам, до построения дерева: single для одного
+байта, stored, если выигрыш estimate_block_bits меньше min_gain, small, если
+разных байтов не больше 16 и код постоянной длины не длиннее кода Хаффмана,
+иначе tree - код Хаффмана (своё дерево или повтор, это выбирает choose_block_tree).
+*/
+block_type choose_block_type(const std::vector<std::size_t>& count, std::size_t size, double min_gain);
+
+// Дописывают в dst блоки без дерева: stored, single и small. Возвращают объём дополнительных данных
+std::size_t encode_stored_block(const char* data, std::size_t size, std::string& dst);
+std::size_t encode_single_block(const char* data, std::size_t size, std::string& dst);
+std::size_t encode_small_block(const char* data, std::size_t size, const std::vector<std::size_t>& count, std::string& dst);
+
+/*
+Выбирает дерево блока: prev, если код блока деревом prev не длиннее кода новым
+деревом fresh вместе с его записью (оценка точная, по длинам кодов). prev может быть nullptr.
+*/
+SharedTree choose_block_tree(const std::vector<std::size_t>& count, const SharedTree& fresh, const SharedTree& prev);
+
+/*
+Кодирует блок деревом tree и дописывает его в dst. Если tree - это prev, дерево
+не записывается. Возвращает объём дополнительных данных.
+*/
+std::size_t encode_huffman_block(const char* data, std::size_t size, const SharedTree& tree, const SharedTree& prev, std::string& dst);
+
+// Разобранный заголовок блока
+struct HuffmanBlockHeader{
+    block_type type;
+    SharedTree tree;          // дерево блока: своё или повторённое (у блоков без дерева - prev)
+    std::size_t data_offset;  // где начинается число бит
+};
+
+/*
+Читает заголовок блока data (с первым байтом method::huffman_block). prev - дерево
+предыдущего блока: его повторяет block_type::repeat и передают дальше блоки без дерева.
+*/
+HuffmanBlockHeader read_huffman_block_header(const char* data, std::size_t size, const SharedTree& prev);
+
+/*
+Разжимает блок с разобранным заголовком header в dst. expected_size - размер
+исходного блока из заголовка потока блоков: длина, записанная в самом блоке,
+сверяется с ним до выделения памяти. Возвращает объём дополнительных данных.
+*/
+std::size_t decode_huffman_block(const char* data, std::size_t size, const HuffmanBlockHeader& header, std::size_t expected_size, std::string& dst);
+
+}
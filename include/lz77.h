@@ -0,0 +1,54 @@
+#pragma once
+
+#include "huffman.h"
+#include <string>
+
+
+namespace Huffman{
+
+/*
+Предварительный этап LZ77: повторы заменяются ссылками назад (длина, расстояние).
+Результат - три потока, каждый из которых потом сжимается своим деревом Хаффмана:
+    literals  - байты, для которых повтор не найден;
+    lengths   - по байту на каждый шаг разбора: 0 - литерал, иначе длина повтора - MIN_MATCH + 1;
+    distances - по два байта (младший, старший) расстояния на каждый повтор.
+Повторы ищутся по хеш-цепочкам из первых трёх байтов.
+*/
+struct Lz77Streams{
+    std::string literals;
+    std::string lengths;
+    std::string distances;
+};
+
+class Lz77{
+public:
+    static constexpr int MIN_MATCH = 3;
+    static constexpr int MAX_MATCH = MIN_MATCH + 254;
+    static constexpr int WINDOW = 1 << 15;
+
+    /*
+    level от 1 до 9: чем больше, тем длиннее просматриваемые цепочки
+    и тем лучше сжатие. С уровня 4 включается ленивый поиск:
+    повтор откладывается, если со следующего байта начинается более длинный.
+    */
+    Lz77(int level = 6);
+
+    Lz77Streams parse(const std::string& data);
+
+    // Восстанавливает данные по потокам. Бросает HuffmanException, если потоки испорчены
+    static std::string restore(const Lz77Streams& streams);
+
+private:
+    int max_chain;  // сколько кандидатов просматривать
+    int nice_length;  // повтор такой длины принимается сразу
+    bool lazy;
+};
+
+
+// Сжимает src: LZ77 и три потока Хаффмана. Возвращает объём дополнительных данных
+std::size_t lz77_encode(std::istream& src, std::ostream& dst, int level);
+
+// Разжимает данные, записанные lz77_encode. Возвращает объём дополнительных данных
+std::size_t lz77_decode(std::istream& src, std::ostream& dst);
+
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "huffman.h"
+#include "file_io.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+
+namespace Huffman{
+
+/*
+Очередь ограниченной ёмкости между потоками конвейера. push ждёт, пока
+освободится место, pop - пока появится элемент. После close новые элементы
+не принимаются, а pop возвращает false, когда очередь закрыта и пуста.
+*/
+template<class T>
+class BoundedQueue{
+public:
+    explicit BoundedQueue(std::size_t capacity): capacity(std::max<std::size_t>(1, capacity)) {}
+
+    bool push(T value){
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [&](){ return closed || items.size() < capacity; });
+        if(closed)
+            return false;
+        items.push_back(std::move(value));
+        not_empty.notify_one();
+        return true;
+    }
+
+    bool pop(T& value){
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [&](){ return closed || !items.empty(); });
+        if(items.empty())
+            return false;
+        value = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close(){
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_full.notify_all();
+        not_empty.notify_all();
+    }
+
+private:
+    std::size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+
+/*
+Конвейерное сжатие (method::blocks). Отдельный поток читает src блоками по
+opt.block_size, opt.threads потоков сжимают блоки способом opt.coder (каждый блок -
+как отдельный файл, со своим первым байтом), а вызывающий поток записывает готовые
+блоки по порядку. Очереди между ними ограничены, в памяти одновременно не больше
+2 * threads блоков, а чтение, сжатие и запись идут одновременно.
+Для opt.coder = method::huffman блоки пишутся как method::huffman_block и могут
+повторять дерево предыдущего блока, а с opt.split прочитанный блок может
+записаться несколькими блоками, разделёнными по смене частот (split_block).
+Формат как у bwt_encode: [uint32 размер блока][uint32 размер сжатого блока][блок]...,
+в конце заголовок {0, 0}, за ним индекс блоков для decode_range: где начинается
+каждый блок и какой блок хранит его дерево.
+Возвращает объём дополнительных данных.
+*/
+std::size_t pipeline_encode(std::istream& src, std::ostream& dst, const encode_options& opt);
+
+// Разжимает данные pipeline_encode тем же конвейером. Возвращает объём дополнительных данных
+std::size_t pipeline_decode(std::istream& src, std::ostream& dst, int threads = 0);
+
+/*
+Разжимает только байты [offset, offset + length) исходных данных, сжатых в блоках
+(method::blocks), с заголовком файла или без него. Сжатые данные начинаются с
+текущей позиции src и идут до его конца, src должен поддерживать seekg. По индексу
+блоков в конце данных находятся блоки, покрывающие диапазон, и блок с деревом,
+которое повторяет первый из них; остальные не читаются. Возвращает число записанных
+байт: меньше length, если диапазон выходит за конец данных.
+*/
+std::size_t decode_range(std::istream& src, uint64_t offset, uint64_t length, std::ostream& dst);
+
+// То же для произвольного источника и приёмника (например, файлов через io_uring)
+std::size_t pipeline_encode(FileReader& src, FileWriter& dst, const encode_options& opt);
+std::size_t pipeline_decode(FileReader& src, FileWriter& dst, int threads = 0);
+
+/*
+Сжимает файл src_path в dst_path (заголовок файла, за ним байт method::blocks) и
+разжимает обратно, читая и записывая файлы способом io. Разжимать так можно только
+данные, сжатые в блоках, с заголовком файла или без него. Возвращают объём
+дополнительных данных.
+*/
+std::size_t pipeline_encode_file(const char* src_path, const char* dst_path, const encode_options& opt, io_backend io);
+std::size_t pipeline_decode_file(const char* src_path, const char* dst_path, int threads, io_backend io);
+
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "huffman.h"
+
+
+namespace Huffman{
+
+/*
+Предварительный этап RLE над расширенным алфавитом.
+Символы 0..255 - обычные байты. Серия из k >= RLE_MIN_RUN повторов предыдущего байта
+записывается одним символом RLE_RUN + c, где c = floor(log2(k)),
+за которым идут c младших бит k без ведущей единицы (как коды длин в deflate).
+Дерево Хаффмана строится сразу над байтами и символами серий, поэтому
+длинная серия нулей стоит несколько десятков бит, а не бит на байт.
+*/
+constexpr uint16_t RLE_RUN = 256;
+constexpr int RLE_RUN_CLASSES = 32;
+constexpr uint32_t RLE_MIN_RUN = 4;
+constexpr int RLE_SYMBOL_BITS = 9;  // ширина символа в компактной записи дерева
+
+// Сжимает src: RLE и код Хаффмана. Возвращает объём дополнительных данных
+std::size_t rle_encode(std::istream& src, std::ostream& dst);
+
+// Разжимает данные, записанные rle_encode. Возвращает объём дополнительных данных
+std::size_t rle_decode(std::istream& src, std::ostream& dst);
+
+}
@@ -0,0 +1,335 @@
+#pragma once
+
+#include "huffman.h"
+#include <array>
+#include <cstring>
+#include <vector>
+
+
+namespace Huffman{
+
+/*
+Фиксированный канонический код Хаффмана, который строится при компиляции
+(как статическая таблица Хаффмана в HPACK). Таблица кодов для кодера, узлы
+дерева и таблица декодирования вычисляются constexpr-функциями и лежат в .rodata:
+во время работы ничего не строится и не читается из файла.
+
+N - размер алфавита (символы 0..N-1), MAX_LENGTH - наибольшая длина кода.
+*/
+template<std::size_t N, int MAX_LENGTH>
+struct StaticCode{
+    static_assert(N >= 2 && N <= (1 << 15), "alphabet must have from 2 to 2^15 symbols");
+    static_assert(MAX_LENGTH >= 1 && MAX_LENGTH <= 32, "codes must fit into 32 bits");
+
+    // Узел дерева в том же виде, что и в HuffmanTree: листья в начале, корень последний
+    struct Node{
+        uint16_t i0 = (uint16_t)-1;
+        uint16_t i1 = (uint16_t)-1;
+        uint16_t ip = (uint16_t)-1;
+        bool v = false;
+        uint16_t symb = 0;
+    };
+
+    /*
+    Элемент таблицы декодирования, как у HuffmanTree: индекс - следующие DECODE_BITS
+    бит потока (первый бит - младший), node - узел, в который они приводят, len -
+    сколько бит для этого нужно. Если node не лист, код длиннее таблицы.
+    */
+    struct DecodeEntry{
+        uint16_t node = 0;
+        uint8_t len = 0;
+    };
+    static constexpr int DECODE_BITS = MAX_LENGTH < 11 ? MAX_LENGTH : 11;
+
+    std::array<uint8_t, N> length{};        // длина кода символа, 0 - у символа нет кода
+    std::array<uint32_t, N> code{};         // код символа, первый бит - старший
+    std::array<uint32_t, N> stream_code{};  // тот же код в порядке записи: первый бит - младший
+    std::array<Node, 2 * N - 1> nodes{};
+    std::array<DecodeEntry, std::size_t(1) << DECODE_BITS> decode_table{};
+    uint16_t root = 0;
+
+    // Кодирует один символ
+    void encode(uint16_t symb, bit_oseq& dst) const{
+        if(symb >= N || length[symb] == 0)
+            throw HuffmanException("symbol '" + std::to_string(symb) + "' does not exist in the static code");
+        for(int k = length[symb] - 1; k >= 0; k--)
+            dst.write((code[symb] >> k) & 1);
+    }
+
+    // Декодирует один символ
+    uint16_t decode(bit_iseq& src) const{
+        uint16_t i = root;
+        while(nodes[i].i0 != (uint16_t)-1)
+            i = src.read() ? nodes[i].i1 : nodes[i].i0;
+        return nodes[i].symb;
+    }
+
+    /*
+    Кодирует поток байтов src, для алфавита из 256 символов. Коды копятся в 64-битном
+    накопителе и выходят по 4 байта, а порции по 64 КиБ уходят в bit_oseq целыми байтами.
+    */
+    void encode(std::istream& src, std::ostream& dst) const{
+        static_assert(N == 256, "byte streams need a 256-symbol alphabet");
+        constexpr std::size_t CHUNK = 1 << 16;
+        bit_oseq bit_seq_dst(dst);
+        std::vector<byte_t> out;
+        out.reserve(CHUNK + 4);
+        uint64_t acc = 0;
+        int nbits = 0;
+        char chunk[CHUNK];
+        while(src){
+            src.read(chunk, sizeof(chunk));
+            const std::size_t n = src.gcount();
+            for(std::size_t i = 0; i < n; i++){
+                const byte_t symb = chunk[i];
+                if(length[symb] == 0)
+                    throw HuffmanException("symbol '" + std::to_string(symb) + "' does not exist in the static code");
+                acc |= uint64_t(stream_code[symb]) << nbits;
+                nbits += length[symb];
+                if(nbits >= 32){
+                    for(int k = 0; k < 4; k++)
+                        out.push_back(acc >> (8 * k));
+                    acc >>= 32;
+                    nbits -= 32;
+                }
+            }
+            bit_seq_dst.write_bytes(out.data(), out.size());
+            out.clear();
+        }
+        src.clear();
+        for(int k = 0; k < nbits; k++)
+            bit_seq_dst.write((acc >> k) & 1);
+    }
+
+    /*
+    Декодирует поток, записанный encode: код длиной до DECODE_BITS - одним
+    обращением к таблице по 64-битному чтению, остаток длинного кода - побитово.
+    */
+    void decode(std::istream& src, std::ostream& dst) const{
+        static_assert(N == 256, "byte streams need a 256-symbol alphabet");
+        std::vector<byte_t> data;
+        std::size_t size;
+        if(read_bit_seq(src, data, size) != decode_status::ok)
+            throw HuffmanException("data format error");
+        // 8 байт запаса: 64-битное чтение с любого байта данных не выходит за буфер
+        data.resize(data.size() + sizeof(uint64_t), 0);
+
+        constexpr uint64_t mask = (uint64_t(1) << DECODE_BITS) - 1;
+        constexpr std::size_t CHUNK = 1 << 16;
+        char out[CHUNK];
+        std::size_t k = 0;
+        std::size_t pos = 0;
+        while(pos < size){
+            uint64_t word;
+            std::memcpy(&word, data.data() + (pos >> 3), sizeof(word));
+            const DecodeEntry e = decode_table[(word >> (pos & 7)) & mask];
+            uint16_t i = e.node;
+            pos += e.len;
+            for(; nodes[i].i0 != (uint16_t)-1 && pos < size; pos++)
+                i = (data[pos >> 3] >> (pos & 7)) & 1 ? nodes[i].i1 : nodes[i].i0;
+            if(pos > size || nodes[i].i0 != (uint16_t)-1)
+                throw HuffmanException("data format error");
+            out[k++] = (char)nodes[i].symb;
+            if(k == CHUNK){
+                dst.write(out, k);
+                k = 0;
+            }
+        }
+        dst.write(out, k);
+    }
+};
+
+
+/*
+Длины кодов Хаффмана для частот freq, не длиннее max_length.
+Если обычное дерево получается глубже, частоты сглаживаются (f / 2 + 1)
+и дерево строится заново, пока глубина не уложится в предел.
+Символы с нулевой частотой кода не получают.
+*/
+template<std::size_t N>
+constexpr std::array<uint8_t, N> huffman_code_lengths(std::array<uint64_t, N> freq, int max_length){
+    while(true){
+        std::array<uint64_t, 2 * N> weight{};
+        std::array<std::size_t, 2 * N> parent{};
+        std::array<bool, 2 * N> active{};
+        std::size_t count = 0;
+        for(std::size_t s = 0; s < N; s++){
+            weight[s] = freq[s];
+            active[s] = freq[s] != 0;
+            count += active[s];
+        }
+        if(count < 2)
+            throw "static code needs at least two symbols";
+
+        // Квадратичный алгоритм: при компиляции простота важнее скорости
+        std::size_t next = N;
+        for(; count > 1; count--){
+            std::size_t a = 2 * N, b = 2 * N;
+            for(std::size_t i = 0; i < next; i++){
+                if(!active[i])
+                    continue;
+                if(a == 2 * N || weight[i] < weight[a]){
+                    b = a;
+                    a = i;
+                }
+                else if(b == 2 * N || weight[i] < weight[b]){
+                    b = i;
+                }
+            }
+            active[a] = active[b] = false;
+            weight[next] = weight[a] + weight[b];
+            parent[a] = parent[b] = next;
+            active[next] = true;
+            next++;
+        }
+
+        std::array<uint8_t, N> length{};
+        int longest = 0;
+        for(std::size_t s = 0; s < N; s++){
+            if(freq[s] == 0)
+                continue;
+            int depth = 0;
+            for(std::size_t i = s; i != next - 1; i = parent[i])
+                depth++;
+            length[s] = depth;
+            longest = depth > longest ? depth : longest;
+        }
+        if(longest <= max_length)
+            return length;
+        for(std::size_t s = 0; s < N; s++)
+            if(freq[s] != 0)
+                freq[s] = freq[s] / 2 + 1;
+    }
+}
+
+
+/*
+Строит канонический код по длинам: коды одной длины идут подряд в порядке символов.
+Дерево собирается снизу вверх: на каждом уровне сначала листья этой длины,
+затем внутренние узлы, созданные из пар узлов уровнем ниже.
+Длины должны задавать полный префиксный код (равенство Крафта).
+*/
+template<std::size_t N, int MAX_LENGTH>
+constexpr StaticCode<N, MAX_LENGTH> make_static_code(const std::array<uint8_t, N>& length){
+    StaticCode<N, MAX_LENGTH> res{};
+    res.length = length;
+
+    std::array<uint32_t, MAX_LENGTH + 1> bl_count{};
+    std::size_t leaves = 0;
+    for(std::size_t s = 0; s < N; s++){
+        if(length[s] > MAX_LENGTH)
+            throw "code length exceeds MAX_LENGTH";
+        if(length[s] != 0){
+            bl_count[length[s]]++;
+            leaves++;
+        }
+    }
+    if(leaves < 2)
+        throw "static code needs at least two symbols";
+
+    std::array<uint32_t, MAX_LENGTH + 2> next_code{};
+    uint64_t value = 0;
+    for(int len = 1; len <= MAX_LENGTH; len++){
+        value = (value + bl_count[len - 1]) << 1;
+        next_code[len] = value;
+    }
+    for(std::size_t s = 0; s < N; s++)
+        if(length[s] != 0)
+            res.code[s] = next_code[length[s]]++;
+
+    // Листья получают индексы 0..leaves-1, внутренние узлы - по мере создания
+    std::size_t leaf = 0;
+    std::size_t inner = leaves;
+    std::array<uint16_t, N> level{};      // узлы текущего уровня в порядке кодов
+    std::array<uint16_t, N> lower{};      // узлы уровня ниже
+    std::size_t lower_size = 0;
+    for(int len = MAX_LENGTH; len >= 1; len--){
+        std::size_t level_size = 0;
+        for(std::size_t s = 0; s < N; s++){
+            if(length[s] != len)
+                continue;
+            res.nodes[leaf].symb = s;
+            level[level_size++] = leaf++;
+        }
+        if(lower_size % 2 != 0)
+            throw "code lengths do not form a complete prefix code";
+        for(std::size_t i = 0; i < lower_size; i += 2){
+            auto& node = res.nodes[inner];
+            node.i0 = lower[i];
+            node.i1 = lower[i + 1];
+            res.nodes[lower[i]].ip = inner;
+            res.nodes[lower[i]].v = 0;
+            res.nodes[lower[i + 1]].ip = inner;
+            res.nodes[lower[i + 1]].v = 1;
+            level[level_size++] = inner++;
+        }
+        lower = level;
+        lower_size = level_size;
+    }
+    if(lower_size != 2 || inner != 2 * leaves - 2)
+        throw "code lengths do not form a complete prefix code";
+    auto& root = res.nodes[inner];
+    root.i0 = lower[0];
+    root.i1 = lower[1];
+    res.nodes[lower[0]].ip = inner;
+    res.nodes[lower[0]].v = 0;
+    res.nodes[lower[1]].ip = inner;
+    res.nodes[lower[1]].v = 1;
+    res.root = inner;
+
+    for(std::size_t s = 0; s < N; s++)
+        for(int k = 0; k < length[s]; k++)
+            res.stream_code[s] |= ((res.code[s] >> (length[s] - 1 - k)) & 1) << k;
+
+    for(std::size_t index = 0; index < res.decode_table.size(); index++){
+        uint16_t i = res.root;
+        int len = 0;
+        while(len < res.DECODE_BITS && res.nodes[i].i0 != (uint16_t)-1){
+            i = (index >> len) & 1 ? res.nodes[i].i1 : res.nodes[i].i0;
+            len++;
+        }
+        res.decode_table[index] = {i, (uint8_t)len};
+    }
+    return res;
+}
+
+
+// Канонический код по частотам символов
+template<std::size_t N, int MAX_LENGTH>
+constexpr StaticCode<N, MAX_LENGTH> make_static_code(const std::array<uint64_t, N>& freq){
+    return make_static_code<N, MAX_LENGTH>(huffman_code_lengths<N>(freq, MAX_LENGTH));
+}
+
+
+/*
+Примерные частоты байтов в английском тексте и логах. Код есть у всех 256 байтов,
+поэтому встроенным кодом можно сжать любые данные, но выгоден он только для текста.
+*/
+constexpr std::array<uint64_t, 256> text_frequencies(){
+    std::array<uint64_t, 256> freq{};
+    for(int s = 0; s < 256; s++)
+        freq[s] = 1;
+    for(int s = 0x20; s < 0x7f; s++)
+        freq[s] = 40;  // знаки препинания и прочие печатные символы
+    const char* letters = "etaoinshrdlcumwfgypbvkjxqz";
+    const uint64_t letter_freq[] = {
+        1270, 906, 817, 751, 697, 675, 633, 609, 599, 425, 403, 278, 276,
+        241, 236, 223, 202, 197, 193, 149, 98, 77, 15, 15, 10, 7,
+    };
+    for(int i = 0; i < 26; i++){
+        freq[(byte_t)letters[i]] = letter_freq[i];
+        freq[(byte_t)letters[i] - 'a' + 'A'] = letter_freq[i] / 8 + 1;
+    }
+    for(int s = '0'; s <= '9'; s++)
+        freq[s] = 150;
+    freq[' '] = 1900;
+    freq['\n'] = 200;
+    freq['.'] = 120;
+    freq[','] = 110;
+    return freq;
+}
+
+// Встроенный код для текста
+inline constexpr StaticCode<256, 15> text_code = make_static_code<256, 15>(text_frequencies());
+
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace Huffman{
+
+/*
+Пул потоков с перехватом работы. У каждого потока своя очередь: свои задачи
+он берёт с конца (последние добавленные, их данные ещё в кэше), а когда они
+кончаются, забирает задачи с начала чужих очередей. Задачи извне раскладываются
+по очередям по кругу, задачи из рабочего потока попадают в его очередь.
+Исключение задачи сохраняется и пробрасывается из wait.
+*/
+class ThreadPool{
+public:
+    explicit ThreadPool(int threads = 0);
+    ~ThreadPool();
+
+    void submit(std::function<void()> task);
+
+    // Ждёт выполнения всех поставленных задач
+    void wait();
+
+    int size() const { return workers.size(); }
+
+private:
+    struct Queue{
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    void run(int index);
+    bool try_pop(int index, std::function<void()>& task);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<std::size_t> next_queue{0};
+    std::size_t queued = 0;      // задач в очередях, под idle_mutex
+    std::size_t unfinished = 0;  // поставленных и ещё не выполненных задач, под idle_mutex
+    bool stop = false;
+    std::exception_ptr error;
+    std::mutex idle_mutex;
+    std::condition_variable idle;
+    std::condition_variable done;
+};
+
+}
@@ -0,0 +1,172 @@
+#include "adaptive.h"
+
+using namespace Huffman;
+
+
+
+AdaptiveHuffmanTree::AdaptiveHuffmanTree(){
+    nodes.resize(MAX_NODES);
+    nyt = MAX_NODES - 1;
+    nodes[nyt] = {
+        .i0 = (uint16_t)-1,
+        .i1 = (uint16_t)-1,
+        .ip = (uint16_t)-1,
+        .v = 0,
+        .symb = 0,
+        .weight = 0,
+    };
+    for(int i = 0; i < 256; i++)
+        leaves[i] = (uint16_t)-1;
+}
+
+
+void AdaptiveHuffmanTree::encode(char symb, bit_oseq& dst){
+    uint16_t leaf = leaves[(byte_t)symb];
+    if(leaf == (uint16_t)-1){
+        write_code(nyt, dst);
+        for(int k = 7; k >= 0; k--)
+            dst.write(((byte_t)symb >> k) & 1);
+        leaf = add_symbol(symb);
+    }
+    else{
+        write_code(leaf, dst);
+    }
+    update(leaf);
+}
+
+
+char AdaptiveHuffmanTree::decode(bit_iseq& src){
+    uint16_t i = MAX_NODES - 1;
+    while(!nodes[i].is_leaf())
+        i = src.read() ? nodes[i].i1 : nodes[i].i0;
+    if(i == nyt){
+        byte_t b = 0;
+        for(int k = 0; k < 8; k++)
+            b = (b << 1) | src.read();
+        if(leaves[b] != (uint16_t)-1)
+            throw HuffmanException("data format error");
+        i = add_symbol((char)b);
+    }
+    char symb = nodes[i].symb;
+    update(i);
+    return symb;
+}
+
+
+void AdaptiveHuffmanTree::encode(std::istream& src, std::ostream& dst){
+    bit_oseq bit_seq_dst(dst);
+    while(true){
+        // Если следующего символа придётся ждать (канал, живой поток), декодер получает всё закодированное до него
+        if(src.rdbuf()->in_avail() == 0)
+            bit_seq_dst.sync();
+        char symb = src.get();
+        if(!src.good()){
+            src.clear();
+            break;
+        }
+        encode(symb, bit_seq_dst);
+    }
+}
+
+
+void AdaptiveHuffmanTree::decode(std::istream& src, std::ostream& dst){
+    try{
+        bit_iseq bit_seq_src(src);
+        while(!bit_seq_src.end_of_seq()){
+            char symb = decode(bit_seq_src);
+            dst.write(&symb, 1);
+        }
+    }
+    catch(const HuffmanException&){
+        throw;
+    }
+    catch(...){
+        throw HuffmanException("data format error");
+    }
+}
+
+
+void AdaptiveHuffmanTree::write_code(uint16_t node, bit_oseq& dst){
+    bool arr[MAX_NODES];
+    int j = 0;
+    while(nodes[node].ip != (uint16_t)-1){
+        arr[j] = nodes[node].v;
+        node = nodes[node].ip;
+        j++;
+    }
+    while(j > 0){
+        j--;
+        dst.write(arr[j]);
+    }
+}
+
+
+uint16_t AdaptiveHuffmanTree::add_symbol(char symb){
+    // Бывший NYT становится внутренним узлом: слева новый NYT, справа новый лист
+    uint16_t parent = nyt;
+    uint16_t leaf = nyt - 1;
+    nyt = nyt - 2;
+    nodes[nyt] = {
+        .i0 = (uint16_t)-1,
+        .i1 = (uint16_t)-1,
+        .ip = parent,
+        .v = 0,
+        .symb = 0,
+        .weight = 0,
+    };
+    nodes[leaf] = {
+        .i0 = (uint16_t)-1,
+        .i1 = (uint16_t)-1,
+        .ip = parent,
+        .v = 1,
+        .symb = symb,
+        .weight = 0,
+    };
+    nodes[parent].i0 = nyt;
+    nodes[parent].i1 = leaf;
+    leaves[(byte_t)symb] = leaf;
+    return leaf;
+}
+
+
+void AdaptiveHuffmanTree::update(uint16_t node){
+    while(node != MAX_NODES - 1){
+        // Старший узел блока - узел с наибольшим индексом среди узлов того же веса
+        uint16_t leader = node;
+        while(leader + 1 < MAX_NODES - 1 && nodes[leader + 1].weight == nodes[node].weight)
+            leader++;
+        if(leader != node && leader != nodes[node].ip){
+            swap_nodes(node, leader);
+            node = leader;
+        }
+        nodes[node].weight += 1;
+        node = nodes[node].ip;
+    }
+    nodes[node].weight += 1;
+}
+
+
+void AdaptiveHuffmanTree::swap_nodes(uint16_t a, uint16_t b){
+    // Позиция в дереве (ip и v) остаётся за индексом, переезжает только содержимое
+    Node& na = nodes[a];
+    Node& nb = nodes[b];
+    std::swap(na.i0, nb.i0);
+    std::swap(na.i1, nb.i1);
+    std::swap(na.symb, nb.symb);
+    std::swap(na.weight, nb.weight);
+    for(uint16_t i : {a, b}){
+        Node& n = nodes[i];
+        if(n.is_leaf()){
+            leaves[(byte_t)n.symb] = i;
+        }
+        else{
+            nodes[n.i0].ip = i;
+            nodes[n.i1].ip = i;
+        }
+    }
+}
+
+
+bool AdaptiveHuffmanTree::Node::is_leaf() const{
+    return i0 == (uint16_t)-1 && i1 == (uint16_t)-1;
+}
@@ -0,0 +1,199 @@
+#include "archive.h"
+#include "checksum.h"
+#include <cstring>
+#include <sstream>
+
+using namespace Huffman;
+
+
+
+static const char ARCHIVE_MAGIC[4] = {'H', 'U', 'F', 'A'};
+static const byte_t ARCHIVE_VERSION = 1;
+
+// Хвост архива: смещение и размер каталога, CRC-32 каталога, сигнатура
+struct ArchiveTrailer{
+    uint64_t directory_offset;
+    uint64_t directory_size;
+    uint32_t directory_crc;
+    char magic[4];
+};
+static_assert(sizeof(ArchiveTrailer) == 24, "trailer layout is a part of the format");
+
+
+template<class T>
+static void put(std::string& dst, T value){
+    dst.append((const char*)&value, sizeof(value));
+}
+
+template<class T>
+static T get(const std::string& src, std::size_t& pos){
+    if(pos + sizeof(T) > src.size())
+        throw HuffmanException("archive directory is damaged");
+    T value;
+    std::memcpy(&value, src.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+}
+
+
+
+ArchiveWriter::ArchiveWriter(std::ostream& dst): dst(dst){
+    dst.write(ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+    dst.put(ARCHIVE_VERSION);
+    offset = sizeof(ARCHIVE_MAGIC) + 1;
+}
+
+
+ArchiveWriter::~ArchiveWriter(){
+    try{
+        close();
+    }
+    catch(...){}
+}
+
+
+std::size_t ArchiveWriter::add(const std::string& name, std::istream& src, const encode_options& opt){
+    if(closed)
+        throw HuffmanException("archive is already closed");
+    if(name.size() > UINT16_MAX)
+        throw HuffmanException("member name is too long: " + name);
+
+    ArchiveEntry entry;
+    entry.name = name;
+    entry.offset = offset;
+
+    // Контрольная сумма исходных данных - отдельным проходом, encode сам читает поток не один раз
+    const std::streampos begin = src.tellg();
+    char buffer[1 << 16];
+    while(src){
+        src.read(buffer, sizeof(buffer));
+        entry.raw_crc = crc32(buffer, src.gcount(), entry.raw_crc);
+        entry.raw_size += src.gcount();
+    }
+    src.clear();
+    src.seekg(begin);
+
+    crc_ostreambuf packed(dst.rdbuf());
+    std::ostream packed_dst(&packed);
+    std::size_t additional_size = encode(src, packed_dst, opt);
+    if(!packed_dst.good() || !dst.good())
+        throw HuffmanException("can't write output file");
+    entry.packed_size = packed.size();
+    entry.packed_crc = packed.crc();
+    offset += entry.packed_size;
+    _entries.push_back(entry);
+    return additional_size;
+}
+
+
+std::size_t ArchiveWriter::close(){
+    if(closed)
+        return 0;
+    closed = true;
+
+    std::string directory;
+    put<uint32_t>(directory, _entries.size());
+    for(const auto& e : _entries){
+        put<uint16_t>(directory, e.name.size());
+        directory += e.name;
+        put(directory, e.offset);
+        put(directory, e.packed_size);
+        put(directory, e.raw_size);
+        put(directory, e.packed_crc);
+        put(directory, e.raw_crc);
+    }
+    ArchiveTrailer trailer{offset, directory.size(), crc32(directory.data(), directory.size()), {}};
+    std::memcpy(trailer.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+    dst.write(directory.data(), directory.size());
+    dst.write((const char*)&trailer, sizeof(trailer));
+    dst.flush();
+    if(!dst.good())
+        throw HuffmanException("can't write output file");
+    return sizeof(ARCHIVE_MAGIC) + 1 + directory.size() + sizeof(trailer);
+}
+
+
+
+ArchiveReader::ArchiveReader(std::istream& src): src(src){
+    char header[sizeof(ARCHIVE_MAGIC) + 1];
+    src.seekg(0, src.beg);
+    src.read(header, sizeof(header));
+    if(!src.good() || std::memcmp(header, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0)
+        throw HuffmanException("not an archive");
+    if((byte_t)header[sizeof(ARCHIVE_MAGIC)] != ARCHIVE_VERSION)
+        throw HuffmanException("unsupported archive version");
+
+    src.seekg(0, src.end);
+    const uint64_t archive_size = src.tellg();
+    ArchiveTrailer trailer;
+    if(archive_size < sizeof(header) + sizeof(trailer))
+        throw HuffmanException("archive is truncated");
+    src.seekg(archive_size - sizeof(trailer));
+    src.read((char*)&trailer, sizeof(trailer));
+    if(!src.good() || std::memcmp(trailer.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0)
+        throw HuffmanException("archive is truncated");
+    if(trailer.directory_offset < sizeof(header) || trailer.directory_size != archive_size - sizeof(trailer) - trailer.directory_offset)
+        throw HuffmanException("archive directory is damaged");
+
+    std::string directory(trailer.directory_size, 0);
+    src.seekg(trailer.directory_offset);
+    src.read(&directory[0], directory.size());
+    if(!src.good() || crc32(directory.data(), directory.size()) != trailer.directory_crc)
+        throw HuffmanException("archive directory is damaged");
+
+    std::size_t pos = 0;
+    uint32_t count = get<uint32_t>(directory, pos);
+    for(uint32_t i = 0; i < count; i++){
+        ArchiveEntry e;
+        uint16_t name_size = get<uint16_t>(directory, pos);
+        if(pos + name_size > directory.size())
+            throw HuffmanException("archive directory is damaged");
+        e.name = directory.substr(pos, name_size);
+        pos += name_size;
+        e.offset = get<uint64_t>(directory, pos);
+        e.packed_size = get<uint64_t>(directory, pos);
+        e.raw_size = get<uint64_t>(directory, pos);
+        e.packed_crc = get<uint32_t>(directory, pos);
+        e.raw_crc = get<uint32_t>(directory, pos);
+        // Смещение проверяется до вычитания, иначе разность переполнится и пропустит любой размер
+        if(e.offset < sizeof(header) || e.offset > trailer.directory_offset || e.packed_size > trailer.directory_offset - e.offset)
+            throw HuffmanException("archive directory is damaged");
+        index[e.name] = _entries.size();
+        _entries.push_back(e);
+    }
+    directory_size = sizeof(header) + directory.size() + sizeof(trailer);
+}
+
+
+const ArchiveEntry* ArchiveReader::find(const std::string& name) const{
+    auto it = index.find(name);
+    return it == index.end() ? nullptr : &_entries[it->second];
+}
+
+
+std::size_t ArchiveReader::extract(const ArchiveEntry& entry, std::ostream& dst, int threads){
+    std::string packed(entry.packed_size, 0);
+    src.clear();
+    src.seekg(entry.offset);
+    src.read(&packed[0], packed.size());
+    if(!src.good())
+        throw HuffmanException("archive is truncated");
+    if(crc32(packed.data(), packed.size()) != entry.packed_crc)
+        throw HuffmanException("checksum mismatch in member " + entry.name);
+
+    std::stringstream packed_src(packed);
+    crc_ostreambuf raw(dst.rdbuf());
+    std::ostream raw_dst(&raw);
+    std::size_t additional_size = decode(packed_src, raw_dst, threads);
+    if(raw.size() != entry.raw_size || raw.crc() != entry.raw_crc)
+        throw HuffmanException("checksum mismatch in member " + entry.name);
+    return additional_size;
+}
+
+
+std::size_t ArchiveReader::extract(const std::string& name, std::ostream& dst, int threads){
+    const ArchiveEntry* entry = find(name);
+    if(entry == nullptr)
+        throw HuffmanException("no such member in the archive: " + name);
+    return extract(*entry, dst, threads);
+}
@@ -0,0 +1,154 @@
+#include "batch.h"
+#include "thread_pool.h"
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+
+#include <glob.h>
+
+using namespace Huffman;
+
+
+
+std::string Huffman::safe_relative_path(const std::string& path){
+    std::string name = std::filesystem::path(path).relative_path().lexically_normal().string();
+    // Выход за каталог через ".." не допускается
+    while(name.rfind("../", 0) == 0)
+        name = name.substr(3);
+    if(name == "..")
+        name.clear();
+    return name;
+}
+
+
+std::string Huffman::batch_output_path(const std::string& path, const std::string& output_dir, bool decode){
+    std::string name = safe_relative_path(path);
+    if(!decode)
+        name += ".huf";
+    else if(name.size() > 4 && name.compare(name.size() - 4, 4, ".huf") == 0)
+        name.resize(name.size() - 4);
+    else
+        name += ".out";
+    return (std::filesystem::path(output_dir) / name).string();
+}
+
+
+std::vector<std::string> Huffman::read_path_list(std::istream& src){
+    std::vector<std::string> paths;
+    std::string line;
+    while(std::getline(src, line)){
+        if(!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if(!line.empty())
+            paths.push_back(line);
+    }
+    return paths;
+}
+
+
+std::vector<std::string> Huffman::expand_glob(const std::string& pattern){
+    std::vector<std::string> paths;
+    glob_t g;
+    if(glob(pattern.c_str(), 0, nullptr, &g) == 0)
+        for(std::size_t i = 0; i < g.gl_pathc; i++)
+            paths.push_back(g.gl_pathv[i]);
+    globfree(&g);
+    return paths;
+}
+
+
+// Сжимает или разжимает один файл, результат и ошибки записывает в res под mutex
+static void process_file(const std::string& path, const batch_options& opt, batch_result& res, std::mutex& mutex){
+    try{
+        std::string output_path = batch_output_path(path, opt.output_dir, opt.decode);
+        std::ifstream in(path, std::ios::binary);
+        if(!in)
+            throw HuffmanException("source file does not exist");
+        std::filesystem::path dir = std::filesystem::path(output_path).parent_path();
+        if(!dir.empty())
+            std::filesystem::create_directories(dir);
+        std::ofstream out(output_path, std::ios::binary);
+        if(!out)
+            throw HuffmanException("can't create output file");
+
+        encode_options options = opt.options;
+        options.threads = 1;
+        std::size_t additional_size = opt.decode ? decode_file(in, out, 1) : encode_file(in, out, options);
+        out.close();
+        if(!out)
+            throw HuffmanException("can't write output file");
+
+        std::lock_guard<std::mutex> lock(mutex);
+        res.files++;
+        res.size_in += std::filesystem::file_size(path);
+        res.size_out += std::filesystem::file_size(output_path);
+        res.additional_size += additional_size;
+    }
+    catch(const HuffmanException& e){
+        std::lock_guard<std::mutex> lock(mutex);
+        res.errors.push_back({path, e.message});
+    }
+    catch(const std::exception& e){
+        std::lock_guard<std::mutex> lock(mutex);
+        res.errors.push_back({path, e.what()});
+    }
+}
+
+
+batch_result Huffman::run_batch(const std::vector<std::string>& paths, const batch_options& opt){
+    batch_result res;
+
+    /*
+    Разные пути могут дать один результат: у "/x/a", "x/a" и "../x/a" отбрасываются
+    корень и "..". Такие файлы попали бы в разные задачи и писали бы один файл
+    одновременно, поэтому обрабатывается только первый, остальные - ошибки
+    */
+    std::map<std::string, std::string> outputs;  // путь результата -> исходный файл
+    std::vector<std::string> unique_paths;
+    for(const auto& path : paths){
+        const std::string output = std::filesystem::path(batch_output_path(path, opt.output_dir, opt.decode)).lexically_normal().string();
+        auto [it, inserted] = outputs.emplace(output, path);
+        if(inserted)
+            unique_paths.push_back(path);
+        else
+            res.errors.push_back({path, "output file " + output + " is also the result of " + it->second});
+    }
+
+    // Большие файлы - первыми, чтобы в конце пул доедал мелкие задачи, а не ждал одну большую
+    std::vector<std::pair<std::size_t, std::string>> files;
+    for(const auto& path : unique_paths){
+        std::error_code ec;
+        std::size_t size = std::filesystem::file_size(path, ec);
+        files.push_back({ec ? 0 : size, path});
+    }
+    std::stable_sort(files.begin(), files.end(), [](const auto& a, const auto& b){ return a.first > b.first; });
+
+    std::mutex mutex;
+    ThreadPool pool(opt.threads);
+    std::vector<std::string> pack;
+    std::size_t pack_bytes = 0;
+    auto submit_pack = [&](){
+        if(pack.empty())
+            return;
+        pool.submit([&, pack = std::move(pack)](){
+            for(const auto& path : pack)
+                process_file(path, opt, res, mutex);
+        });
+        pack.clear();
+        pack_bytes = 0;
+    };
+    for(const auto& [size, path] : files){
+        if(size >= opt.pack_size){
+            pool.submit([&, path = path](){ process_file(path, opt, res, mutex); });
+            continue;
+        }
+        pack.push_back(path);
+        pack_bytes += size + 4096;  // у пустых и крошечных файлов основное время - открытие
+        if(pack_bytes >= opt.pack_size)
+            submit_pack();
+    }
+    submit_pack();
+    pool.wait();
+    return res;
+}
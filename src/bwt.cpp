@@ -0,0 +1,459 @@
+#include "bwt.h"
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+using namespace Huffman;
+
+
+
+/*
+SA-IS (Nong, Zhang, Chan). s - строка длины n над алфавитом [0, K),
+последний символ - единственный наименьший (ограничитель).
+Сначала сортируются LMS-подстроки, затем по их рангам рекурсивно строится
+суффиксный массив сокращённой строки, и по нему индуцируются все суффиксы.
+*/
+static void sais(const int32_t* s, int32_t* sa, int32_t n, int32_t K){
+    std::vector<bool> t(n);  // true - суффикс S-типа
+    t[n - 1] = true;
+    for(int32_t i = n - 2; i >= 0; i--)
+        t[i] = s[i] < s[i + 1] || (s[i] == s[i + 1] && t[i + 1]);
+    auto is_lms = [&](int32_t i){ return i > 0 && t[i] && !t[i - 1]; };
+
+    std::vector<int32_t> bkt(K);
+    auto get_buckets = [&](bool end){
+        std::fill(bkt.begin(), bkt.end(), 0);
+        for(int32_t i = 0; i < n; i++)
+            bkt[s[i]] += 1;
+        int32_t sum = 0;
+        for(int32_t c = 0; c < K; c++){
+            sum += bkt[c];
+            bkt[c] = end ? sum : sum - bkt[c];
+        }
+    };
+    auto induce = [&](){
+        get_buckets(false);
+        for(int32_t i = 0; i < n; i++){
+            int32_t j = sa[i] - 1;
+            if(sa[i] > 0 && !t[j])
+                sa[bkt[s[j]]++] = j;
+        }
+        get_buckets(true);
+        for(int32_t i = n - 1; i >= 0; i--){
+            int32_t j = sa[i] - 1;
+            if(sa[i] > 0 && t[j])
+                sa[--bkt[s[j]]] = j;
+        }
+    };
+
+    // Сортировка LMS-подстрок
+    get_buckets(true);
+    std::fill(sa, sa + n, -1);
+    for(int32_t i = 1; i < n; i++)
+        if(is_lms(i))
+            sa[--bkt[s[i]]] = i;
+    induce();
+
+    int32_t n1 = 0;
+    for(int32_t i = 0; i < n; i++)
+        if(is_lms(sa[i]))
+            sa[n1++] = sa[i];
+
+    // Ранги LMS-подстрок
+    std::fill(sa + n1, sa + n, -1);
+    int32_t name = 0;
+    int32_t prev = -1;
+    for(int32_t i = 0; i < n1; i++){
+        int32_t pos = sa[i];
+        bool diff = false;
+        for(int32_t d = 0; d < n; d++){
+            if(prev == -1 || s[pos + d] != s[prev + d] || t[pos + d] != t[prev + d]){
+                diff = true;
+                break;
+            }
+            if(d > 0 && (is_lms(pos + d) || is_lms(prev + d)))
+                break;
+        }
+        if(diff){
+            name += 1;
+            prev = pos;
+        }
+        sa[n1 + pos / 2] = name - 1;
+    }
+    for(int32_t i = n - 1, j = n - 1; i >= n1; i--)
+        if(sa[i] >= 0)
+            sa[j--] = sa[i];
+
+    // Суффиксный массив сокращённой строки
+    int32_t* s1 = sa + n - n1;
+    int32_t* sa1 = sa;
+    if(name < n1)
+        sais(s1, sa1, n1, name);
+    else
+        for(int32_t i = 0; i < n1; i++)
+            sa1[s1[i]] = i;
+
+    // Индуцирование суффиксного массива из отсортированных LMS-суффиксов
+    get_buckets(true);
+    for(int32_t i = 1, j = 0; i < n; i++)
+        if(is_lms(i))
+            s1[j++] = i;
+    for(int32_t i = 0; i < n1; i++)
+        sa1[i] = s1[sa1[i]];
+    std::fill(sa + n1, sa + n, -1);
+    for(int32_t i = n1 - 1; i >= 0; i--){
+        int32_t j = sa[i];
+        sa[i] = -1;
+        sa[--bkt[s[j]]] = j;
+    }
+    induce();
+}
+
+
+std::vector<int32_t> Huffman::suffix_array(const byte_t* s, std::size_t n){
+    // Байты сдвигаются на 1, в конец добавляется ограничитель 0; его суффикс в ответ не входит
+    std::vector<int32_t> str(n + 1);
+    for(std::size_t i = 0; i < n; i++)
+        str[i] = s[i] + 1;
+    str[n] = 0;
+    std::vector<int32_t> sa(n + 1);
+    sais(str.data(), sa.data(), n + 1, 257);
+    return std::vector<int32_t>(sa.begin() + 1, sa.end());
+}
+
+
+std::string Huffman::bwt_forward(const std::string& block, uint32_t& primary){
+    std::vector<int32_t> sa = suffix_array((const byte_t*)block.data(), block.size());
+    // Строки - суффиксы block + '$'. Первая строка "$" в sa не входит, её последний символ - block.back()
+    std::string last;
+    last.reserve(block.size());
+    primary = 0;
+    if(!block.empty())
+        last.push_back(block.back());
+    for(std::size_t i = 0; i < sa.size(); i++){
+        if(sa[i] == 0)
+            primary = i + 1;  // в этой строке последний символ - '$', он не записывается
+        else
+            last.push_back(block[sa[i] - 1]);
+    }
+    return last;
+}
+
+
+std::string Huffman::bwt_inverse(const std::string& last, uint32_t primary){
+    const std::size_t n = last.size();
+    if(n == 0)
+        return "";
+    if(primary == 0 || primary > n)
+        throw HuffmanException("data format error");
+
+    // Строка i столбца L (с учётом '$' в строке primary) переходит в строку lf[i]
+    std::size_t count[257] = {};
+    for(char c : last)
+        count[(byte_t)c + 1] += 1;
+    std::size_t start[257];
+    std::size_t sum = 1;  // строка 0 начинается с '$'
+    for(int c = 0; c < 257; c++){
+        start[c] = sum;
+        sum += count[c];
+    }
+    std::vector<uint32_t> lf(n + 1);
+    for(std::size_t i = 0; i <= n; i++){
+        if(i == primary){
+            lf[i] = 0;
+            continue;
+        }
+        byte_t c = last[i - (i > primary)];
+        lf[i] = start[c + 1]++;
+    }
+
+    std::string res(n, 0);
+    std::size_t row = 0;
+    for(std::size_t k = n; k-- > 0;){
+        if(row == primary)
+            throw HuffmanException("data format error");
+        res[k] = last[row - (row > primary)];
+        row = lf[row];
+    }
+    return res;
+}
+
+
+std::string Huffman::mtf_encode(const std::string& data){
+    byte_t order[256];
+    for(int i = 0; i < 256; i++)
+        order[i] = i;
+    std::string res(data.size(), 0);
+    for(std::size_t i = 0; i < data.size(); i++){
+        byte_t c = data[i];
+        int j = 0;
+        while(order[j] != c)
+            j++;
+        std::memmove(order + 1, order, j);
+        order[0] = c;
+        res[i] = (char)j;
+    }
+    return res;
+}
+
+
+std::string Huffman::mtf_decode(const std::string& data){
+    byte_t order[256];
+    for(int i = 0; i < 256; i++)
+        order[i] = i;
+    std::string res(data.size(), 0);
+    for(std::size_t i = 0; i < data.size(); i++){
+        byte_t j = data[i];
+        byte_t c = order[j];
+        std::memmove(order + 1, order, j);
+        order[0] = c;
+        res[i] = (char)c;
+    }
+    return res;
+}
+
+
+std::vector<uint16_t> Huffman::zrle_encode(const std::string& data){
+    std::vector<uint16_t> res;
+    std::size_t run = 0;
+    auto flush_run = [&](){
+        while(run > 0){
+            if(run & 1){
+                res.push_back(ZRLE_RUNA);
+                run = (run - 1) / 2;
+            }
+            else{
+                res.push_back(ZRLE_RUNB);
+                run = (run - 2) / 2;
+            }
+        }
+    };
+    for(char c : data){
+        if(c == 0){
+            run += 1;
+            continue;
+        }
+        flush_run();
+        res.push_back((byte_t)c + 1);
+    }
+    flush_run();
+    return res;
+}
+
+
+std::string Huffman::zrle_decode(const std::vector<uint16_t>& symbols, std::size_t expected_size){
+    std::string res;
+    std::size_t run = 0;
+    std::size_t weight = 1;
+    for(uint16_t symb : symbols){
+        if(symb == ZRLE_RUNA || symb == ZRLE_RUNB){
+            if(weight > INT32_MAX)
+                throw HuffmanException("data format error");
+            run += weight << symb;
+            weight <<= 1;
+            // Серия проверяется сразу: несколько цифр дают до 2^32 нулей
+            if(run > expected_size - res.size())
+                throw HuffmanException("data format error");
+            continue;
+        }
+        if(symb > 256 || run >= expected_size - res.size())
+            throw HuffmanException("data format error");
+        res.append(run, 0);
+        run = 0;
+        weight = 1;
+        res.push_back((char)(symb - 1));
+    }
+    res.append(run, 0);
+    return res;
+}
+
+
+
+
+std::string Huffman::bwt_encode_block(const std::string& block, std::size_t& additional_size){
+    uint32_t primary;
+    std::vector<uint16_t> symbols = zrle_encode(mtf_encode(bwt_forward(block, primary)));
+
+    std::map<uint16_t, double> p;
+    for(uint16_t symb : symbols)
+        p[symb] += 1;
+    if(p.size() <= 1){
+        p[0] += 0;
+        p[1] += 0;
+    }
+    TokenHuffmanTree tree(p);
+
+    std::ostringstream dst;
+    dst.write((char*)&primary, sizeof(primary));
+    bit_oseq tree_dst(dst);
+    tree.save_compact(tree_dst, ZRLE_SYMBOL_BITS);
+    additional_size += sizeof(primary) + 2 * sizeof(seq_size_t) + (tree_dst.size() + 7) / 8;
+    tree_dst.destroy();
+    bit_oseq bit_seq_dst(dst);
+    for(uint16_t symb : symbols)
+        tree.encode(symb, bit_seq_dst);
+    bit_seq_dst.destroy();
+    return dst.str();
+}
+
+
+std::string Huffman::bwt_decode_block(const std::string& payload, std::size_t expected_size, std::size_t& additional_size){
+    std::istringstream src(payload);
+    uint32_t primary;
+    std::vector<uint16_t> symbols;
+    src.read((char*)&primary, sizeof(primary));
+    if(!src.good())
+        throw HuffmanException("file is too small");
+    try{
+        TokenHuffmanTree tree;
+        bit_iseq tree_src(src);
+        tree.load_compact(tree_src, ZRLE_SYMBOL_BITS);
+        additional_size += sizeof(primary) + 2 * sizeof(seq_size_t) + (tree_src.size() + 7) / 8;
+        bit_iseq bit_seq_src(src);
+        while(!bit_seq_src.end_of_seq())
+            symbols.push_back(tree.decode(bit_seq_src));
+    }
+    catch(const HuffmanException&){
+        throw;
+    }
+    catch(...){
+        throw HuffmanException("data format error");
+    }
+    return bwt_inverse(mtf_decode(zrle_decode(symbols, expected_size)), primary);
+}
+
+
+
+
+// Выполняет f(0), ..., f(n - 1) в threads потоках
+template<class F>
+static void parallel_for(std::size_t n, int threads, F f){
+    if(threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    std::atomic<std::size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto worker = [&](){
+        for(std::size_t i = next++; i < n; i = next++){
+            try{
+                f(i);
+            }
+            catch(...){
+                std::lock_guard<std::mutex> lock(error_mutex);
+                error = std::current_exception();
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for(int k = 1; k < threads && (std::size_t)k < n; k++)
+        pool.emplace_back(worker);
+    worker();
+    for(auto& thread : pool)
+        thread.join();
+    if(error)
+        std::rethrow_exception(error);
+}
+
+
+/*
+Формат: блоки подряд, у каждого заголовок - размер исходного блока и размер
+сжатого, затем сжатый блок. Заголовок с нулевыми размерами завершает данные.
+Блоки читаются и пишутся группами по числу потоков, чтобы ограничить память.
+*/
+std::size_t Huffman::bwt_encode(std::istream& src, std::ostream& dst, std::size_t block_size, int threads){
+    if(threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    block_size = std::max<std::size_t>(1, std::min<std::size_t>(block_size, INT32_MAX - 1));
+    std::size_t additional_size = 0;
+    while(true){
+        std::vector<std::string> blocks;
+        for(int k = 0; k < threads; k++){
+            std::string block(block_size, 0);
+            src.read(&block[0], block_size);
+            block.resize(src.gcount());
+            if(block.empty())
+                break;
+            blocks.push_back(std::move(block));
+        }
+        src.clear();
+        if(blocks.empty())
+            break;
+
+        std::vector<std::string> payloads(blocks.size());
+        std::vector<std::size_t> sizes(blocks.size(), 0);
+        parallel_for(blocks.size(), threads, [&](std::size_t i){
+            payloads[i] = bwt_encode_block(blocks[i], sizes[i]);
+        });
+        for(std::size_t i = 0; i < blocks.size(); i++){
+            uint32_t header[2] = {(uint32_t)blocks[i].size(), (uint32_t)payloads[i].size()};
+            dst.write((char*)header, sizeof(header));
+            dst.write(payloads[i].data(), payloads[i].size());
+            additional_size += sizeof(header) + sizes[i];
+        }
+    }
+    uint32_t end[2] = {0, 0};
+    dst.write((char*)end, sizeof(end));
+    return additional_size + sizeof(end);
+}
+
+
+/*
+Читает size байт сжатого блока. Размер из заголовка не проверен, поэтому память
+выделяется по мере прихода данных кусками по мегабайту, а не сразу на все 4 ГиБ.
+*/
+static bool read_payload(std::istream& src, std::string& dst, std::size_t size){
+    constexpr std::size_t CHUNK = 1 << 20;
+    while(dst.size() < size){
+        const std::size_t have = dst.size();
+        const std::size_t part = std::min(CHUNK, size - have);
+        dst.resize(have + part);
+        src.read(&dst[have], part);
+        if(!src.good())
+            return false;
+    }
+    return true;
+}
+
+
+std::size_t Huffman::bwt_decode(std::istream& src, std::ostream& dst, int threads){
+    if(threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    std::size_t additional_size = 0;
+    bool finished = false;
+    while(!finished){
+        std::vector<std::string> payloads;
+        std::vector<uint32_t> raw_sizes;
+        while((int)payloads.size() < threads){
+            uint32_t header[2];
+            src.read((char*)header, sizeof(header));
+            if(!src.good())
+                throw HuffmanException("file is too small");
+            additional_size += sizeof(header);
+            if(header[0] == 0){
+                finished = true;
+                break;
+            }
+            std::string payload;
+            if(!read_payload(src, payload, header[1]))
+                throw HuffmanException("file is too small");
+            payloads.push_back(std::move(payload));
+            raw_sizes.push_back(header[0]);
+        }
+
+        std::vector<std::string> blocks(payloads.size());
+        std::vector<std::size_t> sizes(payloads.size(), 0);
+        parallel_for(payloads.size(), threads, [&](std::size_t i){
+            blocks[i] = bwt_decode_block(payloads[i], raw_sizes[i], sizes[i]);
+            if(blocks[i].size() != raw_sizes[i])
+                throw HuffmanException("data format error");
+        });
+        for(std::size_t i = 0; i < blocks.size(); i++){
+            dst.write(blocks[i].data(), blocks[i].size());
+            additional_size += sizes[i];
+        }
+    }
+    return additional_size;
+}
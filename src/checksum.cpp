@@ -0,0 +1,50 @@
+#include "checksum.h"
+#include <array>
+
+using namespace Huffman;
+
+
+
+static constexpr std::array<uint32_t, 256> make_crc_table(){
+    std::array<uint32_t, 256> table{};
+    for(uint32_t i = 0; i < 256; i++){
+        uint32_t c = i;
+        for(int k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        table[i] = c;
+    }
+    return table;
+}
+
+static constexpr std::array<uint32_t, 256> crc_table = make_crc_table();
+
+
+uint32_t Huffman::crc32(const void* data, std::size_t size, uint32_t crc){
+    const byte_t* p = (const byte_t*)data;
+    crc = ~crc;
+    for(std::size_t i = 0; i < size; i++)
+        crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+
+crc_ostreambuf::int_type crc_ostreambuf::overflow(int_type c){
+    if(traits_type::eq_int_type(c, traits_type::eof()))
+        return traits_type::not_eof(c);
+    char ch = traits_type::to_char_type(c);
+    return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+}
+
+std::streamsize crc_ostreambuf::xsputn(const char* s, std::streamsize n){
+    std::streamsize written = dst->sputn(s, n);
+    if(written > 0){
+        _crc = crc32(s, written, _crc);
+        _size += written;
+    }
+    return written;
+}
+
+int crc_ostreambuf::sync(){
+    return dst->pubsync();
+}
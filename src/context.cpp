@@ -0,0 +1,249 @@
+#include "context.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace Huffman;
+
+
+
+ContextModel::ContextModel(std::istream& src, int tables){
+    construct(src, tables);
+}
+
+
+void ContextModel::construct(std::istream& src, int tables){
+    assert(tables >= 1 && tables <= MAX_TABLES);
+
+    // Частоты символов после каждого значения предыдущего байта
+    std::vector<double> h(256 * 256, 0);
+    double total[256] = {};
+    auto state = src.rdstate();
+    auto pos = src.tellg();
+    byte_t prev = 0;
+    std::vector<char> buf(1 << 16);
+    while(src){
+        src.read(buf.data(), buf.size());
+        for(std::streamsize i = 0; i < src.gcount(); i++){
+            const byte_t symb = buf[i];
+            h[prev * 256 + symb] += 1;
+            total[prev] += 1;
+            prev = symb;
+        }
+    }
+    src.clear(state);
+    src.seekg(pos);
+
+    std::vector<int> used;
+    for(int c = 0; c < 256; c++)
+        if(total[c] != 0)
+            used.push_back(c);
+    std::sort(used.begin(), used.end(), [&](int a, int b){ return total[a] > total[b]; });
+    int K = std::max(1, std::min<int>(tables, used.size()));
+
+    // Начальные группы - самые частые контексты, дальше несколько шагов k-средних:
+    // контекст относим к группе, дерево которой кодирует его короче всего
+    int assign[256] = {};
+    for(int k = 0; k < K && k < (int)used.size(); k++)
+        assign[used[k]] = k;
+    std::vector<double> cluster(K * 256);
+    auto recompute = [&](){
+        std::fill(cluster.begin(), cluster.end(), 0);
+        for(int c : used)
+            for(int s = 0; s < 256; s++)
+                cluster[assign[c] * 256 + s] += h[c * 256 + s];
+    };
+    for(int k = 0; k < K && k < (int)used.size(); k++)
+        for(int s = 0; s < 256; s++)
+            cluster[k * 256 + s] = h[used[k] * 256 + s];
+
+    std::vector<double> cost(K * 256);
+    for(int iteration = 0; iteration < 6; iteration++){
+        for(int k = 0; k < K; k++){
+            double sum = 0;
+            for(int s = 0; s < 256; s++)
+                sum += cluster[k * 256 + s];
+            for(int s = 0; s < 256; s++)
+                cost[k * 256 + s] = -std::log2((cluster[k * 256 + s] + 0.5) / (sum + 128));
+        }
+        for(int c : used){
+            double best = INFINITY;
+            for(int k = 0; k < K; k++){
+                double bits = 0;
+                for(int s = 0; s < 256; s++)
+                    bits += h[c * 256 + s] * cost[k * 256 + s];
+                if(bits < best){
+                    best = bits;
+                    assign[c] = k;
+                }
+            }
+        }
+        recompute();
+    }
+
+    // Пустые группы выбрасываем
+    int renumber[MAX_TABLES];
+    int tables_count = 0;
+    trees.clear();
+    for(int k = 0; k < K; k++){
+        std::map<char, double> p;
+        for(int s = 0; s < 256; s++)
+            if(cluster[k * 256 + s] != 0)
+                p[(char)s] = cluster[k * 256 + s];
+        if(p.empty() && k != 0){
+            renumber[k] = 0;
+            continue;
+        }
+        if(p.size() <= 1){
+            p[0] += 0;
+            p[1] += 0;
+        }
+        renumber[k] = tables_count++;
+        trees.push_back(HuffmanTree(p));
+    }
+    for(int c = 0; c < 256; c++)
+        context_table[c] = renumber[assign[c]];
+}
+
+
+void ContextModel::encode(std::istream& src, std::ostream& dst){
+    for(auto& tree : trees)
+        tree.prepare_encode_table();
+    stream_header_size = 0;
+    std::string block(BLOCK_SIZE, 0);
+    std::vector<std::vector<char>> symbols(trees.size());
+    std::vector<byte_t> bits;
+    byte_t prev = 0;
+    while(true){
+        src.read(&block[0], BLOCK_SIZE);
+        const uint32_t n = src.gcount();
+        dst.write((const char*)&n, sizeof(n));
+        stream_header_size += sizeof(n);
+        if(n == 0)
+            break;
+
+        // Символы раскладываются по деревьям их контекстов, и каждая группа кодируется табличным кодером дерева
+        for(auto& s : symbols)
+            s.clear();
+        for(uint32_t i = 0; i < n; i++){
+            symbols[context_table[prev]].push_back(block[i]);
+            prev = block[i];
+        }
+        for(std::size_t t = 0; t < trees.size(); t++){
+            bits.clear();
+            const std::size_t nbits = trees[t].encode(symbols[t].data(), symbols[t].size(), bits);
+            bit_oseq bit_seq_dst(dst);
+            bit_seq_dst.write_bytes(bits.data(), nbits / 8);
+            for(std::size_t k = nbits / 8 * 8; k < nbits; k++)
+                bit_seq_dst.write((bits[k / 8] >> (k % 8)) & 1);
+            bit_seq_dst.flush();
+            stream_header_size += bit_seq_header_bits(nbits) / 8;
+        }
+    }
+    src.clear();
+}
+
+
+void ContextModel::decode(std::istream& src, std::ostream& dst){
+    for(auto& tree : trees)
+        tree.prepare_decode_table();
+    stream_header_size = 0;
+    std::string block;
+    std::vector<std::vector<char>> symbols(trees.size());
+    std::vector<byte_t> bits;
+    byte_t prev = 0;
+    while(true){
+        uint32_t n;
+        src.read((char*)&n, sizeof(n));
+        if(!src.good())
+            throw HuffmanException("file is too small");
+        stream_header_size += sizeof(n);
+        if(n == 0)
+            break;
+        if(n > BLOCK_SIZE)
+            throw HuffmanException("data format error");
+
+        std::size_t total = 0;
+        for(std::size_t t = 0; t < trees.size(); t++){
+            bits.clear();
+            std::size_t nbits;
+            const decode_status status = read_bit_seq(src, bits, nbits);
+            if(status == decode_status::truncated)
+                throw HuffmanException("file is too small");
+            symbols[t].clear();
+            if(status != decode_status::ok || !trees[t].try_decode(bits.data(), nbits, symbols[t]).ok())
+                throw HuffmanException("data format error");
+            stream_header_size += bit_seq_header_bits(nbits) / 8;
+            total += symbols[t].size();
+        }
+        if(total != n)
+            throw HuffmanException("data format error");
+
+        // Порядок символов восстанавливается по контекстам: следующий символ берётся из группы дерева предыдущего байта
+        block.resize(n);
+        const char* next[MAX_TABLES];
+        const char* end[MAX_TABLES];
+        for(std::size_t t = 0; t < trees.size(); t++){
+            next[t] = symbols[t].data();
+            end[t] = next[t] + symbols[t].size();
+        }
+        for(uint32_t i = 0; i < n; i++){
+            const byte_t t = context_table[prev];
+            if(next[t] == end[t])
+                throw HuffmanException("data format error");
+            prev = *next[t]++;
+            block[i] = prev;
+        }
+        dst.write(block.data(), n);
+    }
+}
+
+
+void ContextModel::save(std::ostream& dst){
+    uint8_t size = trees.size();
+    dst.write((char*)&size, sizeof(size));
+    for(int c = 0; c < 256; c += 2){
+        byte_t packed = context_table[c] | context_table[c + 1] << 4;
+        dst.write((char*)&packed, 1);
+    }
+    bit_oseq bit_seq_dst(dst);
+    for(auto& tree : trees)
+        tree.save_compact(bit_seq_dst);
+    header_size = sizeof(size) + 128 + bit_seq_header_bits(bit_seq_dst.size()) / 8 + (bit_seq_dst.size() + 7) / 8;
+}
+
+
+void ContextModel::load(std::istream& src){
+    uint8_t size;
+    byte_t packed[128];
+    src.read((char*)&size, sizeof(size));
+    src.read((char*)packed, sizeof(packed));
+    if(!src.good())
+        throw HuffmanException("file is too small");
+    if(size == 0 || size > MAX_TABLES)
+        throw HuffmanException("data format error");
+    for(int c = 0; c < 256; c += 2){
+        context_table[c] = packed[c / 2] & 0xf;
+        context_table[c + 1] = packed[c / 2] >> 4;
+        if(context_table[c] >= size || context_table[c + 1] >= size)
+            throw HuffmanException("data format error");
+    }
+    try{
+        bit_iseq bit_seq_src(src);
+        trees.resize(size);
+        for(auto& tree : trees)
+            tree.load_compact(bit_seq_src);
+        header_size = sizeof(size) + 128 + bit_seq_header_bits(bit_seq_src.size()) / 8 + (bit_seq_src.size() + 7) / 8;
+    }
+    catch(const HuffmanException&){
+        throw;
+    }
+    catch(...){
+        throw HuffmanException("data format error");
+    }
+}
+
+
+std::size_t ContextModel::additional_data_size(){
+    return header_size + stream_header_size;
+}
+
@@ -0,0 +1,144 @@
+#include "dictionary.h"
+
+using namespace Huffman;
+
+
+
+static std::map<char, double> with_all_symbols(const std::map<char, double>& m){
+    std::map<char, double> p;
+    for(int b = 0; b < 256; b++)
+        p[(char)b] = 0.5;
+    for(auto iter = m.begin(); iter != m.end(); ++iter)
+        p[iter->first] = std::max(iter->second, 1.0);
+    return p;
+}
+
+
+Dictionary::Dictionary(uint16_t id, const std::map<char, double>& m):
+    HuffmanTree(with_all_symbols(m)), id(id)
+{
+    build_codes();
+}
+
+
+Dictionary Dictionary::train(uint16_t id, std::istream& corpus){
+    return Dictionary(id, counts(corpus));
+}
+
+
+void Dictionary::encode_message(std::istream& src, std::ostream& dst) const{
+    byte_t byte = 0;
+    int offset = 0;
+    auto write = [&](bool bit){
+        byte |= bit << offset;
+        offset += 1;
+        if(offset == 8){
+            dst.put((char)byte);
+            byte = 0;
+            offset = 0;
+        }
+    };
+    while(true){
+        char symb = src.get();
+        if(!src.good()){
+            src.clear();
+            break;
+        }
+        for(bool bit : codes[(byte_t)symb])
+            write(bit);
+    }
+    for(int j = 0; offset != 0; j++)
+        write(padding[j]);
+}
+
+
+void Dictionary::decode_message(std::istream& src, std::ostream& dst) const{
+    const uint16_t root = nodes.size() - 1;
+    uint16_t i = root;
+    while(true){
+        char byte = src.get();
+        if(!src.good()){
+            src.clear();
+            break;
+        }
+        for(int k = 0; k < 8; k++){
+            const Node& node = nodes[i];
+            i = ((byte_t)byte >> k) & 1 ? node.i1 : node.i0;
+            if(nodes[i].is_leaf()){
+                dst.put((char)nodes[i].symb);
+                i = root;
+            }
+        }
+    }
+    // Если сообщение кончилось посреди кода, это дополнение последнего байта
+}
+
+
+void Dictionary::save(std::ostream& dst){
+    dst.write((char*)&id, sizeof(id));
+    HuffmanTree::save(dst);
+}
+
+
+void Dictionary::load(std::istream& src){
+    src.read((char*)&id, sizeof(id));
+    if(!src.good())
+        throw HuffmanException("file is too small");
+    HuffmanTree::load(src);
+    if(nodes.size() != 2 * 256 - 1)
+        throw HuffmanException("dictionary must contain all 256 symbols");
+    build_codes();
+}
+
+
+void Dictionary::build_codes(){
+    std::size_t longest = 0;
+    for(std::size_t leaf = 0; leaf < 256; leaf++){
+        std::vector<bool> code;
+        for(uint16_t i = leaf; nodes[i].ip != (uint16_t)-1; i = nodes[i].ip)
+            code.push_back(nodes[i].v);
+        code = std::vector<bool>(code.rbegin(), code.rend());
+        if(code.size() > longest){
+            longest = code.size();
+            padding = std::vector<bool>(code.begin(), code.begin() + 7);  // в дереве из 256 листьев самый длинный код не короче 8 бит
+        }
+        codes[(byte_t)nodes[leaf].symb] = code;
+    }
+}
+
+
+
+
+void DictionaryRegistry::add(const Dictionary& dict){
+    dicts[dict.id] = dict;
+}
+
+
+void DictionaryRegistry::load(std::istream& src){
+    Dictionary dict;
+    dict.load(src);
+    add(dict);
+}
+
+
+bool DictionaryRegistry::contains(uint16_t id) const{
+    return dicts.count(id) != 0;
+}
+
+
+const Dictionary& DictionaryRegistry::get(uint16_t id) const{
+    auto iter = dicts.find(id);
+    if(iter == dicts.end())
+        throw HuffmanException("dictionary " + std::to_string(id) + " is not loaded");
+    return iter->second;
+}
+
+
+void DictionaryRegistry::encode(uint16_t id, std::istream& src, std::ostream& dst) const{
+    get(id).encode_message(src, dst);
+}
+
+
+void DictionaryRegistry::decode(uint16_t id, std::istream& src, std::ostream& dst) const{
+    get(id).decode_message(src, dst);
+}
@@ -0,0 +1,595 @@
+#include "file_io.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if __has_include(<linux/io_uring.h>)
+#define HUFFMAN_HAVE_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+using namespace Huffman;
+
+
+
+std::size_t StreamReader::read(char* dst, std::size_t size){
+    src.read(dst, size);
+    return src.gcount();
+}
+
+
+void StreamWriter::write(const char* data, std::size_t size){
+    dst.write(data, size);
+}
+
+void StreamWriter::close(){
+    dst.flush();
+    if(!dst.good())
+        throw HuffmanException("can't write output file");
+}
+
+
+
+// Потоки iostream, открытые по пути к файлу
+class FileStreamReader : public FileReader{
+public:
+    explicit FileStreamReader(const char* path): file(path, std::ios::binary), reader(file) {
+        if(!file)
+            throw HuffmanException(std::string("source file does not exist: ") + path);
+    }
+    std::size_t read(char* dst, std::size_t size) override { return reader.read(dst, size); }
+private:
+    std::ifstream file;
+    StreamReader reader;
+};
+
+class FileStreamWriter : public FileWriter{
+public:
+    explicit FileStreamWriter(const char* path): file(path, std::ios::binary), writer(file) {
+        if(!file)
+            throw HuffmanException(std::string("can't create output file: ") + path);
+    }
+    void write(const char* data, std::size_t size) override { writer.write(data, size); }
+    void close() override { writer.close(); file.close(); }
+private:
+    std::ofstream file;
+    StreamWriter writer;
+};
+
+
+
+// Читает или пишет ровно size байт по смещению offset, повторяя короткие операции
+static void pread_all(int fd, char* dst, std::size_t size, off_t offset){
+    while(size > 0){
+        ssize_t n = ::pread(fd, dst, size, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            throw HuffmanException("read error");
+        dst += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+static void pwrite_all(int fd, const char* data, std::size_t size, off_t offset){
+    while(size > 0){
+        ssize_t n = ::pwrite(fd, data, size, offset);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            throw HuffmanException("can't write output file");
+        data += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+
+/*
+Читает подряд, пока не наберёт size байт или не дойдёт до конца данных. Так читаются
+каналы и устройства (/dev/stdin): у них нет размера и по смещению их читать нельзя
+*/
+static std::size_t read_all(int fd, char* dst, std::size_t size){
+    std::size_t done = 0;
+    while(done < size){
+        ssize_t n = ::read(fd, dst + done, size - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0)
+            throw HuffmanException("read error");
+        if(n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+// Размер файла для чтения по смещениям. regular = false у каналов и устройств, их размер не используется
+static std::size_t source_size(int fd, bool& regular){
+    struct stat st;
+    if(fstat(fd, &st) != 0)
+        throw HuffmanException("can't get source file size");
+    regular = S_ISREG(st.st_mode);
+    return regular ? st.st_size : 0;
+}
+
+
+static int open_file(const char* path, bool for_write){
+    int fd = for_write ? ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : ::open(path, O_RDONLY);
+    if(fd < 0)
+        throw HuffmanException(for_write ? std::string("can't create output file: ") + path
+                                         : std::string("source file does not exist: ") + path);
+    return fd;
+}
+
+
+class PreadReader : public FileReader{
+public:
+    explicit PreadReader(int fd): fd(fd) {
+        try{
+            file_size = source_size(fd, regular);
+        }
+        catch(...){
+            ::close(fd);
+            throw;
+        }
+    }
+    ~PreadReader(){ ::close(fd); }
+
+    bool is_regular() const { return regular; }
+
+    std::size_t read(char* dst, std::size_t size) override {
+        if(!regular)
+            return read_all(fd, dst, size);
+        size = std::min<std::size_t>(size, file_size - offset);
+        pread_all(fd, dst, size, offset);
+        offset += size;
+        return size;
+    }
+
+private:
+    int fd;
+    bool regular = true;
+    std::size_t file_size;
+    std::size_t offset = 0;
+};
+
+
+// Копит данные и пишет их pwrite кусками по chunk_size байт
+class PwriteWriter : public FileWriter{
+public:
+    PwriteWriter(const char* path, std::size_t chunk_size): fd(open_file(path, true)), chunk_size(chunk_size) {
+        buffer.reserve(chunk_size);
+    }
+    ~PwriteWriter(){
+        if(fd >= 0)
+            ::close(fd);
+    }
+
+    void write(const char* data, std::size_t size) override {
+        while(size > 0){
+            std::size_t n = std::min(size, chunk_size - buffer.size());
+            buffer.insert(buffer.end(), data, data + n);
+            data += n;
+            size -= n;
+            if(buffer.size() == chunk_size)
+                flush();
+        }
+    }
+
+    void close() override {
+        flush();
+        if(::close(fd) != 0){
+            fd = -1;
+            throw HuffmanException("can't write output file");
+        }
+        fd = -1;
+    }
+
+private:
+    void flush(){
+        pwrite_all(fd, buffer.data(), buffer.size(), offset);
+        offset += buffer.size();
+        buffer.clear();
+    }
+
+    int fd;
+    std::size_t chunk_size;
+    std::vector<char> buffer;
+    std::size_t offset = 0;
+};
+
+
+
+#ifdef HUFFMAN_HAVE_URING
+
+/*
+Минимальная обвязка io_uring на системных вызовах (без liburing): кольца
+отправки и завершения, отображённые в память процесса.
+*/
+class Uring{
+public:
+    ~Uring(){
+        if(sqes != nullptr)
+            munmap(sqes, sqes_size);
+        if(cq_ptr != nullptr && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+        if(sq_ptr != nullptr)
+            munmap(sq_ptr, sq_size);
+        if(fd >= 0)
+            ::close(fd);
+    }
+
+    // false, если ядро не даёт создать кольцо
+    bool init(unsigned entries){
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        fd = syscall(__NR_io_uring_setup, entries, &p);
+        if(fd < 0)
+            return false;
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if(p.features & IORING_FEAT_SINGLE_MMAP)
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if(sq_ptr == MAP_FAILED){
+            sq_ptr = nullptr;
+            return false;
+        }
+        if(p.features & IORING_FEAT_SINGLE_MMAP)
+            cq_ptr = sq_ptr;
+        else{
+            cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if(cq_ptr == MAP_FAILED){
+                cq_ptr = nullptr;
+                return false;
+            }
+        }
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        void* s = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if(s == MAP_FAILED)
+            return false;
+        sqes = (io_uring_sqe*)s;
+
+        char* sq = (char*)sq_ptr;
+        sq_head = (unsigned*)(sq + p.sq_off.head);
+        sq_tail = (unsigned*)(sq + p.sq_off.tail);
+        sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+        sq_entries = p.sq_entries;
+        sq_array = (unsigned*)(sq + p.sq_off.array);
+        char* cq = (char*)cq_ptr;
+        cq_head = (unsigned*)(cq + p.cq_off.head);
+        cq_tail = (unsigned*)(cq + p.cq_off.tail);
+        cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    bool register_buffers(const std::vector<iovec>& buffers){
+        return syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) == 0;
+    }
+
+    // Ставит операцию в очередь отправки. Очередь не переполняется: операций в полёте не больше depth
+    void push(const io_uring_sqe& sqe){
+        unsigned tail = *sq_tail;
+        unsigned index = tail & sq_mask;
+        sqes[index] = sqe;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        pending++;
+    }
+
+    // Отправляет поставленные операции и ждёт, пока завершится хотя бы wait из них
+    void enter(unsigned wait){
+        while(true){
+            int res = syscall(__NR_io_uring_enter, fd, pending, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if(res >= 0){
+                pending -= std::min<unsigned>(res, pending);
+                return;
+            }
+            if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                throw HuffmanException("io_uring error");
+        }
+    }
+
+    // Забирает одно завершение, false - завершений пока нет
+    bool pop(io_uring_cqe& cqe){
+        unsigned head = *cq_head;
+        if(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            return false;
+        cqe = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    int fd = -1;
+    void* sq_ptr = nullptr;
+    void* cq_ptr = nullptr;
+    std::size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0, sq_entries = 0;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+    unsigned pending = 0;
+};
+
+
+/*
+Общая часть чтения и записи через io_uring: depth буферов по chunk_size байт,
+выровненных по странице и по возможности зарегистрированных в ядре (тогда
+операции READ_FIXED / WRITE_FIXED не отображают страницы при каждом вызове).
+Буферы используются по кругу, операция буфера i помечена user_data = i.
+*/
+class UringFile{
+protected:
+    UringFile(int fd, std::size_t chunk_size, int depth): fd(fd), chunk_size(chunk_size), depth(std::max(1, depth)) {}
+
+    ~UringFile(){
+        // Ядро может ещё писать в буферы - дожидаемся всех операций
+        try{
+            while(in_flight > 0)
+                wait_one();
+        }
+        catch(...){}
+        for(auto& b : buffers)
+            std::free(b.iov_base);
+        if(fd >= 0)
+            ::close(fd);
+    }
+
+    bool init(){
+        if(!ring.init(depth))
+            return false;
+        std::size_t size = (chunk_size + 4095) / 4096 * 4096;
+        for(int i = 0; i < depth; i++){
+            void* b = std::aligned_alloc(4096, size);
+            if(b == nullptr)
+                return false;
+            buffers.push_back({b, chunk_size});
+        }
+        fixed = ring.register_buffers(buffers);  // без регистрации (мало RLIMIT_MEMLOCK) работают обычные READ / WRITE
+        lengths.assign(depth, 0);
+        offsets.assign(depth, 0);
+        results.assign(depth, 0);
+        busy.assign(depth, false);
+        return true;
+    }
+
+    void submit(int i, bool write, std::size_t length, std::size_t offset){
+        io_uring_sqe sqe;
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = write ? (fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE) : (fixed ? IORING_OP_READ_FIXED : IORING_OP_READ);
+        sqe.fd = fd;
+        sqe.addr = (uint64_t)buffers[i].iov_base;
+        sqe.len = length;
+        sqe.off = offset;
+        sqe.buf_index = fixed ? i : 0;
+        sqe.user_data = i;
+        lengths[i] = length;
+        offsets[i] = offset;
+        busy[i] = true;
+        in_flight++;
+        ring.push(sqe);
+        ring.enter(0);
+    }
+
+    // Ждёт завершения операции буфера i
+    void wait(int i){
+        while(busy[i])
+            wait_one();
+    }
+
+    void wait_one(){
+        io_uring_cqe cqe;
+        while(!ring.pop(cqe))
+            ring.enter(1);
+        int i = cqe.user_data;
+        results[i] = cqe.res;
+        busy[i] = false;
+        in_flight--;
+    }
+
+    char* buffer(int i){ return (char*)buffers[i].iov_base; }
+
+    int fd;
+    std::size_t chunk_size;
+    int depth;
+    Uring ring;
+    std::vector<iovec> buffers;
+    bool fixed = false;
+    std::vector<std::size_t> lengths;
+    std::vector<std::size_t> offsets;
+    std::vector<int> results;
+    std::vector<bool> busy;
+    int in_flight = 0;
+};
+
+
+/*
+Чтение с опережением: сразу отправляются depth чтений подряд идущих кусков,
+и каждый прочитанный буфер тут же отправляется за следующим куском файла.
+*/
+class UringReader : public FileReader, UringFile{
+public:
+    UringReader(int fd, std::size_t chunk_size, int depth): UringFile(fd, chunk_size, depth) {
+        bool regular;
+        file_size = source_size(fd, regular);
+    }
+
+    bool start(){
+        if(!init())
+            return false;
+        for(int i = 0; i < depth && next_offset < file_size; i++)
+            submit_next(i);
+        return true;
+    }
+
+    std::size_t read(char* dst, std::size_t size) override {
+        std::size_t done = 0;
+        while(done < size){
+            if(pos == length){
+                if(loaded){
+                    loaded = false;
+                    if(next_offset < file_size)
+                        submit_next(current);
+                    current = (current + 1) % depth;
+                }
+                if(read_offset >= file_size)
+                    break;
+                load_current();
+            }
+            std::size_t n = std::min(size - done, length - pos);
+            std::memcpy(dst + done, buffer(current) + pos, n);
+            pos += n;
+            done += n;
+        }
+        return done;
+    }
+
+private:
+    void submit_next(int i){
+        submit(i, false, std::min(chunk_size, file_size - next_offset), next_offset);
+        next_offset += lengths[i];
+    }
+
+    void load_current(){
+        wait(current);
+        int res = results[current];
+        if(res < 0)
+            throw HuffmanException("read error");
+        if((std::size_t)res < lengths[current])  // короткое чтение - дочитываем сами
+            pread_all(fd, buffer(current) + res, lengths[current] - res, offsets[current] + res);
+        length = lengths[current];
+        pos = 0;
+        read_offset += length;
+        loaded = true;
+    }
+
+    std::size_t file_size;
+    std::size_t next_offset = 0;  // с какого места файла читать следующий отправляемый кусок
+    std::size_t read_offset = 0;  // сколько байт файла уже попало в read
+    int current = 0;              // буфер, из которого идёт чтение
+    bool loaded = false;
+    std::size_t pos = 0, length = 0;
+};
+
+
+// Запись без ожидания: заполненный буфер отправляется, а данные копятся в следующем
+class UringWriter : public FileWriter, UringFile{
+public:
+    UringWriter(int fd, std::size_t chunk_size, int depth): UringFile(fd, chunk_size, depth) {}
+
+    bool start(){ return init(); }
+
+    void write(const char* data, std::size_t size) override {
+        while(size > 0){
+            std::size_t n = std::min(size, chunk_size - fill);
+            std::memcpy(buffer(current) + fill, data, n);
+            fill += n;
+            data += n;
+            size -= n;
+            if(fill == chunk_size)
+                flush();
+        }
+    }
+
+    void close() override {
+        if(fill > 0)
+            flush();
+        for(int i = 0; i < depth; i++)
+            finish(i);
+        int res = ::close(fd);
+        fd = -1;
+        if(res != 0)
+            throw HuffmanException("can't write output file");
+    }
+
+private:
+    void flush(){
+        submit(current, true, fill, offset);
+        offset += fill;
+        fill = 0;
+        current = (current + 1) % depth;
+        finish(current);
+    }
+
+    // Дожидается записи буфера i, если она была, и проверяет её результат
+    void finish(int i){
+        if(!busy[i] && lengths[i] == 0)
+            return;
+        wait(i);
+        int res = results[i];
+        std::size_t length = lengths[i];
+        lengths[i] = 0;
+        if(res < 0)
+            throw HuffmanException("can't write output file");
+        if((std::size_t)res < length)
+            pwrite_all(fd, buffer(i) + res, length - res, offsets[i] + res);
+    }
+
+    int current = 0;
+    std::size_t fill = 0;
+    std::size_t offset = 0;
+};
+
+#endif
+
+
+
+bool Huffman::uring_available(){
+#ifdef HUFFMAN_HAVE_URING
+    static const bool available = [](){
+        Uring ring;
+        return ring.init(2);
+    }();
+    return available;
+#else
+    return false;
+#endif
+}
+
+
+std::unique_ptr<FileReader> Huffman::open_reader(const char* path, io_backend io, std::size_t chunk_size, int depth){
+    if(io == io_backend::stream)
+        return std::make_unique<FileStreamReader>(path);
+    auto reader = std::make_unique<PreadReader>(open_file(path, false));
+#ifdef HUFFMAN_HAVE_URING
+    // Канал или устройство io_uring по смещениям не прочитает, их PreadReader читает подряд
+    if(io == io_backend::uring && reader->is_regular() && uring_available()){
+        auto uring_reader = std::make_unique<UringReader>(open_file(path, false), chunk_size, depth);
+        if(uring_reader->start())
+            return uring_reader;
+    }
+#endif
+    return reader;
+}
+
+
+std::unique_ptr<FileWriter> Huffman::open_writer(const char* path, io_backend io, std::size_t chunk_size, int depth){
+    if(io == io_backend::stream)
+        return std::make_unique<FileStreamWriter>(path);
+#ifdef HUFFMAN_HAVE_URING
+    if(io == io_backend::uring && uring_available()){
+        auto writer = std::make_unique<UringWriter>(open_file(path, true), chunk_size, depth);
+        if(writer->start())
+            return writer;
+    }
+#endif
+    return std::make_unique<PwriteWriter>(path, chunk_size);
+}
@@ -0,0 +1,261 @@
+#include "fse.h"
+#include <array>
+#include <cstring>
+#include <iterator>
+#include <cmath>
+
+using namespace Huffman;
+
+
+
+// Пишет младшие n бит value, начиная со старшего
+static void write_bits(bit_oseq& dst, uint32_t value, int n){
+    for(int k = n - 1; k >= 0; k--)
+        dst.write((value >> k) & 1);
+}
+
+// Байт с обратным порядком бит: bit_oseq заполняет байт с младшего бита, а значения идут со старшего
+static constexpr std::array<byte_t, 256> make_reverse_table(){
+    std::array<byte_t, 256> table{};
+    for(int b = 0; b < 256; b++)
+        for(int k = 0; k < 8; k++)
+            table[b] |= ((b >> k) & 1) << (7 - k);
+    return table;
+}
+
+static constexpr std::array<byte_t, 256> reverse_table = make_reverse_table();
+
+
+
+FseTable::FseTable(const std::map<char, double>& m, int table_log){
+    construct(m, table_log);
+}
+
+
+void FseTable::construct(const std::map<char, double>& m, int table_log){
+    assert(m.size() <= 256 && (1u << table_log) >= 256);
+    this->table_log = table_log;
+    const int L = 1 << table_log;
+    for(int s = 0; s < 256; s++)
+        norm[s] = 0;
+
+    double total = 0;
+    for(auto iter = m.begin(); iter != m.end(); ++iter)
+        total += iter->second;
+
+    // Каждый встретившийся символ получает хотя бы одно состояние
+    int sum = 0;
+    for(auto iter = m.begin(); iter != m.end(); ++iter){
+        byte_t s = iter->first;
+        long n = total > 0 ? std::lround(iter->second * L / total) : 1;
+        norm[s] = std::max(n, 1L);
+        sum += norm[s];
+    }
+
+    // Излишек или недостаток отдаём самым частым символам
+    while(sum != L && sum != 0){
+        int largest = 0;
+        for(int s = 1; s < 256; s++)
+            if(norm[s] > norm[largest])
+                largest = s;
+        if(sum < L){
+            norm[largest] += L - sum;
+            sum = L;
+        }
+        else{
+            int d = std::min(sum - L, norm[largest] - 1);
+            assert(d > 0);  // иначе у всех символов по одному состоянию и их больше L
+            norm[largest] -= d;
+            sum -= d;
+        }
+    }
+    build_tables();
+}
+
+
+void FseTable::encode(std::istream& src, std::ostream& dst){
+    // Число символов пишется перед данными, поэтому оно берётся из длины потока (как в counts, src должен поддерживать seekg)
+    const std::streampos begin = src.tellg();
+    src.seekg(0, src.end);
+    const std::streampos end = src.tellg();
+    src.seekg(begin);
+    if(begin == std::streampos(-1) || end == std::streampos(-1))
+        throw HuffmanException("fse coder needs a seekable input");
+    if(uint64_t(end - begin) > UINT32_MAX)
+        throw HuffmanException("data is too large for the fse coder");
+    uint32_t n = end - begin;
+    dst.write((char*)&n, sizeof(n));
+
+    // Пакеты по BATCH символов кодируются независимо, каждый со своим начальным состоянием:
+    // порции бит копятся только для одного пакета
+    const uint32_t L = 1u << table_log;
+    std::string data(std::min<uint32_t>(n, BATCH), 0);
+    std::vector<uint32_t> chunks(data.size());  // порции бит: значение << 8 | длина
+    bit_oseq bit_seq_dst(dst);
+    for(uint32_t done = 0; done < n;){
+        const uint32_t size = std::min<uint32_t>(n - done, BATCH);
+        src.read(&data[0], size);
+        if(uint32_t(src.gcount()) != size)
+            throw HuffmanException("can't read input");
+        uint32_t state = L;
+        for(uint32_t i = size; i-- > 0;){
+            byte_t s = data[i];
+            if(norm[s] == 0)
+                throw HuffmanException("symbol '" + std::to_string(data[i]) + "' does not exist in the fse table");
+            int nb = 0;
+            while((state >> nb) >= 2u * norm[s])
+                nb++;
+            chunks[i] = (state & ((1u << nb) - 1)) << 8 | nb;
+            state = enc_states[first[s] + (state >> nb) - norm[s]];
+        }
+        write_bits(bit_seq_dst, state - L, table_log);
+        for(uint32_t i = 0; i < size; i++)
+            write_bits(bit_seq_dst, chunks[i] >> 8, chunks[i] & 0xff);
+        done += size;
+    }
+}
+
+
+void FseTable::decode(std::istream& src, std::ostream& dst){
+    uint32_t n;
+    src.read((char*)&n, sizeof(n));
+    if(!src.good())
+        throw HuffmanException("file is too small");
+
+    // Биты читаются целиком, с 8 байтами запаса для 64-битных чтений; в каждом байте порядок бит обращается,
+    // и тогда следующие биты - это старшие разряды big-endian слова с текущего байта
+    std::vector<byte_t> data;
+    std::size_t nbits;
+    if(read_bit_seq(src, data, nbits) != decode_status::ok)
+        throw HuffmanException("data format error");
+    data.resize(data.size() + sizeof(uint64_t), 0);
+    for(byte_t& b : data)
+        b = reverse_table[b];
+    if(n == 0)
+        return;
+    if(dnodes.empty() || first[255] + norm[255] == 0)
+        throw HuffmanException("empty fse table");
+
+    std::size_t pos = 0;
+    auto read_bits = [&](int nb){
+        if(pos + nb > nbits)
+            throw HuffmanException("data format error");
+        uint64_t word;
+        std::memcpy(&word, data.data() + (pos >> 3), sizeof(word));
+        word = __builtin_bswap64(word) << (pos & 7);
+        pos += nb;
+        return uint32_t(word >> 1 >> (63 - nb));  // nb = 0 даёт 0 без сдвига на 64
+    };
+
+    // Пакет совпадает с куском вывода: начальное состояние читается перед каждым
+    char out[BATCH];
+    for(uint32_t i = 0; i < n;){
+        const uint32_t k_end = std::min<uint32_t>(n - i, BATCH);
+        uint32_t state = read_bits(table_log);
+        for(uint32_t k = 0; k < k_end; k++){
+            const DNode d = dnodes[state];
+            out[k] = d.symb;
+            state = d.base + read_bits(d.nb_bits);
+        }
+        dst.write(out, k_end);
+        i += k_end;
+    }
+}
+
+
+void FseTable::save(std::ostream& dst){
+    uint8_t log = table_log;
+    uint16_t size = 0;
+    for(int s = 0; s < 256; s++)
+        size += norm[s] != 0;
+    dst.write((char*)&log, sizeof(log));
+    dst.write((char*)&size, sizeof(size));
+    for(int s = 0; s < 256; s++){
+        if(norm[s] == 0)
+            continue;
+        char symb = s;
+        dst.write(&symb, 1);
+        dst.write((char*)&norm[s], sizeof(norm[s]));
+    }
+}
+
+
+void FseTable::load(std::istream& src){
+    uint8_t log;
+    uint16_t size;
+    src.read((char*)&log, sizeof(log));
+    src.read((char*)&size, sizeof(size));
+    if(!src.good())
+        throw HuffmanException("file is too small");
+    if(log < 8 || log > 15 || size > 256)
+        throw HuffmanException("data format error");
+    table_log = log;
+    for(int s = 0; s < 256; s++)
+        norm[s] = 0;
+    for(int i = 0; i < size; i++){
+        char symb;
+        uint16_t n;
+        src.read(&symb, 1);
+        src.read((char*)&n, sizeof(n));
+        if(!src.good())
+            throw HuffmanException("file is too small");
+        // Повтор символа перезаписал бы его частоту, и таблица осталась бы заполнена не вся
+        if(n == 0 || norm[(byte_t)symb] != 0)
+            throw HuffmanException("data format error");
+        norm[(byte_t)symb] = n;
+    }
+    uint32_t sum = 0;
+    for(int s = 0; s < 256; s++)
+        sum += norm[s];
+    if(size != 0 && sum != (1u << table_log))
+        throw HuffmanException("data format error");
+    build_tables();
+}
+
+
+std::size_t FseTable::additional_data_size(){
+    std::size_t size = 0;
+    for(int s = 0; s < 256; s++)
+        size += norm[s] != 0;
+    return sizeof(uint8_t) + sizeof(uint16_t) + size * (sizeof(char) + sizeof(uint16_t))
+        + sizeof(uint32_t) + sizeof(seq_size_t);
+}
+
+
+void FseTable::build_tables(){
+    const uint32_t L = 1u << table_log;
+    enc_states.assign(L, 0);
+    dnodes.assign(L, DNode{0, 0, 0});
+
+    // Раскладываем символы по состояниям с шагом, взаимно простым с L, как в FSE
+    std::vector<char> spread(L);
+    const uint32_t step = (L >> 1) + (L >> 3) + 3;
+    uint32_t pos = 0;
+    uint16_t next[256];
+    uint32_t cumulative = 0;
+    for(int s = 0; s < 256; s++){
+        first[s] = cumulative;
+        next[s] = norm[s];
+        cumulative += norm[s];
+        for(int k = 0; k < norm[s]; k++){
+            spread[pos] = (char)s;
+            pos = (pos + step) & (L - 1);
+        }
+    }
+    if(cumulative == 0)
+        return;
+
+    for(uint32_t x = 0; x < L; x++){
+        byte_t s = spread[x];
+        uint32_t m = next[s]++;  // m пробегает [norm[s], 2*norm[s])
+        int nb = 0;
+        while((m << nb) < L)
+            nb++;
+        dnodes[x] = {
+            .symb = (char)s,
+            .nb_bits = (uint8_t)nb,
+            .base = (uint16_t)((m << nb) - L),
+        };
+        enc_states[first[s] + m - norm[s]] = L + x;
+    }
+}
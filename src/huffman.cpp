@@ -1,38 +1,85 @@
 #include "huffman.h"
+#include "adaptive.h"
+#include "fse.h"
+#include "context.h"
+#include "lz77.h"
+#include "rle.h"
+#include "bwt.h"
+#include "static_code.h"
+#include "pipeline.h"
+#include "huffman_block.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
 
 using namespace Huffman;
 
 
 
 bit_oseq::bit_oseq(std::ostream& os): 
-    _os(&os), _offset(0), _size(0), _begin(os.tellp()), _byte(0)
+    _os(&os), _size(0), _chunk_bits(0)
 {
-    write_size();
+    _bytes.reserve(BIT_SEQ_CHUNK);
 }
 
 void bit_oseq::write(bool value){
-    if(_offset == 8){
-        next_byte();
-    }
-    byte_t mask = 1 << _offset;
-    byte_t v = (value << _offset);
-    _byte = (_byte & ~mask) | (v & mask);
-    _offset += 1;
+    if(_chunk_bits % 8 == 0)
+        _bytes.push_back(0);
+    _bytes.back() |= value << (_chunk_bits % 8);
+    _chunk_bits += 1;
     _size += 1;
+    if(_chunk_bits == 8 * BIT_SEQ_CHUNK)
+        write_chunk();
+}
+
+void bit_oseq::write_bytes(const byte_t* data, std::size_t n){
+    assert(_chunk_bits % 8 == 0);
+    while(n > 0){
+        const std::size_t k = std::min(n, BIT_SEQ_CHUNK - _bytes.size());
+        _bytes.insert(_bytes.end(), data, data + k);
+        _chunk_bits += 8 * k;
+        _size += 8 * k;
+        data += k;
+        n -= k;
+        if(_bytes.size() == BIT_SEQ_CHUNK)
+            write_chunk();
+    }
+}
+
+void bit_oseq::sync(){
+    if(_os == nullptr)
+        return;
+    write_chunk();
+    _os->flush();
+}
+
+void bit_oseq::write_chunk(){
+    // Неполный последний байт остаётся в буфере и уйдёт со следующим куском
+    const std::size_t whole = _chunk_bits / 8;
+    if(_os == nullptr || whole == 0)
+        return;
+    const seq_size_t header = BIT_SEQ_MORE | seq_size_t(8 * whole);
+    _os->write((const char*)&header, sizeof(header));
+    _os->write((const char*)_bytes.data(), whole);
+    _bytes.erase(_bytes.begin(), _bytes.begin() + whole);
+    _chunk_bits -= 8 * whole;
 }
 
 void bit_oseq::flush(){
-    if(_offset != 0)
-        next_byte();
-    write_size();
+    if(_os == nullptr)
+        return;
+    _os->write((const char*)&_chunk_bits, sizeof(_chunk_bits));
+    _os->write((const char*)_bytes.data(), _bytes.size());
+    _os = nullptr;
 }
 
 void bit_oseq::destroy(){
     flush();
-    _os = nullptr;
 }
 
-seq_size_t bit_oseq::size(){
+std::size_t bit_oseq::size(){
     return _size;
 }
 
@@ -41,57 +88,124 @@ bit_oseq::~bit_oseq(){
 }
 
 
-void bit_oseq::write_size(){
-    if(_os == nullptr)
-        return;
-    _os->seekp(_begin);
-    _os->write((char*)&_size, sizeof(_size));
-    _os->seekp(0, _os->end);
-}
-
-void bit_oseq::next_byte(){
-    if(_os == nullptr)
-        return;
-    _os->write((char*)&_byte, sizeof(_byte));
-    _offset = 0;
-}
-
-
 
 
 bit_iseq::bit_iseq(std::istream& is): 
-    _is(is), _offset(8), _pos(0)
+    _is(is), _size(0), _pos(0), _last(false), _offset(8)
 {
-    is.read((char*)&_size, sizeof(_size));
-    if(is.fail())
-        throw "bit_iseq: failed to read size of sequence";
+    if(!next_chunk())
+        throw HuffmanException("bit_iseq: failed to read size of sequence");
 }
 
 bool bit_iseq::read(){
-    if(end_of_seq())
-        throw "bit_iseq: failed to read - the end of sequence has been reached";
-    if(_offset == 8)
-        next_byte();
-    bool res = (_byte >> _offset) & 1;
+    bool res;
+    if(!try_read(res))
+        throw HuffmanException(end_of_seq()? "bit_iseq: failed to read - the end of sequence has been reached"
+                                           : "bit_iseq: failed to read - wrong sequence format");
+    return res;
+}
+
+bool bit_iseq::try_read(bool& bit){
+    if(end_of_seq() || _pos >= _size)
+        return false;
+    if(_offset == 8 && !next_byte())
+        return false;
+    bit = (_byte >> _offset) & 1;
     _offset += 1;
     _pos += 1;
-    return res;
+    return true;
 }
 
 bool bit_iseq::end_of_seq(){
-    return _pos >= _size;  
+    // Кусок с продолжением кончается на границе байта, так что следующий байт потока - заголовок
+    while(_pos >= _size && !_last)
+        if(!next_chunk())
+            return false;
+    return _pos >= _size;
 }
 
-seq_size_t bit_iseq::size(){
+std::size_t bit_iseq::size(){
     return _size;
 }
 
+std::size_t bit_iseq::position(){
+    return _pos;
+}
 
-void bit_iseq::next_byte(){
+
+bool bit_iseq::next_byte(){
     _is.read((char*)&_byte, 1);
     if(_is.fail())
-        throw "bit_iseq: failed to read - wrong sequence format";
+        return false;
     _offset = 0;
+    return true;
+}
+
+bool bit_iseq::next_chunk(){
+    seq_size_t header;
+    _is.read((char*)&header, sizeof(header));
+    if(_is.fail())
+        return false;
+    if(header & BIT_SEQ_MORE){
+        header &= ~BIT_SEQ_MORE;
+        if(header % 8 != 0)
+            return false;
+    }
+    else
+        _last = true;
+    _size += header;
+    return true;
+}
+
+
+decode_status Huffman::read_bit_seq(std::istream& src, std::vector<byte_t>& bytes, std::size_t& nbits){
+    nbits = 0;
+    while(true){
+        seq_size_t header;
+        src.read((char*)&header, sizeof(header));
+        if(src.fail())
+            return decode_status::truncated;
+        const bool more = header & BIT_SEQ_MORE;
+        header &= ~BIT_SEQ_MORE;
+        if(more && header % 8 != 0)
+            return decode_status::corrupt;
+        // Размер из заголовка не проверен, поэтому буфер растёт по BIT_SEQ_CHUNK байт вслед за прочитанным
+        const std::size_t start = bytes.size();
+        const std::size_t size = (std::size_t(header) + 7) / 8;
+        while(bytes.size() - start < size){
+            const std::size_t at = bytes.size();
+            bytes.resize(at + std::min(size - (at - start), BIT_SEQ_CHUNK));
+            src.read((char*)bytes.data() + at, bytes.size() - at);
+            if(src.fail()){
+                bytes.resize(at + src.gcount());
+                nbits += 8 * (bytes.size() - start);
+                return decode_status::truncated;
+            }
+        }
+        nbits += header;
+        if(!more)
+            return decode_status::ok;
+    }
+}
+
+
+std::size_t Huffman::bit_seq_header_bits(std::size_t pos){
+    // Кодеры пишут куски с продолжением по BIT_SEQ_CHUNK байт
+    return 8 * sizeof(seq_size_t) * (1 + pos / (8 * BIT_SEQ_CHUNK));
+}
+
+
+
+
+std::string decode_result::message() const{
+    std::string what;
+    switch(status){
+    case decode_status::ok:             return "ok";
+    case decode_status::truncated:      what = "data is truncated"; break;
+    case decode_status::corrupt:        what = "data format error"; break;
+    case decode_status::unknown_method: what = "unknown compression method"; break;
+    }
+    return what + " at bit " + std::to_string(position);
 }
 
 
@@ -103,58 +217,370 @@ void bit_iseq::next_byte(){
 Строит дерево Хаффмана.
 Принимает на вход используемые символы и их частоты
 */
-HuffmanTree::HuffmanTree(const std::map<char, double>& m){
+template<class Symbol>
+BasicHuffmanTree<Symbol>::BasicHuffmanTree(const std::map<Symbol, double>& m){
     construct(m);
 }
 
 
 // Кодирует сообщение m и записывает результат в cm
-void HuffmanTree::encode(std::istream& src, std::ostream& dst){
+template<class Symbol>
+void BasicHuffmanTree<Symbol>::encode(std::istream& src, std::ostream& dst){
+    prepare_encode_table();
+    const int max_length = max_code_length;
+    if(max_length == 0 || max_length > 64 - 8){
+        // Дерево из одного листа или код не помещается в накопитель - побитовая запись
+        bit_oseq bit_seq_dst(dst);
+        while(true){
+            Symbol symb;
+            src.read((char*)&symb, sizeof(symb));
+            if(!src.good()){
+                src.clear();
+                break;
+            }
+            encode(symb, bit_seq_dst);
+        }
+        return;
+    }
+    const int unroll = max_length <= MAX_UNROLLED_CODE_LENGTH? 4 : (64 - 8) / max_length;
+
+    // Целые байты каждой порции сразу уходят в bit_oseq, в накопителе между порциями остаётся меньше 8 бит
+    constexpr std::size_t CHUNK = 1 << 16;
+    std::vector<Symbol> in(CHUNK);
+    std::vector<byte_t> out(CHUNK * max_length / 8 + 16);
     bit_oseq bit_seq_dst(dst);
-    bool arr[256];  // глубина дерева не превосходит его размера, а размер не больше количества символов - 256
-    while(true){
-        int j = 0;
-        char symb = src.get();
-        if(!src.good()){
-            src.clear();
-            break;
+    uint64_t acc = 0;
+    int nbits = 0;
+    while(src){
+        src.read((char*)in.data(), CHUNK * sizeof(Symbol));
+        const std::size_t n = src.gcount() / sizeof(Symbol);  // неполный последний символ отбрасывается
+        byte_t* o = out.data();
+        if(!encode_chunk(unroll, encode_table.data(), in.data(), n, o, acc, nbits))
+            for(std::size_t i = 0; i < n; i++)
+                find_leaf_with_symbol(in[i]);  // бросит исключение с нужным символом
+        bit_seq_dst.write_bytes(out.data(), o - out.data());
+    }
+    src.clear();
+    for(int k = 0; k < nbits; k++)
+        bit_seq_dst.write((acc >> k) & 1);
+}
+
+
+template<class Symbol>
+std::size_t BasicHuffmanTree<Symbol>::encode(const Symbol* src, std::size_t n, std::vector<byte_t>& dst){
+    prepare_encode_table();
+    const int max_length = max_code_length;
+    if(max_length == 0 || max_length > 64 - 8){
+        std::stringstream ss;
+        {
+            bit_oseq bit_seq_dst(ss);
+            for(std::size_t i = 0; i < n; i++)
+                encode(src[i], bit_seq_dst);
         }
-        Node* node = &find_leaf_with_symbol(symb);  // тут может вылететь исключение, что символа нет в дереве
-        while(node->ip != (uint16_t)-1){
-            arr[j] = node->v;
-            node = &nodes[node->ip];
-            j++;
+        // Заголовки кусков снимаются: в памяти биты идут подряд
+        std::size_t size;
+        read_bit_seq(ss, dst, size);
+        return size;
+    }
+    const int unroll = max_length <= MAX_UNROLLED_CODE_LENGTH? 4 : (64 - 8) / max_length;
+
+    const std::size_t start = dst.size();
+    dst.resize(start + n * max_length / 8 + 16);
+    byte_t* o = dst.data() + start;
+    uint64_t acc = 0;
+    int nbits = 0;
+    if(!encode_chunk(unroll, encode_table.data(), src, n, o, acc, nbits)){
+        dst.resize(start);
+        for(std::size_t i = 0; i < n; i++)
+            find_leaf_with_symbol(src[i]);
+    }
+    std::size_t bits = (o - dst.data() - start) * 8 + nbits;
+    if(nbits > 0)
+        *o++ = acc;
+    dst.resize(o - dst.data());
+    return bits;
+}
+
+
+template<class Symbol>
+int BasicHuffmanTree<Symbol>::build_encode_table(std::vector<EncodeEntry>& table){
+    table.assign(std::size_t(1) << (8 * sizeof(Symbol)), EncodeEntry{0, 0});
+    int max_length = 0;
+    int N = (nodes.size() + 1) / 2;
+    for(int i = 0; i < N && nodes.size() > 1; i++){
+        // От листа к корню: последний бит кода приходит первым и уезжает в старшие разряды
+        uint64_t code = 0;
+        int len = 0;
+        for(const Node* node = &nodes[i]; node->ip != (uint16_t)-1; node = &nodes[node->ip]){
+            if(len < 64)
+                code = (code << 1) | node->v;
+            len++;
         }
-        while(j > 0){
-            j--;
-            bit_seq_dst.write(arr[j]);
+        table[USymbol(nodes[i].symb)] = {code, (uint8_t)std::min(len, 255)};
+        max_length = std::max(max_length, len);
+    }
+    return max_length;
+}
+
+
+template<class Symbol>
+template<int U>
+bool BasicHuffmanTree<Symbol>::encode_kernel(const EncodeEntry* table, const Symbol* src, std::size_t n, byte_t*& out, uint64_t& acc, int& nbits){
+    std::size_t i = 0;
+    uint8_t missing = 0;
+    // Внутри группы из U кодов нет ни ветвлений, ни записи в память - только сдвиги накопителя
+    for(; i + U <= n; i += U){
+        for(int j = 0; j < U; j++){
+            const EncodeEntry e = table[USymbol(src[i + j])];
+            acc |= e.code << nbits;
+            nbits += e.len;
+            missing |= e.len == 0;
         }
+        std::memcpy(out, &acc, sizeof(acc));
+        out += nbits >> 3;
+        acc >>= nbits & ~7;
+        nbits &= 7;
+    }
+    for(; i < n; i++){
+        const EncodeEntry e = table[USymbol(src[i])];
+        acc |= e.code << nbits;
+        nbits += e.len;
+        missing |= e.len == 0;
+        std::memcpy(out, &acc, sizeof(acc));
+        out += nbits >> 3;
+        acc >>= nbits & ~7;
+        nbits &= 7;
+    }
+    return !missing;
+}
+
+
+template<class Symbol>
+bool BasicHuffmanTree<Symbol>::encode_chunk(int unroll, const EncodeEntry* table, const Symbol* src, std::size_t n, byte_t*& out, uint64_t& acc, int& nbits){
+    switch(unroll){
+    case 4:  return encode_kernel<4>(table, src, n, out, acc, nbits);
+    case 3:  return encode_kernel<3>(table, src, n, out, acc, nbits);
+    case 2:  return encode_kernel<2>(table, src, n, out, acc, nbits);
+    default: return encode_kernel<1>(table, src, n, out, acc, nbits);
     }
 }
 
+
 // Декодирует сообщение cm и записывает результат в m 
-void HuffmanTree::decode(std::istream& src, std::ostream& dst){
-    try{
-        bit_iseq bit_seq_src(src);
-        std::size_t i = 0;
-        while(!bit_seq_src.end_of_seq()){
-            Node* node = &nodes[nodes.size()-1];
-            while(!node->is_leaf()){
-                node = &nodes[node->next_node_index(bit_seq_src.read())];
-                i++;
+template<class Symbol>
+void BasicHuffmanTree<Symbol>::decode(std::istream& src, std::ostream& dst){
+    decode_result res = try_decode(src, dst);
+    if(!res.ok())
+        throw HuffmanException(res.message());
+}
+
+template<class Symbol>
+void BasicHuffmanTree<Symbol>::decode(const byte_t* data, std::size_t size, std::vector<Symbol>& dst){
+    decode_result res = try_decode(data, size, dst);
+    if(!res.ok())
+        throw HuffmanException(res.message());
+}
+
+
+template<class Symbol>
+decode_result BasicHuffmanTree<Symbol>::try_decode(std::istream& src, std::ostream& dst){
+    std::vector<byte_t> data;
+    std::size_t size;
+    const decode_status read = read_bit_seq(src, data, size);
+    if(read == decode_status::corrupt || (read == decode_status::truncated && size == 0))
+        return {read, size + bit_seq_header_bits(size) - 8 * sizeof(seq_size_t)};
+    // При обрыве декодируем то, что успели прочитать: ошибка будет на первом недостающем бите
+    std::vector<Symbol> res;
+    decode_result status = try_decode(data.data(), size, res);
+    dst.write((const char*)res.data(), res.size() * sizeof(Symbol));
+    if(status.ok() && read == decode_status::truncated)
+        status = {decode_status::truncated, size};
+    if(!status.ok())
+        status.position += bit_seq_header_bits(status.position);
+    return status;
+}
+
+
+template<class Symbol>
+decode_result BasicHuffmanTree<Symbol>::try_decode(const byte_t* data, std::size_t size, std::vector<Symbol>& dst){
+    if(size == 0)
+        return {};
+    if(nodes.empty() || nodes.back().is_leaf())  // у кода из одного листа нулевая длина
+        return {decode_status::corrupt, 0};
+
+    prepare_decode_table();
+    const int bits = decode_bits;
+    const DecodeEntry* const table = decode_table.data();
+    const uint64_t mask = (uint64_t(1) << bits) - 1;
+    const std::size_t nbytes = (std::size_t(size) + 7) / 8;
+    const Node* const leaves = nodes.data();
+
+    std::size_t pos = 0;
+    std::size_t out = dst.size();
+    decode_status status = decode_status::ok;
+
+    /*
+    Быстрый цикл: пока от текущего байта до конца данных есть 8 байт, следующие
+    биты берутся одним 64-битным чтением (формат везде little-endian), и из слова
+    подряд декодируются коды, пока в нём остаётся не меньше bits бит: код длиной
+    до bits бит - одно обращение к таблице и сдвиг слова, новое чтение из памяти
+    нужно раз в несколько кодов. Последний байт слова не используется, поэтому
+    коды из таблицы не выходят за size.
+    Выход dst расширяется кусками по CHUNK символов (с запасом на одно слово),
+    внутри куска границы не проверяются.
+    */
+    constexpr std::size_t CHUNK = 4096;
+    while((pos >> 3) + 8 <= nbytes && status == decode_status::ok){
+        dst.resize(out + CHUNK + 64);
+        Symbol* const dst_ptr = dst.data() + out;
+        std::size_t k = 0;
+        while(k < CHUNK && (pos >> 3) + 8 <= nbytes){
+            uint64_t word;
+            std::memcpy(&word, data + (pos >> 3), sizeof(word));
+            word >>= pos & 7;
+            int avail = 56 - (pos & 7);
+            while(avail >= bits){
+                const DecodeEntry e = table[word & mask];
+                word >>= e.len;
+                avail -= e.len;
+                pos += e.len;
+                uint16_t node = e.node;
+                if(!leaves[node].is_leaf()){  // редкий случай: код длиннее таблицы
+                    status = walk_to_leaf(data, size, pos, node);
+                    if(status == decode_status::ok)
+                        dst_ptr[k++] = leaves[node].symb;
+                    break;
+                }
+                dst_ptr[k++] = leaves[node].symb;
             }
-            assert(node->is_leaf());
-            dst.write(&node->symb, 1);
+            if(status != decode_status::ok)
+                break;
+        }
+        out += k;
+    }
+    dst.resize(out);
+
+    // Медленный цикл для конца буфера: побитово, каждый переход проверяется
+    while(pos < size && status == decode_status::ok){
+        uint16_t node = nodes.size() - 1;
+        status = walk_to_leaf(data, size, pos, node);
+        if(status == decode_status::ok)
+            dst.push_back(nodes[node].symb);
+    }
+    if(status != decode_status::ok)
+        return {status, pos};
+    return {};
+}
+
+
+template<class Symbol>
+int BasicHuffmanTree<Symbol>::build_decode_table(std::vector<DecodeEntry>& table){
+    // Глубина дерева: таблица длиннее самого длинного кода не нужна
+    int depth = 0;
+    std::vector<std::pair<uint16_t, int>> stack = {{uint16_t(nodes.size() - 1), 0}};
+    while(!stack.empty() && depth < DECODE_TABLE_BITS){
+        auto [i, d] = stack.back();
+        stack.pop_back();
+        if(d >= DECODE_TABLE_BITS + 1)
+            continue;
+        if(nodes[i].is_leaf()){
+            depth = std::max(depth, d);
+            continue;
         }
+        stack.push_back({nodes[i].i0, d + 1});
+        stack.push_back({nodes[i].i1, d + 1});
     }
-    catch(...){
+    const int bits = std::max(1, std::min(depth, DECODE_TABLE_BITS));
+
+    table.resize(std::size_t(1) << bits);
+    for(std::size_t index = 0; index < table.size(); index++){
+        uint16_t node = nodes.size() - 1;
+        int len = 0;
+        while(len < bits && !nodes[node].is_leaf()){
+            node = nodes[node].next_node_index((index >> len) & 1);
+            len++;
+        }
+        table[index] = {node, (uint8_t)len};
+    }
+    return bits;
+}
+
+
+template<class Symbol>
+decode_status BasicHuffmanTree<Symbol>::walk_to_leaf(const byte_t* data, std::size_t size, std::size_t& pos, uint16_t& node){
+    while(!nodes[node].is_leaf()){
+        if(pos >= size)
+            return decode_status::truncated;
+        node = nodes[node].next_node_index((data[pos >> 3] >> (pos & 7)) & 1);
+        pos++;
+    }
+    return decode_status::ok;
+}
+
+
+template<class Symbol>
+std::map<Symbol, std::vector<bool>> BasicHuffmanTree<Symbol>::codes(){
+    std::map<Symbol, std::vector<bool>> res;
+    int N = (nodes.size() + 1) / 2;
+    for(int i = 0; i < N; i++){
+        std::vector<bool> code;
+        Node* node = &nodes[i];
+        while(node->ip != (uint16_t)-1){
+            code.push_back(node->v);
+            node = &nodes[node->ip];
+        }
+        res[nodes[i].symb] = std::vector<bool>(code.rbegin(), code.rend());
+    }
+    return res;
+}
+
+
+template<class Symbol>
+void BasicHuffmanTree<Symbol>::encode(Symbol symb, bit_oseq& dst){
+    bool arr[MAX_LEAVES];  // глубина дерева меньше числа листьев
+    int j = 0;
+    Node* node = &find_leaf_with_symbol(symb);  // тут может вылететь исключение, что символа нет в дереве
+    while(node->ip != (uint16_t)-1){
+        arr[j] = node->v;
+        node = &nodes[node->ip];
+        j++;
+    }
+    while(j > 0){
+        j--;
+        dst.write(arr[j]);
+    }
+}
+
+
+template<class Symbol>
+Symbol BasicHuffmanTree<Symbol>::decode(bit_iseq& src){
+    Symbol symb;
+    if(!try_decode(src, symb))
         throw HuffmanException("data format error");
+    return symb;
+}
+
+
+template<class Symbol>
+bool BasicHuffmanTree<Symbol>::try_decode(bit_iseq& src, Symbol& symb){
+    if(nodes.empty())
+        return false;
+    uint16_t node = nodes.size() - 1;
+    while(!nodes[node].is_leaf()){
+        bool bit;
+        if(!src.try_read(bit))
+            return false;
+        node = nodes[node].next_node_index(bit);
     }
+    symb = nodes[node].symb;
+    return true;
 }
 
 
 // Алгоритм создания дерева. Принимает на вход используемые символы и их частоты
-void HuffmanTree::construct(const std::map<char, double>& m){
+template<class Symbol>
+void BasicHuffmanTree<Symbol>::construct(const std::map<Symbol, double>& m){
+    assert(m.size() <= MAX_LEAVES);
     int N = m.size();
     nodes.resize(2*N - 1);
     std::multiset<CNode> cnodes;
@@ -199,49 +625,357 @@ void HuffmanTree::construct(const std::map<char, double>& m){
     }
     assert(cnodes.size() == 1);
     assert(i == 2*N - 1);
+    index_leaves();
 }
 
 
 // Запись в файл и чтение из файла в бинарном виде
 
-void HuffmanTree::save(std::ostream& dst){
+template<class Symbol>
+void BasicHuffmanTree<Symbol>::save(std::ostream& dst){
     uint16_t size = nodes.size();
     dst.write((char*)&size, sizeof(size));
     dst.write((char*)&nodes[0], nodes.size() * sizeof(Node));
 }
 
-void HuffmanTree::load(std::istream& src){
+template<class Symbol>
+void BasicHuffmanTree<Symbol>::load(std::istream& src){
+    const decode_status status = try_load(src);
+    if(status == decode_status::truncated)
+        throw HuffmanException("file is too small");
+    if(status != decode_status::ok)
+        throw HuffmanException("data format error");
+}
+template<class Symbol>
+decode_status BasicHuffmanTree<Symbol>::try_load(std::istream& src){
     uint16_t size;
     src.read((char*)&size, sizeof(size));
     if(!src.good())
-        throw HuffmanException("file is too small");
-    nodes.resize(size);
-    src.read((char*)&nodes[0], nodes.size() * sizeof(Node));
+        return decode_status::truncated;
+    if(size == 0 || size % 2 == 0 || size > 2 * MAX_LEAVES - 1)
+        return decode_status::corrupt;
+    std::vector<Node> loaded(size);
+    src.read((char*)loaded.data(), loaded.size() * sizeof(Node));
     if(!src.good())
-        throw HuffmanException("file is too small");
+        return decode_status::truncated;
+    const decode_status status = validate_nodes((const byte_t*)loaded.data(), loaded.size());
+    if(status != decode_status::ok)
+        return status;
+    nodes.swap(loaded);
+    index_leaves();
+    return decode_status::ok;
+}
+template<class Symbol>
+decode_status BasicHuffmanTree<Symbol>::try_load(const byte_t* data, std::size_t size){
+    const decode_status status = validate_saved(data, size);
+    if(status != decode_status::ok)
+        return status;
+    uint16_t count;
+    std::memcpy(&count, data, sizeof(count));
+    nodes.resize(count);
+    std::memcpy(nodes.data(), data + sizeof(count), count * sizeof(Node));
+    index_leaves();
+    return decode_status::ok;
+}
+
+
+template<class Symbol>
+decode_status BasicHuffmanTree<Symbol>::validate_saved(const byte_t* data, std::size_t size){
+    uint16_t count;
+    if(size < sizeof(count))
+        return decode_status::truncated;
+    std::memcpy(&count, data, sizeof(count));
+    if(count == 0 || count % 2 == 0 || count > 2 * MAX_LEAVES - 1)
+        return decode_status::corrupt;
+    if(size - sizeof(count) < count * sizeof(Node))
+        return decode_status::truncated;
+    return validate_nodes(data + sizeof(count), count);
+}
+
+template<class Symbol>
+decode_status BasicHuffmanTree<Symbol>::validate_nodes(const byte_t* records, std::size_t count){
+    // Поля читаются из байтов записи: в ней может быть и недопустимое значение bool
+    auto field = [&](std::size_t i, std::size_t offset){
+        uint16_t value;
+        std::memcpy(&value, records + i * sizeof(Node) + offset, sizeof(value));
+        return value;
+    };
+    auto flag = [&](std::size_t i){ return records[i * sizeof(Node) + offsetof(Node, v)]; };
+    constexpr uint16_t NONE = -1;
+
+    const std::size_t leaves = (count + 1) / 2;
+    for(std::size_t i = 0; i < count; i++){
+        if(flag(i) > 1)
+            return decode_status::corrupt;
+        const uint16_t i0 = field(i, offsetof(Node, i0));
+        const uint16_t i1 = field(i, offsetof(Node, i1));
+        if(i == count - 1 && field(i, offsetof(Node, ip)) != NONE)
+            return decode_status::corrupt;
+        if(i < leaves){
+            if(i0 != NONE || i1 != NONE)
+                return decode_status::corrupt;
+            continue;
+        }
+        // Одинаковые потомки не пройдут проверку v: у первого он 0, у второго 1
+        if(i0 >= i || i1 >= i)
+            return decode_status::corrupt;
+        if(field(i0, offsetof(Node, ip)) != i || flag(i0) != 0 || field(i1, offsetof(Node, ip)) != i || flag(i1) != 1)
+            return decode_status::corrupt;
+    }
+    return decode_status::ok;
+}
+
+
+template<class Symbol>
+void BasicHuffmanTree<Symbol>::save_compact(bit_oseq& dst, int symbol_bits){
+    std::vector<uint16_t> stack{(uint16_t)(nodes.size() - 1)};
+    while(!stack.empty()){
+        Node& node = nodes[stack.back()];
+        stack.pop_back();
+        dst.write(node.is_leaf());
+        if(node.is_leaf()){
+            for(int k = symbol_bits - 1; k >= 0; k--)
+                dst.write(((USymbol)node.symb >> k) & 1);
+        }
+        else{
+            stack.push_back(node.i1);
+            stack.push_back(node.i0);
+        }
+    }
+}
+
+template<class Symbol>
+void BasicHuffmanTree<Symbol>::load_compact(bit_iseq& src, int symbol_bits){
+    assert(symbol_bits >= 1 && symbol_bits <= (int)(8 * sizeof(Symbol)));
+    const std::size_t max_leaves = std::min(MAX_LEAVES, std::size_t(1) << symbol_bits);
+    // Сначала читаем дерево в порядке обхода, потом нумеруем как в construct:
+    // листья в начале, внутренние узлы после своих потомков, корень последний
+    struct PNode{
+        bool leaf;
+        USymbol symb;
+        int i0, i1, parent;
+    };
+    std::vector<PNode> order;
+    std::vector<int> open{-1};  // узлы, ждущие второго потомка
+    std::size_t leaves = 0;
+    while(!open.empty()){
+        int parent = open.back();
+        if(parent != -1 && order[parent].i0 != -1)
+            open.pop_back();
+        int index = order.size();
+        if(parent != -1){
+            if(order[parent].i0 == -1)
+                order[parent].i0 = index;
+            else
+                order[parent].i1 = index;
+        }
+        else{
+            open.pop_back();
+        }
+        PNode node{src.read(), 0, -1, -1, parent};
+        if(node.leaf){
+            for(int k = 0; k < symbol_bits; k++)
+                node.symb = (node.symb << 1) | src.read();
+            leaves += 1;
+        }
+        else{
+            open.push_back(index);
+        }
+        order.push_back(node);
+        if(leaves > max_leaves || order.size() > 2 * max_leaves - 1)
+            throw HuffmanException("data format error");
+    }
+
+    if(leaves < 2)
+        throw HuffmanException("data format error");
+
+    std::vector<uint16_t> index(order.size());
+    std::size_t next_leaf = 0;
+    std::size_t next_inner = leaves;
+    for(int i = order.size() - 1; i >= 0; i--)  // в обратном прямом порядке потомки идут раньше родителя
+        index[i] = order[i].leaf ? next_leaf++ : next_inner++;
+
+    nodes.resize(order.size());
+    for(std::size_t i = 0; i < order.size(); i++){
+        const PNode& p = order[i];
+        Node& node = nodes[index[i]];
+        node.i0 = p.leaf ? (uint16_t)-1 : index[p.i0];
+        node.i1 = p.leaf ? (uint16_t)-1 : index[p.i1];
+        node.ip = p.parent == -1 ? (uint16_t)-1 : index[p.parent];
+        node.v = p.parent != -1 && order[p.parent].i1 == (int)i;
+        node.symb = p.symb;
+    }
+    index_leaves();
 }
 
 
-std::size_t HuffmanTree::additional_data_size(){
+template<class Symbol>
+std::size_t BasicHuffmanTree<Symbol>::additional_data_size(){
     return sizeof(uint16_t) + nodes.size() * sizeof(Node) + sizeof(seq_size_t);
 }
 
 
-bool HuffmanTree::operator==(const HuffmanTree& t) const{
+template<class Symbol>
+std::vector<uint8_t> BasicHuffmanTree<Symbol>::code_lengths(){
+    prepare_encode_table();
+    std::vector<uint8_t> lengths(encode_table.size());
+    for(std::size_t s = 0; s < lengths.size(); s++)
+        lengths[s] = encode_table[s].len;
+    return lengths;
+}
+
+
+template<class Symbol>
+bool BasicHuffmanTree<Symbol>::try_construct_canonical(const std::vector<uint8_t>& lengths){
+    constexpr int MAX_LENGTH = 64;
+    if(lengths.size() > (std::size_t(1) << (8 * sizeof(Symbol))))
+        return false;
+    std::size_t bl_count[MAX_LENGTH + 1] = {};
+    std::size_t N = 0;
+    for(uint8_t len : lengths){
+        if(len > MAX_LENGTH)
+            return false;
+        if(len != 0){
+            bl_count[len]++;
+            N++;
+        }
+    }
+    if(N < 2 || N > MAX_LEAVES)
+        return false;
+
+    // Код полный, если на каждой глубине свободных мест ровно столько, сколько нужно оставшимся символам
+    std::size_t left = 1, remaining = N;
+    for(int len = 1; len <= MAX_LENGTH; len++){
+        left <<= 1;
+        if(bl_count[len] > left)
+            return false;
+        left -= bl_count[len];
+        remaining -= bl_count[len];
+        if(left > remaining)
+            return false;
+    }
+    if(left != 0)
+        return false;
+
+    uint64_t next_code[MAX_LENGTH + 2] = {};
+    uint64_t code = 0;
+    for(int len = 1; len <= MAX_LENGTH; len++){
+        code = (code + bl_count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+
+    // Дерево по кодам от корня (первый бит кода - старший), потом нумерация как в construct
+    struct TNode{
+        int child[2] = {-1, -1};
+        int symbol = -1;
+    };
+    std::vector<TNode> tnodes(1);
+    tnodes.reserve(2 * N - 1);
+    for(std::size_t s = 0; s < lengths.size(); s++){
+        const int len = lengths[s];
+        if(len == 0)
+            continue;
+        const uint64_t c = next_code[len]++;
+        int t = 0;
+        for(int k = len - 1; k >= 0; k--){
+            const int bit = (c >> k) & 1;
+            if(tnodes[t].child[bit] == -1){
+                tnodes[t].child[bit] = tnodes.size();
+                tnodes.emplace_back();
+            }
+            t = tnodes[t].child[bit];
+        }
+        tnodes[t].symbol = s;
+    }
+    assert(tnodes.size() == 2 * N - 1);
+
+    // Обход в обратном порядке: потомки получают номера раньше родителей, корень - последний
+    std::vector<uint16_t> index(tnodes.size());
+    int next_leaf = 0, next_inner = N;
+    std::vector<std::pair<int, bool>> stack = {{0, false}};
+    while(!stack.empty()){
+        auto [t, done] = stack.back();
+        stack.pop_back();
+        if(tnodes[t].symbol != -1)
+            index[t] = next_leaf++;
+        else if(done)
+            index[t] = next_inner++;
+        else{
+            stack.push_back({t, true});
+            stack.push_back({tnodes[t].child[1], false});
+            stack.push_back({tnodes[t].child[0], false});
+        }
+    }
+
+    nodes.assign(tnodes.size(), Node{(uint16_t)-1, (uint16_t)-1, (uint16_t)-1, false, Symbol()});
+    for(std::size_t t = 0; t < tnodes.size(); t++){
+        Node& node = nodes[index[t]];
+        if(tnodes[t].symbol != -1){
+            node.symb = Symbol(tnodes[t].symbol);
+            continue;
+        }
+        for(int bit : {0, 1}){
+            const uint16_t child = index[tnodes[t].child[bit]];
+            (bit ? node.i1 : node.i0) = child;
+            nodes[child].ip = index[t];
+            nodes[child].v = bit;
+        }
+    }
+    index_leaves();
+    return true;
+}
+
+
+template<class Symbol>
+std::size_t BasicHuffmanTree<Symbol>::saved_size(std::size_t leaves){
+    return sizeof(uint16_t) + (2 * std::max<std::size_t>(leaves, 1) - 1) * sizeof(Node);
+}
+
+
+template<class Symbol>
+std::size_t BasicHuffmanTree<Symbol>::cost(const std::vector<std::size_t>& count){
+    prepare_encode_table();
+    std::size_t bits = 0;
+    for(std::size_t s = 0; s < count.size(); s++){
+        if(count[s] == 0)
+            continue;
+        if(s >= leaf_index.size() || leaf_index[s] == (uint16_t)-1)
+            return SIZE_MAX;
+        bits += count[s] * encode_table[s].len;
+    }
+    return bits;
+}
+
+
+template<class Symbol>
+void BasicHuffmanTree<Symbol>::prepare_encode_table(){
+    if(encode_table.empty())
+        max_code_length = build_encode_table(encode_table);
+}
+
+template<class Symbol>
+void BasicHuffmanTree<Symbol>::prepare_decode_table(){
+    if(decode_table.empty() && nodes.size() > 1)
+        decode_bits = build_decode_table(decode_table);
+}
+
+
+template<class Symbol>
+bool BasicHuffmanTree<Symbol>::operator==(const BasicHuffmanTree& t) const{
     return nodes == t.nodes;
 }
 
 
-bool HuffmanTree::Node::is_leaf(){
+template<class Symbol>
+bool BasicHuffmanTree<Symbol>::Node::is_leaf() const{
     return i0 == (uint16_t)-1 && i1 == (uint16_t)-1;
 }
-uint16_t HuffmanTree::Node::next_node_index(bool bit){
-    uint16_t res = bit? i1 : i0;
-    if(res == -1)
-        throw 0;
-    return res;
+template<class Symbol>
+uint16_t BasicHuffmanTree<Symbol>::Node::next_node_index(bool bit) const{
+    return bit? i1 : i0;
 }
-bool HuffmanTree::Node::operator==(const Node& n) const{
+template<class Symbol>
+bool BasicHuffmanTree<Symbol>::Node::operator==(const Node& n) const{
     return i0 == n.i0 && 
         i1 == n.i1 && 
         ip == n.ip && 
@@ -252,42 +986,168 @@ bool HuffmanTree::Node::operator==(const Node& n) const{
 
 
 
-HuffmanTree::Node& HuffmanTree::find_leaf_with_symbol(char symb){
+template<class Symbol>
+typename BasicHuffmanTree<Symbol>::Node& BasicHuffmanTree<Symbol>::find_leaf_with_symbol(Symbol symb){
+    USymbol s = symb;
+    if(s >= leaf_index.size() || leaf_index[s] == (uint16_t)-1)
+        throw HuffmanException("symbol '" + std::to_string(symb) + "' does not exist in the huffman tree");
+    Node& node = nodes[leaf_index[s]];
+    assert(node.is_leaf() && node.symb == symb);
+    return node;
+}
+
+template<class Symbol>
+void BasicHuffmanTree<Symbol>::index_leaves(){
+    encode_table.clear();
+    max_code_length = 0;
+    decode_table.clear();
+    decode_bits = 0;
+    leaf_index.clear();
     int N = (nodes.size() + 1) / 2;
     for(int i = 0; i < N; i++){
-        Node& node = nodes[i];
-        assert(node.is_leaf());
-        if(node.symb == symb){
-            return node;
-        }
+        USymbol s = nodes[i].symb;
+        if(s >= leaf_index.size())
+            leaf_index.resize(s + 1, (uint16_t)-1);
+        leaf_index[s] = i;
     }
-    throw HuffmanException("symbol '" + std::to_string(symb) + "' does not exist in the huffman tree");
 }
 
 
 
 // Подсчитывает количества всех входящих в текст src символов. Осталяет курсор потока на месте.
-std::map<char, double> Huffman::counts(std::istream& src){
-    std::map<char, double> p;
+template<class Symbol>
+std::map<Symbol, double> Huffman::counts(std::istream& src){
+    using USymbol = typename std::make_unsigned<Symbol>::type;
     auto state = src.rdstate();
     auto pos = src.tellg();
-    while(true){
-        char symb = src.get();
+    // Счётчики в массиве по всем значениям символа, поток читается кусками; map собирается в конце
+    std::vector<std::size_t> count(std::size_t(1) << (8 * sizeof(Symbol)), 0);
+    std::vector<Symbol> chunk(1 << 16);
+    while(src){
+        src.read((char*)chunk.data(), chunk.size() * sizeof(Symbol));
+        const std::size_t n = src.gcount() / sizeof(Symbol);  // неполный последний символ не считается
+        for(std::size_t i = 0; i < n; i++)
+            count[USymbol(chunk[i])]++;
+    }
+    src.clear(state);
+    src.seekg(pos);
+
+    std::map<Symbol, double> p;
+    for(std::size_t s = 0; s < count.size(); s++)
+        if(count[s] != 0)
+            p[Symbol(s)] = count[s];
+    return p;
+}
+
+
+template class Huffman::BasicHuffmanTree<char>;
+template class Huffman::BasicHuffmanTree<uint16_t>;
+template std::map<char, double> Huffman::counts<char>(std::istream& src);
+template std::map<uint16_t, double> Huffman::counts<uint16_t>(std::istream& src);
+
+
+std::map<char, double> Huffman::sampled_counts(std::istream& src, std::size_t block_size, std::size_t blocks){
+    auto state = src.rdstate();
+    auto pos = src.tellg();
+    src.seekg(0, src.end);
+    std::size_t length = src.tellg() - pos;
+    src.seekg(pos);
+    if(block_size == 0 || blocks == 0 || length <= block_size * blocks){
+        src.clear(state);
+        return counts(src);
+    }
+
+    std::size_t count[256] = {};
+    std::vector<char> block(block_size);
+    std::size_t stride = length / blocks;  // stride >= block_size, блоки не перекрываются
+    for(std::size_t i = 0; i < blocks; i++){
+        src.seekg(pos + (std::streamoff)(i * stride));
+        src.read(block.data(), block_size);
+        std::size_t n = src.gcount();
+        for(std::size_t j = 0; j < n; j++)
+            count[(byte_t)block[j]] += 1;
         if(!src.good())
             break;
-        if(p.count(symb) == 0)
-            p[symb] = 1;
-        else
-            p[symb] += 1;
     }
     src.clear(state);
     src.seekg(pos);
+
+    // Символ, не встретившийся в выборке, всё равно получает код, чуть длиннее самого редкого из встреченных
+    std::map<char, double> p;
+    for(int b = 0; b < 256; b++)
+        p[(char)b] = count[b] != 0 ? count[b] : 0.5;
     return p;
 }
 
 
-std::size_t Huffman::encode(std::istream& src, std::ostream& dst){
-    auto p = counts(src);
+std::size_t Huffman::encode(std::istream& src, std::ostream& dst, const encode_options& opt){
+    if(opt.pipeline){
+        dst.put((char)method::blocks);
+        return sizeof(method) + pipeline_encode(src, dst, opt);
+    }
+
+    std::map<char, double> p;
+    if(opt.coder == method::huffman || opt.coder == method::fse)
+        p = opt.sample ? sampled_counts(src, opt.sample_block, opt.sample_blocks) : counts(src);
+    if(opt.coder == method::huffman && !opt.sample){
+        // Несжимаемые данные (уже сжатые, зашифрованные) выгоднее хранить как есть: дерево даже не строится
+        std::vector<std::size_t> count(256, 0);
+        uint64_t size = 0;
+        for(auto [symb, n] : p){
+            count[(byte_t)symb] = n;
+            size += n;
+        }
+        if(p.size() == 1){
+            // Один повторённый байт: дерево с фиктивными символами дало бы бит на байт, а так - только длина
+            dst.put((char)method::run);
+            dst.write((const char*)&size, sizeof(size));
+            dst.put(p.begin()->first);
+            src.seekg(0, src.end);
+            return sizeof(method) + sizeof(size) + 1;
+        }
+        if(should_store_block(count, size, opt.min_gain)){
+            dst.put((char)method::stored);
+            dst.write((const char*)&size, sizeof(size));
+            char buffer[1 << 16];
+            while(src){
+                src.read(buffer, sizeof(buffer));
+                dst.write(buffer, src.gcount());
+            }
+            src.clear();
+            return sizeof(method) + sizeof(size);
+        }
+    }
+
+    dst.put((char)opt.coder);
+    if(opt.coder == method::adaptive){
+        AdaptiveHuffmanTree tree;
+        tree.encode(src, dst);
+        return sizeof(method) + sizeof(seq_size_t);
+    }
+    if(opt.coder == method::lz77)
+        return sizeof(method) + lz77_encode(src, dst, opt.level);
+    if(opt.coder == method::rle)
+        return sizeof(method) + rle_encode(src, dst);
+    if(opt.coder == method::bwt)
+        return sizeof(method) + bwt_encode(src, dst, opt.block_size, opt.threads);
+    if(opt.coder == method::static_text){
+        text_code.encode(src, dst);
+        return sizeof(method) + sizeof(seq_size_t);
+    }
+    if(opt.coder == method::order1){
+        ContextModel model(src, opt.context_tables);
+        model.save(dst);
+        model.encode(src, dst);
+        return sizeof(method) + model.additional_data_size();
+    }
+
+    if(opt.coder == method::fse){
+        FseTable table(p);
+        table.save(dst);
+        table.encode(src, dst);
+        return sizeof(method) + table.additional_data_size();
+    }
+
     if(p.size() <= 1){
         p[0] = 0;
         p[1] = 0;
@@ -295,15 +1155,184 @@ std::size_t Huffman::encode(std::istream& src, std::ostream& dst){
     HuffmanTree tree(p);
     tree.save(dst);
     tree.encode(src, dst);
-    return tree.additional_data_size();
+    return sizeof(method) + tree.additional_data_size();
 }
 
-std::size_t Huffman::decode(std::istream& src, std::ostream& dst){
+// Декодирует method::huffman без исключений. Метод уже прочитан, позиция ошибки - от начала данных
+static decode_result try_decode_huffman(std::istream& src, std::ostream& dst, std::size_t& additional_size){
     HuffmanTree tree;
-    tree.load(src);
-    tree.decode(src, dst);
-    return tree.additional_data_size();
+    const decode_status status = tree.try_load(src);
+    if(status != decode_status::ok)
+        return {status, 8 * sizeof(method)};
+    decode_result res = tree.try_decode(src, dst);
+    if(!res.ok()){
+        res.position += 8 * (sizeof(method) + tree.additional_data_size() - sizeof(seq_size_t));
+        return res;
+    }
+    additional_size = sizeof(method) + tree.additional_data_size();
+    return res;
+}
+
+
+// Копирует данные method::stored. Метод уже прочитан
+static decode_result try_decode_stored(std::istream& src, std::ostream& dst, std::size_t& additional_size){
+    uint64_t size;
+    src.read((char*)&size, sizeof(size));
+    if(!src.good())
+        return {decode_status::truncated, 8 * sizeof(method)};
+    char buffer[1 << 16];
+    uint64_t copied = 0;
+    while(copied < size){
+        src.read(buffer, std::min<uint64_t>(size - copied, sizeof(buffer)));
+        dst.write(buffer, src.gcount());
+        copied += src.gcount();
+        if(!src.good())
+            break;
+    }
+    if(copied < size)
+        return {decode_status::truncated, 8 * (sizeof(method) + sizeof(size) + copied)};
+    additional_size = sizeof(method) + sizeof(size);
+    return {};
 }
 
 
+std::size_t Huffman::decode(std::istream& src, std::ostream& dst, int threads){
+    char m = src.get();
+    if(!src.good())
+        throw HuffmanException("file is too small");
 
+    if(m == (char)method::adaptive){
+        AdaptiveHuffmanTree tree;
+        tree.decode(src, dst);
+        return sizeof(method) + sizeof(seq_size_t);
+    }
+    if(m == (char)method::fse){
+        FseTable table;
+        table.load(src);
+        table.decode(src, dst);
+        return sizeof(method) + table.additional_data_size();
+    }
+    if(m == (char)method::lz77)
+        return sizeof(method) + lz77_decode(src, dst);
+    if(m == (char)method::rle)
+        return sizeof(method) + rle_decode(src, dst);
+    if(m == (char)method::bwt)
+        return sizeof(method) + bwt_decode(src, dst, threads);
+    if(m == (char)method::blocks)
+        return sizeof(method) + pipeline_decode(src, dst, threads);
+    if(m == (char)method::huffman_block)
+        throw HuffmanException("huffman block can only be decoded inside a block stream");
+    if(m == (char)method::run){
+        uint64_t size;
+        src.read((char*)&size, sizeof(size));
+        char symb = src.get();
+        if(!src.good())
+            throw HuffmanException("file is too small");
+        // Длина ничем не ограничена, поэтому запись прекращается, как только dst перестаёт принимать данные
+        std::string buffer(std::min<uint64_t>(size, 1 << 16), symb);
+        for(uint64_t left = size; left > 0 && dst; left -= std::min<uint64_t>(left, buffer.size()))
+            dst.write(buffer.data(), std::min<uint64_t>(left, buffer.size()));
+        if(!dst)
+            throw HuffmanException("can't write output file");
+        return sizeof(method) + sizeof(size) + 1;
+    }
+    if(m == (char)method::stored){
+        std::size_t additional_size;
+        decode_result res = try_decode_stored(src, dst, additional_size);
+        if(!res.ok())
+            throw HuffmanException(res.message());
+        return additional_size;
+    }
+    if(m == (char)method::static_text){
+        text_code.decode(src, dst);
+        return sizeof(method) + sizeof(seq_size_t);
+    }
+    if(m == (char)method::order1){
+        ContextModel model;
+        model.load(src);
+        model.decode(src, dst);
+        return sizeof(method) + model.additional_data_size();
+    }
+    if(m != (char)method::huffman)
+        throw HuffmanException("unknown compression method");
+
+    std::size_t additional_size;
+    decode_result res = try_decode_huffman(src, dst, additional_size);
+    if(!res.ok())
+        throw HuffmanException(res.message());
+    return additional_size;
+}
+
+
+decode_result Huffman::try_decode(std::istream& src, std::ostream& dst, std::size_t& additional_size, int threads){
+    const int m = src.peek();
+    if(m == std::char_traits<char>::eof())
+        return {decode_status::truncated, 0};
+    if(m > (int)method::run)
+        return {decode_status::unknown_method, 0};
+    if(m == (int)method::huffman){
+        src.get();
+        return try_decode_huffman(src, dst, additional_size);
+    }
+    if(m == (int)method::stored){
+        src.get();
+        return try_decode_stored(src, dst, additional_size);
+    }
+
+    // Остальные декодеры пока сообщают об ошибках исключениями
+    const std::streampos begin = src.tellg();
+    auto corrupt = [&]() -> decode_result {
+        src.clear();
+        const std::streampos at = src.tellg();
+        if(begin == std::streampos(-1) || at == std::streampos(-1))
+            return {decode_status::corrupt, 0};
+        return {decode_status::corrupt, 8 * std::size_t(at - begin)};
+    };
+    try{
+        additional_size = decode(src, dst, threads);
+        return {};
+    }
+    catch(const HuffmanException&){
+        return corrupt();
+    }
+    catch(const std::exception&){
+        // Размеры из заголовков блоков могут дать bad_alloc или length_error - это тоже повреждённые данные
+        return corrupt();
+    }
+}
+
+
+void Huffman::write_file_header(std::ostream& dst){
+    dst.write(FILE_MAGIC, sizeof(FILE_MAGIC));
+    dst.put((char)FILE_VERSION);
+}
+
+void Huffman::check_file_header(const char* header){
+    if(std::memcmp(header, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0)
+        throw HuffmanException("data format error");
+    if((byte_t)header[sizeof(FILE_MAGIC)] != FILE_VERSION)
+        throw HuffmanException("unsupported file format version " + std::to_string((byte_t)header[sizeof(FILE_MAGIC)]));
+}
+
+
+std::size_t Huffman::encode_file(std::istream& src, std::ostream& dst, const encode_options& opt){
+    write_file_header(dst);
+    return FILE_HEADER_SIZE + encode(src, dst, opt);
+}
+
+
+std::size_t Huffman::decode_file(std::istream& src, std::ostream& dst, int threads){
+    if(src.peek() != FILE_MAGIC[0]){
+        // Файл первой версии: дерево и код без заголовка и байта способа
+        HuffmanTree tree;
+        tree.load(src);
+        tree.decode(src, dst);
+        return tree.additional_data_size();
+    }
+    char header[FILE_HEADER_SIZE];
+    src.read(header, sizeof(header));
+    if(!src.good())
+        throw HuffmanException("file is too small");
+    check_file_header(header);
+    return FILE_HEADER_SIZE + decode(src, dst, threads);
+}
@@ -0,0 +1,615 @@
+#include "huffman_block.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+using namespace Huffman;
+
+
+
+// Заголовки любого блока в потоке: [размер][размер сжатого], элемент индекса, способ и тип блока
+static constexpr std::size_t BLOCK_FRAMING = 2 * sizeof(uint32_t) + 3 * sizeof(uint64_t) + sizeof(method) + sizeof(block_type);
+
+
+/*
+Запись длин кодов блока (block_type::tree). Поток бит, младший бит байта - первый.
+Сначала какие байты есть в блоке: чередующиеся серии отсутствующих и присутствующих
+байтов (первая - отсутствующих, может быть пустой), длина серии n - гамма-код Элиаса
+числа n + 1. Затем длины присутствующих байтов по возрастанию, каждая относительно
+предыдущей (до первой - 8) маленьким постоянным префиксным кодом:
+
+    0           та же длина
+    10 s        на 1 больше (s = 0) или меньше (s = 1)
+    110 nnn     та же длина ещё 3 + nnn раз
+    1110 s      на 2 больше или меньше
+    1111 lllll  длина 1 + lllll
+*/
+static constexpr int BLOCK_MAX_CODE_LENGTH = 32;
+static constexpr int FIRST_PREV_LENGTH = 8;
+static constexpr int MIN_REPEAT = 3, MAX_REPEAT = 10;
+
+
+// Пишет биты в строку
+class BitWriter{
+public:
+    explicit BitWriter(std::string& dst): dst(dst) {}
+
+    void put(uint32_t value, int nbits){
+        for(int k = 0; k < nbits; k++, pos++){
+            if(pos % 8 == 0)
+                dst.push_back(0);
+            dst.back() |= ((value >> k) & 1) << (pos % 8);
+        }
+    }
+
+private:
+    std::string& dst;
+    std::size_t pos = 0;
+};
+
+
+// Только считает биты: размер записи без самой записи
+class BitCounter{
+public:
+    void put(uint32_t, int nbits){ bits += nbits; }
+
+    std::size_t bits = 0;
+};
+
+
+class BitReader{
+public:
+    BitReader(const char* data, std::size_t size): data((const byte_t*)data), size(size) {}
+
+    uint32_t get(int nbits){
+        if(pos + nbits > 8 * size)
+            throw HuffmanException("file is too small");
+        uint32_t value = 0;
+        for(int k = 0; k < nbits; k++, pos++)
+            value |= uint32_t((data[pos / 8] >> (pos % 8)) & 1) << k;
+        return value;
+    }
+
+    // Сколько целых байтов занято прочитанными битами
+    std::size_t bytes() const { return (pos + 7) / 8; }
+
+private:
+    const byte_t* data;
+    std::size_t size;
+    std::size_t pos = 0;
+};
+
+
+template<class Sink>
+static void put_gamma(Sink& dst, uint32_t value){
+    int n = 0;
+    while((value >> (n + 1)) != 0)
+        n++;
+    dst.put(0, n);
+    dst.put(1, 1);
+    dst.put(value, n);
+}
+
+
+static uint32_t get_gamma(BitReader& src){
+    int n = 0;
+    while(src.get(1) == 0)
+        if(++n > 9)  // серия не длиннее 256
+            throw HuffmanException("data format error");
+    return (uint32_t(1) << n) | src.get(n);
+}
+
+
+template<class Sink>
+static void put_code_lengths(Sink& dst, const uint8_t* lengths){
+    bool present = false;
+    for(int b = 0; b < 256;){
+        int run = 0;
+        while(b + run < 256 && (lengths[b + run] != 0) == present)
+            run++;
+        put_gamma(dst, run + 1);
+        b += run;
+        present = !present;
+    }
+
+    int prev = FIRST_PREV_LENGTH;
+    for(int b = 0; b < 256;){
+        const int len = lengths[b];
+        if(len == 0){
+            b++;
+            continue;
+        }
+        // Повтор (6 бит) выгоднее нулей, начиная с 7 одинаковых длин
+        int run = 0, end = b;
+        for(; end < 256 && run < MAX_REPEAT; end++)
+            if(lengths[end] != 0){
+                if(lengths[end] != prev)
+                    break;
+                run++;
+            }
+        if(run >= 7){
+            dst.put(0b011, 3);
+            dst.put(run - MIN_REPEAT, 3);
+            b = end;
+            continue;
+        }
+        if(len == prev)
+            dst.put(0, 1);
+        else if(len == prev + 1 || len == prev - 1){
+            dst.put(0b01, 2);
+            dst.put(len < prev, 1);
+        }
+        else if(len == prev + 2 || len == prev - 2){
+            dst.put(0b0111, 4);
+            dst.put(len < prev, 1);
+        }
+        else{
+            dst.put(0b1111, 4);
+            dst.put(len - 1, 5);
+        }
+        prev = len;
+        b++;
+    }
+}
+
+
+static std::vector<uint8_t> get_code_lengths(BitReader& src){
+    std::vector<uint8_t> lengths(256, 0);
+    std::vector<int> present;
+    bool is_present = false;
+    for(std::size_t b = 0; b < 256;){
+        const std::size_t run = get_gamma(src) - 1;
+        if(run > 256 - b)
+            throw HuffmanException("data format error");
+        for(std::size_t k = 0; is_present && k < run; k++)
+            present.push_back(b + k);
+        b += run;
+        is_present = !is_present;
+    }
+
+    int prev = FIRST_PREV_LENGTH;
+    for(std::size_t i = 0; i < present.size();){
+        int len;
+        if(src.get(1) == 0)
+            len = prev;
+        else if(src.get(1) == 0)
+            len = src.get(1) ? prev - 1 : prev + 1;
+        else if(src.get(1) == 0){
+            const std::size_t n = MIN_REPEAT + src.get(3);
+            if(n > present.size() - i)
+                throw HuffmanException("data format error");
+            for(std::size_t k = 0; k < n; k++)
+                lengths[present[i++]] = prev;
+            continue;
+        }
+        else if(src.get(1) == 0)
+            len = src.get(1) ? prev - 2 : prev + 2;
+        else
+            len = 1 + src.get(5);
+        if(len < 1 || len > BLOCK_MAX_CODE_LENGTH)
+            throw HuffmanException("data format error");
+        lengths[present[i++]] = len;
+        prev = len;
+    }
+    return lengths;
+}
+
+
+std::vector<std::size_t> Huffman::byte_counts(const char* data, std::size_t size){
+    // Четыре независимых счётчика, чтобы подряд идущие одинаковые байты не ждали друг друга
+    std::vector<std::size_t> count[4];
+    for(auto& c : count)
+        c.assign(256, 0);
+    const byte_t* p = (const byte_t*)data;
+    std::size_t i = 0;
+    for(; i + 4 <= size; i += 4){
+        count[0][p[i]]++;
+        count[1][p[i + 1]]++;
+        count[2][p[i + 2]]++;
+        count[3][p[i + 3]]++;
+    }
+    for(; i < size; i++)
+        count[0][p[i]]++;
+    for(int b = 0; b < 256; b++)
+        count[0][b] += count[1][b] + count[2][b] + count[3][b];
+    return count[0];
+}
+
+
+// Длины кодов в lengths[256], без выделения памяти: split_block оценивает так тысячи отрезков
+static void fill_code_lengths(const std::size_t* count, uint8_t* lengths){
+    std::size_t weight[256];
+    std::copy(count, count + 256, weight);
+    while(true){
+        std::pair<std::size_t, int> leaves[256];
+        int n = 0;
+        for(int b = 0; b < 256; b++)
+            if(weight[b] != 0)
+                leaves[n++] = {weight[b], b};
+        // Дереву нужно хотя бы два листа, как в encode
+        for(int fake : {0, 1})
+            if(n < 2 && weight[fake] == 0)
+                leaves[n++] = {0, fake};
+        std::sort(leaves, leaves + n);
+
+        // Две очереди: листья по возрастанию и внутренние узлы, которые появляются тоже по возрастанию.
+        // Узлы 0..n-1 - листья, n.. - внутренние, корень последний
+        std::size_t inner[256];
+        int parent[2 * 256 - 1];
+        int leaf = 0, inner_begin = 0, inner_end = 0;
+        auto take = [&](){
+            if(leaf < n && (inner_begin == inner_end || leaves[leaf].first <= inner[inner_begin])){
+                const int i = leaf++;
+                return std::make_pair(leaves[i].first, i);
+            }
+            const int i = inner_begin++;
+            return std::make_pair(inner[i], n + i);
+        };
+        for(int k = 1; k < n; k++){
+            auto x = take(), y = take();
+            parent[x.second] = parent[y.second] = n + inner_end;
+            inner[inner_end++] = x.first + y.first;
+        }
+        int depth[2 * 256 - 1];
+        depth[2 * n - 2] = 0;
+        int max_depth = 0;
+        for(int v = 2 * n - 3; v >= 0; v--){
+            depth[v] = depth[parent[v]] + 1;
+            max_depth = std::max(max_depth, depth[v]);
+        }
+        if(max_depth <= BLOCK_MAX_CODE_LENGTH){
+            std::fill(lengths, lengths + 256, 0);
+            for(int i = 0; i < n; i++)
+                lengths[leaves[i].second] = depth[i];
+            return;
+        }
+        // Слишком длинные коды (частоты по числам Фибоначчи): сглаживаем частоты и строим заново
+        for(auto& w : weight)
+            w = (w + 1) / 2;
+    }
+}
+
+
+std::vector<uint8_t> Huffman::block_code_lengths(const std::size_t* count){
+    std::vector<uint8_t> lengths(256);
+    fill_code_lengths(count, lengths.data());
+    return lengths;
+}
+
+
+std::size_t Huffman::block_tree_header_size(const std::vector<uint8_t>& lengths){
+    BitCounter counter;
+    put_code_lengths(counter, lengths.data());
+    return (counter.bits + 7) / 8;
+}
+
+
+SharedTree Huffman::make_block_tree(const std::vector<std::size_t>& count){
+    SharedTree tree = std::make_shared<HuffmanTree>();
+    if(!tree->try_construct_canonical(block_code_lengths(count.data())))
+        throw HuffmanException("can't build a block tree");
+    tree->prepare_encode_table();
+    return tree;
+}
+
+
+bool Huffman::should_store_block(const std::vector<std::size_t>& count, std::size_t size, double min_gain){
+    std::size_t bits = huffman_code_bits(count.data());
+    const std::size_t n = std::count_if(count.begin(), count.end(), [](std::size_t c){ return c != 0; });
+    bits += 8 * (sizeof(method) + HuffmanTree::saved_size(std::max<std::size_t>(n, 2)) + sizeof(seq_size_t));
+    const std::size_t stored_bits = 8 * (sizeof(method) + sizeof(uint64_t) + size);
+    return bits > stored_bits * (1 - min_gain);
+}
+
+
+// Ширина номера символа в блоке small для distinct разных байтов
+static int small_width(int distinct){
+    return distinct <= 2 ? 1 : distinct <= 4 ? 2 : 4;
+}
+
+
+block_type Huffman::choose_block_type(const std::vector<std::size_t>& count, std::size_t size, double min_gain){
+    const int distinct = std::count_if(count.begin(), count.end(), [](std::size_t n){ return n != 0; });
+    if(distinct == 1)
+        return block_type::single;
+
+    block_type type = block_type::tree;
+    std::size_t best = estimate_block_bits(count.data());
+    if(distinct > 0 && distinct <= 16){
+        const int k = small_width(distinct);
+        const std::size_t small = 8 * (BLOCK_FRAMING + 1 + (std::size_t(1) << k) + sizeof(uint32_t)) + (size * k + 7) / 8 * 8;
+        // Блок small разжимается таблицей быстрее кода Хаффмана, поэтому список его символов
+        // не учитывается: при равной длине кода он выигрывает у короткой записи длин кодов
+        if(small - 8 * (std::size_t(1) << k) <= best){
+            best = small;
+            type = block_type::small;
+        }
+    }
+    const std::size_t stored_bits = 8 * (BLOCK_FRAMING + size);
+    return best > stored_bits * (1 - min_gain) ? block_type::stored : type;
+}
+
+
+std::size_t Huffman::encode_stored_block(const char* data, std::size_t size, std::string& dst){
+    dst.push_back((char)method::huffman_block);
+    dst.push_back((char)block_type::stored);
+    dst.append(data, size);
+    return sizeof(method) + sizeof(block_type);
+}
+
+
+std::size_t Huffman::encode_single_block(const char* data, std::size_t size, std::string& dst){
+    const uint32_t length = size;
+    dst.push_back((char)method::huffman_block);
+    dst.push_back((char)block_type::single);
+    dst.push_back(data[0]);
+    dst.append((const char*)&length, sizeof(length));
+    return sizeof(method) + sizeof(block_type) + 1 + sizeof(length);
+}
+
+
+std::size_t Huffman::encode_small_block(const char* data, std::size_t size, const std::vector<std::size_t>& count, std::string& dst){
+    const int distinct = std::count_if(count.begin(), count.end(), [](std::size_t n){ return n != 0; });
+    const int k = small_width(distinct);
+    std::string symbols(std::size_t(1) << k, 0);
+    byte_t index[256] = {};
+    for(int b = 0, i = 0; b < 256; b++)
+        if(count[b] != 0){
+            index[b] = i;
+            symbols[i++] = (char)b;
+        }
+
+    const uint32_t length = size;
+    dst.push_back((char)method::huffman_block);
+    dst.push_back((char)block_type::small);
+    dst.push_back((char)k);
+    dst += symbols;
+    dst.append((const char*)&length, sizeof(length));
+
+    // k делит 8, номер символа не переходит через границу байта
+    const std::size_t begin = dst.size();
+    dst.resize(begin + (size * k + 7) / 8, 0);
+    byte_t* out = (byte_t*)&dst[begin];
+    for(std::size_t i = 0; i < size; i++)
+        out[(i * k) >> 3] |= index[(byte_t)data[i]] << ((i * k) & 7);
+    return sizeof(method) + sizeof(block_type) + 1 + symbols.size() + sizeof(length);
+}
+
+
+SharedTree Huffman::choose_block_tree(const std::vector<std::size_t>& count, const SharedTree& fresh, const SharedTree& prev){
+    if(prev == nullptr)
+        return fresh;
+    const std::size_t prev_bits = prev->cost(count);
+    if(prev_bits == SIZE_MAX)
+        return fresh;
+    const std::size_t tree_bytes = block_tree_header_size(fresh->code_lengths());
+    return prev_bits <= fresh->cost(count) + 8 * tree_bytes ? prev : fresh;
+}
+
+
+std::size_t Huffman::encode_huffman_block(const char* data, std::size_t size, const SharedTree& tree, const SharedTree& prev, std::string& dst){
+    const bool repeat = tree == prev;
+    dst.push_back((char)method::huffman_block);
+    dst.push_back((char)(repeat ? block_type::repeat : block_type::tree));
+    const std::size_t header_begin = dst.size();
+    if(!repeat){
+        BitWriter header(dst);
+        put_code_lengths(header, tree->code_lengths().data());
+    }
+    const std::size_t additional_size = sizeof(method) + sizeof(block_type) + dst.size() - header_begin + sizeof(seq_size_t);
+
+    std::vector<byte_t> bits;
+    const std::size_t nbits = tree->encode(data, size, bits);
+    if(nbits > UINT32_MAX)
+        throw HuffmanException("block is too large");
+    const seq_size_t seq_size = nbits;
+    dst.append((const char*)&seq_size, sizeof(seq_size));
+    dst.append((const char*)bits.data(), bits.size());
+    return additional_size;
+}
+
+
+HuffmanBlockHeader Huffman::read_huffman_block_header(const char* data, std::size_t size, const SharedTree& prev){
+    if(size < sizeof(method) + sizeof(block_type) || data[0] != (char)method::huffman_block)
+        throw HuffmanException("data format error");
+    HuffmanBlockHeader header;
+    header.type = (block_type)data[1];
+    header.data_offset = sizeof(method) + sizeof(block_type);
+    if(header.type == block_type::repeat){
+        if(prev == nullptr)
+            throw HuffmanException("block repeats a tree, but there is no previous tree");
+        header.tree = prev;
+    }
+    else if(header.type == block_type::stored || header.type == block_type::single || header.type == block_type::small)
+        header.tree = prev;
+    else if(header.type == block_type::tree){
+        BitReader src(data + header.data_offset, size - header.data_offset);
+        header.tree = std::make_shared<HuffmanTree>();
+        if(!header.tree->try_construct_canonical(get_code_lengths(src)))
+            throw HuffmanException("data format error");
+        header.tree->prepare_decode_table();
+        header.data_offset += src.bytes();
+    }
+    else
+        throw HuffmanException("unknown block type");
+    return header;
+}
+
+
+static std::size_t decode_single_block(const char* data, std::size_t size, std::size_t pos, std::size_t expected_size, std::string& dst){
+    uint32_t length;
+    if(pos + 1 + sizeof(length) > size)
+        throw HuffmanException("file is too small");
+    std::memcpy(&length, data + pos + 1, sizeof(length));
+    if(length != expected_size)
+        throw HuffmanException("data format error");
+    dst.assign(length, data[pos]);
+    return pos + 1 + sizeof(length);
+}
+
+
+static std::size_t decode_small_block(const char* data, std::size_t size, std::size_t pos, std::size_t expected_size, std::string& dst){
+    if(pos >= size)
+        throw HuffmanException("file is too small");
+    const int k = data[pos];
+    if(k != 1 && k != 2 && k != 4)
+        throw HuffmanException("data format error");
+    const byte_t* symbols = (const byte_t*)data + pos + 1;
+    uint32_t length;
+    pos += 1 + (std::size_t(1) << k);
+    if(pos + sizeof(length) > size)
+        throw HuffmanException("file is too small");
+    std::memcpy(&length, data + pos, sizeof(length));
+    if(length != expected_size)
+        throw HuffmanException("data format error");
+    pos += sizeof(length);
+    const std::size_t nbytes = (std::size_t(length) * k + 7) / 8;
+    if(nbytes > size - pos)
+        throw HuffmanException("file is too small");
+
+    // Для каждого байта данных - 8/k символов, которые он кодирует, одним словом (little-endian)
+    const int per_byte = 8 / k;
+    const int mask = (1 << k) - 1;
+    uint64_t table[256];
+    for(int b = 0; b < 256; b++){
+        table[b] = 0;
+        for(int j = 0; j < per_byte; j++)
+            table[b] |= uint64_t(symbols[(b >> (j * k)) & mask]) << (8 * j);
+    }
+    dst.resize(nbytes * per_byte + sizeof(uint64_t));
+    char* out = &dst[0];
+    const byte_t* in = (const byte_t*)data + pos;
+    for(std::size_t i = 0; i < nbytes; i++)
+        std::memcpy(out + i * per_byte, &table[in[i]], sizeof(uint64_t));
+    dst.resize(length);
+    return pos;
+}
+
+
+std::size_t Huffman::decode_huffman_block(const char* data, std::size_t size, const HuffmanBlockHeader& header, std::size_t expected_size, std::string& dst){
+    if(header.type == block_type::stored){
+        if(size - header.data_offset != expected_size)
+            throw HuffmanException("data format error");
+        dst.assign(data + header.data_offset, size - header.data_offset);
+        return header.data_offset;
+    }
+    if(header.type == block_type::single)
+        return decode_single_block(data, size, header.data_offset, expected_size, dst);
+    if(header.type == block_type::small)
+        return decode_small_block(data, size, header.data_offset, expected_size, dst);
+    seq_size_t nbits;
+    if(header.data_offset + sizeof(nbits) > size)
+        throw HuffmanException("file is too small");
+    std::memcpy(&nbits, data + header.data_offset, sizeof(nbits));
+    const std::size_t begin = header.data_offset + sizeof(nbits);
+    if((std::size_t(nbits) + 7) / 8 > size - begin)
+        throw HuffmanException("file is too small");
+    // Код каждого байта не короче бита, так что бит не может быть меньше, чем байтов
+    if(nbits < expected_size)
+        throw HuffmanException("data format error");
+
+    std::vector<char> out;
+    out.reserve(expected_size);
+    header.tree->decode((const byte_t*)data + begin, nbits, out);
+    dst.assign(out.begin(), out.end());
+    return begin;
+}
+
+
+std::size_t Huffman::huffman_code_bits(const std::size_t* count){
+    std::size_t weights[256];
+    int n = 0;
+    for(int b = 0; b < 256; b++)
+        if(count[b] != 0)
+            weights[n++] = count[b];
+    if(n == 1)
+        return weights[0];  // дерево с фиктивным вторым символом, 1 бит на байт
+    // Две очереди: листья по возрастанию и внутренние узлы, которые появляются тоже по возрастанию
+    std::sort(weights, weights + n);
+    std::size_t inner[256];
+    std::size_t bits = 0;
+    int leaf = 0, inner_begin = 0, inner_end = 0;
+    auto take = [&](){
+        if(leaf < n && (inner_begin == inner_end || weights[leaf] <= inner[inner_begin]))
+            return weights[leaf++];
+        return inner[inner_begin++];
+    };
+    for(int k = 1; k < n; k++){
+        const std::size_t w = take() + take();
+        inner[inner_end++] = w;
+        bits += w;
+    }
+    return bits;
+}
+
+
+std::size_t Huffman::estimate_block_bits(const std::size_t* count){
+    uint8_t lengths[256];
+    fill_code_lengths(count, lengths);
+    BitCounter header;
+    put_code_lengths(header, lengths);
+    std::size_t bits = 0;
+    for(int b = 0; b < 256; b++)
+        bits += count[b] * lengths[b];
+    return bits + 8 * (BLOCK_FRAMING + (header.bits + 7) / 8 + sizeof(seq_size_t));
+}
+
+
+std::vector<std::size_t> Huffman::split_block(const char* data, std::size_t size, double min_speed){
+    const auto start = std::chrono::steady_clock::now();
+    const auto budget = std::chrono::duration<double>(min_speed > 0 ? size / (min_speed * 1e6) : 1e9);
+
+    // Для очень больших блоков кусок крупнее, чтобы накопленные частоты занимали не больше 1024 кусков
+    const std::size_t unit = std::max(SPLIT_UNIT, (size + 1023) / 1024);
+    const std::size_t units = (size + unit - 1) / unit;
+    if(units < 2)
+        return {size};
+
+    // prefix[k] - частоты первых k кусков
+    std::vector<std::size_t> prefix((units + 1) * 256, 0);
+    for(std::size_t k = 0; k < units; k++){
+        std::size_t* row = &prefix[(k + 1) * 256];
+        std::copy(row - 256, row, row);
+        const std::size_t end = std::min(size, (k + 1) * unit);
+        for(std::size_t i = k * unit; i < end; i++)
+            row[(byte_t)data[i]]++;
+    }
+    auto estimate = [&](std::size_t lo, std::size_t hi){
+        std::size_t count[256];
+        for(int b = 0; b < 256; b++)
+            count[b] = prefix[hi * 256 + b] - prefix[lo * 256 + b];
+        return estimate_block_bits(count);
+    };
+
+    std::vector<std::size_t> cuts;  // границы частей в кусках
+    std::vector<std::pair<std::size_t, std::size_t>> todo = {{0, units}};
+    while(!todo.empty() && std::chrono::steady_clock::now() - start < budget){
+        auto [lo, hi] = todo.back();
+        todo.pop_back();
+        if(hi - lo < 2)
+            continue;
+        std::size_t best_cut = lo, best = estimate(lo, hi);
+        for(std::size_t k = lo + 1; k < hi; k++){
+            const std::size_t bits = estimate(lo, k) + estimate(k, hi);
+            if(bits < best){
+                best = bits;
+                best_cut = k;
+            }
+        }
+        if(best_cut == lo)
+            continue;
+        cuts.push_back(best_cut);
+        todo.push_back({lo, best_cut});
+        todo.push_back({best_cut, hi});
+    }
+
+    std::sort(cuts.begin(), cuts.end());
+    std::vector<std::size_t> parts;
+    std::size_t prev = 0;
+    for(std::size_t cut : cuts){
+        parts.push_back(cut * unit - prev);
+        prev = cut * unit;
+    }
+    parts.push_back(size - prev);
+    return parts;
+}
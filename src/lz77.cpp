@@ -0,0 +1,181 @@
+#include "lz77.h"
+#include <iterator>
+#include <sstream>
+
+using namespace Huffman;
+
+
+
+static constexpr int HASH_BITS = 15;
+
+
+Lz77::Lz77(int level){
+    level = std::max(1, std::min(level, 9));
+    max_chain = 1 << (level + 1);
+    nice_length = std::min(MAX_MATCH, 16 + level * 24);
+    lazy = level >= 4;
+}
+
+
+Lz77Streams Lz77::parse(const std::string& data){
+    const byte_t* d = (const byte_t*)data.data();
+    const std::size_t n = data.size();
+    std::vector<int32_t> head(1 << HASH_BITS, -1);
+    std::vector<int32_t> prev(WINDOW, -1);
+
+    auto hash = [&](std::size_t i){
+        uint32_t v = d[i] | d[i + 1] << 8 | d[i + 2] << 16;
+        return (v * 2654435761u) >> (32 - HASH_BITS);
+    };
+
+    // Добавляет в цепочки все позиции до pos
+    std::size_t inserted = 0;
+    auto insert_until = [&](std::size_t pos){
+        for(; inserted < pos && inserted + MIN_MATCH <= n; inserted++){
+            uint32_t h = hash(inserted);
+            prev[inserted & (WINDOW - 1)] = head[h];
+            head[h] = inserted;
+        }
+        inserted = std::max(inserted, pos);
+    };
+
+    // Самый длинный повтор для позиции i среди уже добавленных позиций
+    auto find = [&](std::size_t i, int& best_dist){
+        int best = 0;
+        if(i + MIN_MATCH > n)
+            return best;
+        std::size_t limit = std::min<std::size_t>(MAX_MATCH, n - i);
+        int32_t cand = head[hash(i)];
+        for(int chain = max_chain; chain > 0 && cand >= 0 && i - cand <= WINDOW; chain--){
+            if(d[cand + best] == d[i + best]){
+                std::size_t l = 0;
+                while(l < limit && d[cand + l] == d[i + l])
+                    l++;
+                if((int)l > best){
+                    best = l;
+                    best_dist = i - cand;
+                    if(best >= nice_length || l == limit)
+                        break;
+                }
+            }
+            int32_t next = prev[cand & (WINDOW - 1)];
+            if(next >= cand)
+                break;  // ячейка уже занята более новой позицией - цепочка вышла за окно
+            cand = next;
+        }
+        return best >= MIN_MATCH ? best : 0;
+    };
+
+    Lz77Streams res;
+    std::size_t i = 0;
+    while(i < n){
+        int dist = 0;
+        insert_until(i);
+        int len = find(i, dist);
+        if(len != 0 && lazy && len < nice_length && i + 1 < n){
+            int next_dist = 0;
+            insert_until(i + 1);
+            if(find(i + 1, next_dist) > len)
+                len = 0;
+        }
+        if(len == 0){
+            res.lengths.push_back(0);
+            res.literals.push_back(d[i]);
+            i += 1;
+            continue;
+        }
+        res.lengths.push_back((char)(len - MIN_MATCH + 1));
+        res.distances.push_back((char)(dist & 0xff));
+        res.distances.push_back((char)(dist >> 8));
+        i += len;
+    }
+    return res;
+}
+
+
+std::string Lz77::restore(const Lz77Streams& streams){
+    std::string res;
+    std::size_t li = 0;
+    std::size_t di = 0;
+    for(char l : streams.lengths){
+        byte_t len = l;
+        if(len == 0){
+            if(li >= streams.literals.size())
+                throw HuffmanException("data format error");
+            res.push_back(streams.literals[li++]);
+            continue;
+        }
+        if(di + 2 > streams.distances.size())
+            throw HuffmanException("data format error");
+        std::size_t dist = (byte_t)streams.distances[di] | (byte_t)streams.distances[di + 1] << 8;
+        di += 2;
+        if(dist == 0 || dist > res.size())
+            throw HuffmanException("data format error");
+        std::size_t from = res.size() - dist;
+        for(int k = 0; k < len + MIN_MATCH - 1; k++)
+            res.push_back(res[from + k]);  // повтор может перекрываться с самим собой
+    }
+    return res;
+}
+
+
+
+
+// Сжимает один поток своим деревом Хаффмана. Дерево записывается компактно
+static std::size_t encode_stream(const std::string& data, std::ostream& dst){
+    std::istringstream src(data);
+    auto p = counts(src);
+    if(p.size() <= 1){
+        p[0] = 0;
+        p[1] = 0;
+    }
+    HuffmanTree tree(p);
+    bit_oseq tree_dst(dst);
+    tree.save_compact(tree_dst);
+    std::size_t tree_size = (tree_dst.size() + 7) / 8;
+    tree_dst.destroy();
+    tree.encode(src, dst);
+    return 2 * sizeof(seq_size_t) + tree_size;
+}
+
+static std::string decode_stream(std::istream& src, std::size_t& additional_size){
+    std::ostringstream dst;
+    HuffmanTree tree;
+    try{
+        bit_iseq tree_src(src);
+        tree.load_compact(tree_src);
+        additional_size += 2 * sizeof(seq_size_t) + (tree_src.size() + 7) / 8;
+    }
+    catch(const HuffmanException&){
+        throw;
+    }
+    catch(...){
+        throw HuffmanException("data format error");
+    }
+    tree.decode(src, dst);
+    return dst.str();
+}
+
+
+std::size_t Huffman::lz77_encode(std::istream& src, std::ostream& dst, int level){
+    std::string data{std::istreambuf_iterator<char>(src), std::istreambuf_iterator<char>()};
+    src.clear();
+    Lz77Streams streams = Lz77(level).parse(data);
+    std::size_t additional_size = 0;
+    additional_size += encode_stream(streams.lengths, dst);
+    additional_size += encode_stream(streams.literals, dst);
+    additional_size += encode_stream(streams.distances, dst);
+    return additional_size;
+}
+
+
+std::size_t Huffman::lz77_decode(std::istream& src, std::ostream& dst){
+    Lz77Streams streams;
+    std::size_t additional_size = 0;
+    streams.lengths = decode_stream(src, additional_size);
+    streams.literals = decode_stream(src, additional_size);
+    streams.distances = decode_stream(src, additional_size);
+    std::string data = Lz77::restore(streams);
+    dst.write(data.data(), data.size());
+    return additional_size;
+}
@@ -1,7 +1,12 @@
 
 #include "huffman.h"
+#include "dictionary.h"
+#include "pipeline.h"
+#include "batch.h"
+#include "archive.h"
 #include <iostream>
 #include <fstream>
+#include <filesystem>
 
 
 using namespace Huffman;
@@ -9,19 +14,178 @@ using namespace std;
 
 
 struct command{
-    enum {ENCODE, DECODE, UNDEFINED} action;
+    enum {ENCODE, DECODE, TRAIN, UNDEFINED} action;
     const char* file_path;
     const char* output_path;
+    encode_options options;
+    std::vector<const char*> dict_paths;  // словари, загружаемые при запуске
+    int dict_id;                          // идентификатор словаря, -1 - первый загруженный
+    io_backend io;                        // не stream - файлы читаются и пишутся конвейером напрямую
+    const char* batch_list;               // пакетный режим: файл со списком путей, "-" - стандартный ввод
+    std::vector<const char*> globs;       // пакетный режим: шаблоны путей
+    bool archive;                         // сжимать файлы пакета в один архив / извлекать файлы из архива
+    std::vector<const char*> members;     // какие члены архива извлекать, пусто - все
+    bool range;                           // разжать только часть файла: range_offset, range_length
+    uint64_t range_offset;
+    uint64_t range_length;
     command():
-        action(UNDEFINED), file_path(nullptr), output_path(nullptr)
+        action(UNDEFINED), file_path(nullptr), output_path(nullptr), dict_id(-1), io(io_backend::stream), batch_list(nullptr), archive(false),
+        range(false), range_offset(0), range_length(UINT64_MAX)
     { }
 };
 
 
 
+// Пути файлов пакета из --batch и --glob. false, если файла со списком нет
+bool collect_paths(const command& c, std::vector<std::string>& paths){
+    if(c.batch_list != nullptr){
+        if(std::string(c.batch_list) == "-")
+            paths = read_path_list(cin);
+        else{
+            ifstream list(c.batch_list);
+            if(!list){
+                cout << "file list does not exist: " << c.batch_list << endl;
+                return false;
+            }
+            paths = read_path_list(list);
+        }
+    }
+    for(const char* pattern : c.globs){
+        auto matched = expand_glob(pattern);
+        paths.insert(paths.end(), matched.begin(), matched.end());
+    }
+    return true;
+}
+
+
+// Пакетный режим: все файлы сжимаются или разжимаются в один каталог c.output_path
+void make_batch_command(const command& c){
+    std::vector<std::string> paths;
+    if(!collect_paths(c, paths))
+        return;
+
+    batch_options opt;
+    opt.options = c.options;
+    opt.decode = c.action == command::DECODE;
+    opt.output_dir = c.output_path;
+    opt.threads = c.options.threads;
+    batch_result res = run_batch(paths, opt);
+    for(const auto& [path, message] : res.errors)
+        cout << path << ": " << message << "\n";
+    std::size_t size_in = res.size_in;
+    std::size_t size_out = res.size_out;
+    if(c.action == command::ENCODE)
+        size_out -= res.additional_size;
+    else
+        size_in -= res.additional_size;
+    cout << size_in << "\n"
+        << size_out << "\n"
+        << res.additional_size << endl;
+}
+
+
+/*
+Архив: при сжатии файлы пакета записываются членами в архив c.output_path,
+при распаковке члены архива c.file_path (все или c.members) извлекаются в каталог c.output_path
+*/
+void make_archive_command(const command& c){
+    std::size_t size_in = 0, size_out = 0, size_tree = 0;
+    if(c.action == command::ENCODE){
+        std::vector<std::string> paths;
+        if(!collect_paths(c, paths))
+            return;
+        ofstream out(c.output_path, ios::binary);
+        if(!out){
+            cout << "can't create output file" << endl;
+            return;
+        }
+        ArchiveWriter archive(out);
+        for(const auto& path : paths){
+            ifstream in(path, ios::binary);
+            if(!in){
+                cout << "source file does not exist: " << path << endl;
+                return;
+            }
+            size_tree += archive.add(safe_relative_path(path), in, c.options);
+            size_in += archive.entries().back().raw_size;
+        }
+        size_tree += archive.close();
+        size_out = (std::size_t)out.tellp() - size_tree;
+    }
+    else{
+        ifstream in(c.file_path, ios::binary);
+        if(!in){
+            cout << "source file does not exist: " << c.file_path << endl;
+            return;
+        }
+        ArchiveReader archive(in);
+        std::vector<const ArchiveEntry*> entries;
+        for(const char* name : c.members){
+            const ArchiveEntry* entry = archive.find(name);
+            if(entry == nullptr){
+                cout << "no such member in the archive: " << name << endl;
+                return;
+            }
+            entries.push_back(entry);
+        }
+        if(c.members.empty())
+            for(const auto& entry : archive.entries())
+                entries.push_back(&entry);
+        size_tree = archive.additional_data_size();
+        for(const ArchiveEntry* entry : entries){
+            std::filesystem::path path = std::filesystem::path(c.output_path) / safe_relative_path(entry->name);
+            if(path.has_parent_path())
+                std::filesystem::create_directories(path.parent_path());
+            ofstream out(path, ios::binary);
+            if(!out){
+                cout << "can't create output file: " << path.string() << endl;
+                return;
+            }
+            std::size_t member_tree = archive.extract(*entry, out, c.options.threads);
+            size_tree += member_tree;
+            size_in += entry->packed_size - member_tree;
+            size_out += entry->raw_size;
+        }
+    }
+    cout << size_in << "\n"
+        << size_out << "\n"
+        << size_tree << endl;
+}
+
+
 void make_command(const command& c){
     if(c.action == command::UNDEFINED){
-        cout << "no action - encode (-c) or decode (-u)?" << endl;
+        cout << "no action - encode (-c), decode (-u) or train dictionary (-t)?" << endl;
+        return;
+    }
+
+    if(c.archive){
+        if(c.action == command::TRAIN || c.output_path == nullptr || (c.action == command::DECODE && c.file_path == nullptr)){
+            cout << "archive needs -c with files and -o archive, or -u with -f archive and -o directory" << endl;
+            return;
+        }
+        try{
+            make_archive_command(c);
+        }
+        catch(const HuffmanException& e){
+            cout << e.message << "\n";
+        }
+        catch(const std::exception& e){
+            cout << e.what() << "\n";
+        }
+        return;
+    }
+
+    if(c.batch_list != nullptr || !c.globs.empty()){
+        if(c.action == command::TRAIN){
+            cout << "batch mode only encodes (-c) or decodes (-u)" << endl;
+            return;
+        }
+        if(c.output_path == nullptr){
+            cout << "no output directory" << endl;
+            return;
+        }
+        make_batch_command(c);
         return;
     }
 
@@ -49,13 +213,81 @@ void make_command(const command& c){
     }
     
     try{
+        if(c.action == command::TRAIN){
+            Dictionary dict = Dictionary::train(c.dict_id < 0 ? 0 : c.dict_id, in);
+            dict.save(out);
+            in.seekg(0, in.end);
+            cout << in.tellg() << "\n"
+                << 0 << "\n"
+                << out.tellp() << endl;
+            return;
+        }
+
+        if(c.range){
+            if(c.action != command::DECODE){
+                cout << "--offset and --length only work with decode (-u)" << endl;
+                return;
+            }
+            // Читаются только блоки, покрывающие диапазон; в выводе size_in - размер всего сжатого файла
+            std::size_t size_out = decode_range(in, c.range_offset, c.range_length, out);
+            in.seekg(0, in.end);
+            cout << in.tellg() << "\n"
+                << size_out << "\n"
+                << 0 << endl;
+            return;
+        }
+
+        if(c.io != io_backend::stream && c.action != command::TRAIN && c.dict_paths.empty()){
+            // Файлы читаются и пишутся без потоков iostream, всегда блоками конвейера
+            in.close();
+            out.close();
+            std::size_t size_tree;
+            if(c.action == command::ENCODE)
+                size_tree = pipeline_encode_file(c.file_path, c.output_path, c.options, c.io);
+            else
+                size_tree = pipeline_decode_file(c.file_path, c.output_path, c.options.threads, c.io);
+            std::size_t size_in = std::filesystem::file_size(c.file_path);
+            std::size_t size_out = std::filesystem::file_size(c.output_path);
+            if(c.action == command::ENCODE)
+                size_out -= size_tree;
+            else
+                size_in -= size_tree;
+            cout << size_in << "\n"
+                << size_out << "\n"
+                << size_tree << endl;
+            return;
+        }
+
+        DictionaryRegistry registry;
+        int dict_id = c.dict_id;
+        for(const char* path : c.dict_paths){
+            ifstream dict_file(path);
+            if(!dict_file){
+                cout << "dictionary file does not exist: " << path << endl;
+                return;
+            }
+            Dictionary dict;
+            dict.load(dict_file);
+            registry.add(dict);
+            if(dict_id < 0)
+                dict_id = dict.id;
+        }
+
         auto begin_in = in.tellg();
         auto begin_out = out.tellp();
         std::size_t size_tree;
-        if(c.action == command::ENCODE)
-            size_tree = encode(in, out);
+        if(dict_id >= 0){
+            // Сообщения, сжатые словарём, не содержат дополнительных данных
+            if(c.action == command::ENCODE)
+                registry.encode(dict_id, in, out);
+            else
+                registry.decode(dict_id, in, out);
+            size_tree = 0;
+        }
+        else if(c.action == command::ENCODE)
+            size_tree = encode_file(in, out, c.options);
         else
-            size_tree = decode(in, out);
+            size_tree = decode_file(in, out, c.options.threads);
         assert(in.good());
         assert(out.good());
         std::size_t size_in = in.tellg() - begin_in;
@@ -80,29 +312,129 @@ void make_command(const command& c){
 
 
 bool parse_command(int argc, char* argv[], command& c){
-    if(argc != 6){
+    if(argc < 6){
         cout << "wrong args count" << "\n";
         return false;
     }
 
     int i = 1;
-    while(i < 6){
+    while(i < argc){
         std::string arg(argv[i]);
         i += 1;
+        bool has_value = i < argc;
         if(arg == "-c"){
             c.action = command::ENCODE;
         }
         else if(arg == "-u"){
             c.action = command::DECODE;
         }
-        else if(arg == "-f" || arg == "--file"){
+        else if(arg == "-t"){
+            c.action = command::TRAIN;
+        }
+        else if(arg == "--dict" && has_value){
+            c.dict_paths.push_back(argv[i]);
+            i += 1;
+        }
+        else if(arg == "--dict-id" && has_value){
+            c.dict_id = atoi(argv[i]);
+            i += 1;
+        }
+        else if((arg == "-f" || arg == "--file") && has_value){
             c.file_path = argv[i];
             i += 1;
         }
-        else if(arg == "-o" || arg == "--output"){
+        else if((arg == "-o" || arg == "--output") && has_value){
             c.output_path = argv[i];
             i += 1;
         }
+        else if(arg == "--sample"){
+            c.options.sample = true;
+        }
+        else if(arg == "--coder=huffman"){
+            c.options.coder = method::huffman;
+        }
+        else if(arg == "--coder=adaptive"){
+            c.options.coder = method::adaptive;
+        }
+        else if(arg == "--coder=fse"){
+            c.options.coder = method::fse;
+        }
+        else if(arg == "--coder=static"){
+            c.options.coder = method::static_text;
+        }
+        else if(arg == "--order1"){
+            c.options.coder = method::order1;
+        }
+        else if(arg == "--lz77"){
+            c.options.coder = method::lz77;
+        }
+        else if(arg == "--rle"){
+            c.options.coder = method::rle;
+        }
+        else if(arg == "--bwt"){
+            c.options.coder = method::bwt;
+        }
+        else if(arg == "--pipeline"){
+            c.options.pipeline = true;
+        }
+        else if(arg == "--split"){
+            c.options.pipeline = true;
+            c.options.split = true;
+        }
+        else if(arg == "--min-gain" && has_value){
+            c.options.min_gain = atof(argv[i]);
+            i += 1;
+        }
+        else if(arg == "--split-speed" && has_value){
+            c.options.split_min_speed = atof(argv[i]);
+            i += 1;
+        }
+        else if(arg == "--batch" && has_value){
+            c.batch_list = argv[i];
+            i += 1;
+        }
+        else if(arg == "--glob" && has_value){
+            c.globs.push_back(argv[i]);
+            i += 1;
+        }
+        else if(arg == "--archive"){
+            c.archive = true;
+        }
+        else if(arg == "--member" && has_value){
+            c.members.push_back(argv[i]);
+            i += 1;
+        }
+        else if(arg == "--io=stream"){
+            c.io = io_backend::stream;
+        }
+        else if(arg == "--io=pread"){
+            c.io = io_backend::pread;
+        }
+        else if(arg == "--io=uring"){
+            c.io = io_backend::uring;
+        }
+        else if(arg == "--offset" && has_value){
+            c.range = true;
+            c.range_offset = strtoull(argv[i], nullptr, 10);
+            i += 1;
+        }
+        else if(arg == "--length" && has_value){
+            c.range = true;
+            c.range_length = strtoull(argv[i], nullptr, 10);
+            i += 1;
+        }
+        else if(arg == "--block-size" && has_value){
+            c.options.block_size = atol(argv[i]);
+            i += 1;
+        }
+        else if(arg == "--threads" && has_value){
+            c.options.threads = atoi(argv[i]);
+            i += 1;
+        }
+        else if(arg == "--level" && has_value){
+            c.options.level = atoi(argv[i]);
+            i += 1;
+        }
         else{
             cout << "unknown flag: " << arg << endl;
             return false;
@@ -0,0 +1,517 @@
+#include "pipeline.h"
+#include "huffman_block.h"
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <thread>
+
+using namespace Huffman;
+
+
+
+static const char INDEX_MAGIC[4] = {'H', 'I', 'D', 'X'};
+
+// Элемент индекса блоков: где блок начинается в исходных и в сжатых данных (от первого заголовка блока)
+struct BlockIndexEntry{
+    uint64_t raw_offset;
+    uint64_t packed_offset;
+    // Номер последнего блока со своим деревом (block_type::tree) не позже этого, NO_TREE - такого нет.
+    // Блок, повторяющий дерево, находит его сразу, без чтения всех повторов перед ним
+    uint64_t tree_block;
+};
+static const uint64_t NO_TREE = UINT64_MAX;
+
+
+// Блок в конвейере: входные данные, результат и признак готовности для записывающего потока
+struct Block{
+    std::string in;
+    std::string out;
+    uint32_t raw_size = 0;          // для разжатия - ожидаемый размер исходного блока
+    std::size_t additional_size = 0;
+    std::promise<void> done;
+
+    // Если сжатый блок разделён на части (encode_options::split): размеры каждой части, исходный и сжатый.
+    // Части записываются как отдельные блоки
+    std::vector<std::pair<uint32_t, uint32_t>> parts;
+
+    // Блоки Хаффмана: дерево предыдущего блока и дерево этого блока, которое ждёт следующий
+    std::shared_future<SharedTree> prev_tree;
+    std::promise<SharedTree> tree;
+    bool tree_published = false;
+
+    void publish_tree(const SharedTree& t){
+        tree.set_value(t);
+        tree_published = true;
+    }
+};
+using BlockPtr = std::shared_ptr<Block>;
+
+
+/*
+Буфер вывода в строку, который не пропускает больше limit байт. Блок, записанный
+не кодом Хаффмана, разжимается обычным decode, а размер в его заголовке (у method::run
+это любое uint64) ничем не связан с размером блока: без ограничения поддельный блок
+занял бы сколько угодно памяти.
+*/
+class limited_stringbuf : public std::streambuf{
+public:
+    limited_stringbuf(std::string& dst, std::size_t limit): dst(dst), limit(limit) {}
+
+protected:
+    int_type overflow(int_type c) override{
+        if(traits_type::eq_int_type(c, traits_type::eof()))
+            return traits_type::not_eof(c);
+        char ch = traits_type::to_char_type(c);
+        xsputn(&ch, 1);
+        return c;
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override{
+        if((std::size_t)n > limit - dst.size())
+            throw HuffmanException("data format error");
+        dst.append(s, n);
+        return n;
+    }
+
+private:
+    std::string& dst;
+    std::size_t limit;
+};
+
+
+/*
+Читает size байт из src в dst. Размер берётся из заголовка блока и ничем не
+проверен, поэтому память выделяется по мере прихода данных кусками по READ_CHUNK:
+обрезанный или поддельный файл не заставит выделить все обещанные 4 ГиБ.
+Возвращает false, если данных меньше size.
+*/
+static const std::size_t READ_CHUNK = 1 << 20;
+
+static bool read_block(FileReader& src, std::string& dst, std::size_t size){
+    dst.clear();
+    while(dst.size() < size){
+        const std::size_t have = dst.size();
+        const std::size_t part = std::min(READ_CHUNK, size - have);
+        dst.resize(have + part);
+        if(src.read(&dst[have], part) != part)
+            return false;
+    }
+    return true;
+}
+
+
+/*
+Разжимает сжатый блок packed в out. expected_size - размер исходного блока из
+заголовка потока: блок, который обещает другой размер, отвергается до выделения памяти.
+Блок Хаффмана может повторять дерево предыдущего блока, prev_tree() вызывается,
+только если оно действительно нужно. Дерево блока (nullptr у других способов)
+передаётся в publish до декодирования, чтобы следующий блок не ждал. Возвращает
+объём дополнительных данных.
+*/
+template<class PrevTree, class Publish>
+static std::size_t decode_block(const std::string& packed, std::size_t expected_size, PrevTree prev_tree, Publish publish, std::string& out){
+    // Блок внутри блока запустил бы ещё один конвейер со своими потоками, и так без ограничения глубины
+    if(!packed.empty() && packed[0] == (char)method::blocks)
+        throw HuffmanException("data format error");
+    if(packed.size() < 2 && !packed.empty() && packed[0] == (char)method::huffman_block)
+        throw HuffmanException("data format error");
+    // У method::run длина - это весь заголовок, она сверяется сразу
+    if(!packed.empty() && packed[0] == (char)method::run){
+        uint64_t size;
+        if(packed.size() < sizeof(method) + sizeof(size))
+            throw HuffmanException("file is too small");
+        std::memcpy(&size, packed.data() + sizeof(method), sizeof(size));
+        if(size != expected_size)
+            throw HuffmanException("data format error");
+    }
+    if(packed.size() < 2 || packed[0] != (char)method::huffman_block){
+        publish(nullptr);
+        std::stringstream block_src(packed);
+        out.clear();
+        out.reserve(expected_size);
+        limited_stringbuf buf(out, expected_size);
+        std::ostream block_dst(&buf);
+        block_dst.exceptions(std::ios::badbit);  // исключение буфера выходит из decode, а не гасится потоком
+        return decode(block_src, block_dst, 1);
+    }
+    const SharedTree prev = packed[1] != (char)block_type::tree ? prev_tree() : nullptr;
+    HuffmanBlockHeader header = read_huffman_block_header(packed.data(), packed.size(), prev);
+    publish(header.tree);
+    return decode_huffman_block(packed.data(), packed.size(), header, expected_size, out);
+}
+
+
+/*
+Запускает конвейер: read(Block&) в отдельном потоке заполняет очередной блок
+и возвращает false, когда блоки кончились; code(Block&) выполняется в threads
+рабочих потоках; write(Block&) вызывается в этом потоке строго в порядке чтения.
+Ошибка любого этапа останавливает чтение и пробрасывается отсюда.
+*/
+template<class Read, class Code, class Write>
+static void run_pipeline(int threads, Read read, Code code, Write write){
+    if(threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    BoundedQueue<BlockPtr> work(2 * threads);   // блоки, ждущие рабочего потока
+    BoundedQueue<BlockPtr> order(2 * threads);  // все блоки в порядке чтения, для записи
+
+    std::thread reader([&](){
+        std::promise<SharedTree> no_tree;
+        no_tree.set_value(nullptr);
+        std::shared_future<SharedTree> prev_tree = no_tree.get_future().share();
+        while(true){
+            BlockPtr block = std::make_shared<Block>();
+            block->prev_tree = prev_tree;
+            prev_tree = block->tree.get_future().share();
+            bool more;
+            try{
+                more = read(*block);
+            }
+            catch(...){
+                block->done.set_exception(std::current_exception());
+                order.push(block);
+                break;
+            }
+            if(!more || !order.push(block) || !work.push(block))
+                break;
+        }
+        work.close();
+        order.close();
+    });
+
+    std::vector<std::thread> workers;
+    for(int k = 0; k < threads; k++)
+        workers.emplace_back([&](){
+            BlockPtr block;
+            while(work.pop(block)){
+                try{
+                    code(*block);
+                    block->done.set_value();
+                }
+                catch(...){
+                    // Следующий блок может ждать дерево этого, он получит ту же ошибку
+                    if(!block->tree_published)
+                        block->tree.set_exception(std::current_exception());
+                    block->done.set_exception(std::current_exception());
+                }
+            }
+        });
+
+    std::exception_ptr error;
+    BlockPtr block;
+    while(order.pop(block)){
+        try{
+            block->done.get_future().get();
+            write(*block);
+        }
+        catch(...){
+            error = std::current_exception();
+            break;
+        }
+        block.reset();  // память блока освобождается сразу после записи
+    }
+    work.close();
+    order.close();
+    reader.join();
+    for(auto& worker : workers)
+        worker.join();
+    if(error)
+        std::rethrow_exception(error);
+}
+
+
+std::size_t Huffman::pipeline_encode(std::istream& src, std::ostream& dst, const encode_options& opt){
+    StreamReader reader(src);
+    StreamWriter writer(dst);
+    std::size_t additional_size = pipeline_encode(reader, writer, opt);
+    src.clear();
+    return additional_size;
+}
+
+
+std::size_t Huffman::pipeline_decode(std::istream& src, std::ostream& dst, int threads){
+    StreamReader reader(src);
+    StreamWriter writer(dst);
+    return pipeline_decode(reader, writer, threads);
+}
+
+
+std::size_t Huffman::pipeline_encode(FileReader& src, FileWriter& dst, const encode_options& opt){
+    encode_options block_opt = opt;
+    block_opt.pipeline = false;
+    block_opt.threads = 1;  // потоки уже заняты конвейером
+    const std::size_t block_size = std::max<std::size_t>(1, std::min<std::size_t>(opt.block_size, INT32_MAX - 1));
+
+    std::size_t additional_size = 0;
+    std::vector<BlockIndexEntry> index;
+    uint64_t raw_offset = 0, packed_offset = 0;
+    uint64_t tree_block = NO_TREE;
+    run_pipeline(opt.threads,
+        [&](Block& block){
+            block.in.resize(block_size);
+            block.in.resize(src.read(&block.in[0], block_size));
+            return !block.in.empty();
+        },
+        [&](Block& block){
+            if(opt.coder == method::huffman){
+                std::vector<std::size_t> sizes = {block.in.size()};
+                if(opt.split)
+                    sizes = split_block(block.in.data(), block.in.size(), opt.split_min_speed);
+
+                /*
+                Частоты и новые деревья считаются параллельно, ждать предыдущий блок нужно
+                только для выбора. Для частей без дерева (несжимаемых, из одного байта,
+                с малым алфавитом) оно не строится, а следующая часть может повторить
+                дерево части перед ними
+                */
+                std::vector<std::vector<std::size_t>> counts;
+                std::vector<block_type> types;
+                std::vector<SharedTree> trees;  // nullptr - часть без дерева
+                std::size_t begin = 0;
+                for(std::size_t size : sizes){
+                    counts.push_back(byte_counts(block.in.data() + begin, size));
+                    types.push_back(choose_block_type(counts.back(), size, opt.min_gain));
+                    trees.push_back(types.back() == block_type::tree ? make_block_tree(counts.back()) : nullptr);
+                    begin += size;
+                }
+                std::vector<SharedTree> prevs = {block.prev_tree.get()};
+                for(std::size_t k = 0; k < sizes.size(); k++){
+                    if(trees[k] != nullptr)
+                        trees[k] = choose_block_tree(counts[k], trees[k], prevs[k]);
+                    prevs.push_back(trees[k] != nullptr ? trees[k] : prevs[k]);
+                }
+                block.publish_tree(prevs.back());
+
+                begin = 0;
+                for(std::size_t k = 0; k < sizes.size(); k++){
+                    const std::size_t packed = block.out.size();
+                    const char* part = block.in.data() + begin;
+                    if(types[k] == block_type::stored)
+                        block.additional_size += encode_stored_block(part, sizes[k], block.out);
+                    else if(types[k] == block_type::single)
+                        block.additional_size += encode_single_block(part, sizes[k], block.out);
+                    else if(types[k] == block_type::small)
+                        block.additional_size += encode_small_block(part, sizes[k], counts[k], block.out);
+                    else
+                        block.additional_size += encode_huffman_block(part, sizes[k], trees[k], prevs[k], block.out);
+                    block.parts.push_back({(uint32_t)sizes[k], (uint32_t)(block.out.size() - packed)});
+                    begin += sizes[k];
+                }
+                return;
+            }
+            block.publish_tree(nullptr);
+            std::stringstream block_src(block.in);
+            std::stringstream block_dst;
+            block.additional_size = encode(block_src, block_dst, block_opt);
+            block.out = block_dst.str();
+        },
+        [&](Block& block){
+            if(block.parts.empty())
+                block.parts.push_back({(uint32_t)block.in.size(), (uint32_t)block.out.size()});
+            std::size_t packed = 0;
+            for(auto [raw_size, packed_size] : block.parts){
+                uint32_t header[2] = {raw_size, packed_size};
+                dst.write((char*)header, sizeof(header));
+                dst.write(block.out.data() + packed, packed_size);
+                if(packed_size >= 2 && block.out[packed] == (char)method::huffman_block && block.out[packed + 1] == (char)block_type::tree)
+                    tree_block = index.size();
+                packed += packed_size;
+                additional_size += sizeof(header);
+                index.push_back({raw_offset, packed_offset, tree_block});
+                raw_offset += raw_size;
+                packed_offset += sizeof(header) + packed_size;
+            }
+            additional_size += block.additional_size;
+        });
+
+    uint32_t end[2] = {0, 0};
+    dst.write((char*)end, sizeof(end));
+
+    /*
+    Индекс блоков для decode_range: [uint32 n][n элементов][uint32 n]["HIDX"].
+    Последний элемент - конец данных (положение завершающего заголовка).
+    Число элементов записано и в начале - для последовательного чтения, и в конце - чтобы найти индекс с конца
+    */
+    index.push_back({raw_offset, packed_offset, tree_block});
+    uint32_t count = index.size();
+    dst.write((char*)&count, sizeof(count));
+    dst.write((char*)index.data(), index.size() * sizeof(BlockIndexEntry));
+    dst.write((char*)&count, sizeof(count));
+    dst.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    return additional_size + sizeof(end) + 2 * sizeof(count) + index.size() * sizeof(BlockIndexEntry) + sizeof(INDEX_MAGIC);
+}
+
+
+std::size_t Huffman::pipeline_decode(FileReader& src, FileWriter& dst, int threads){
+    std::size_t additional_size = 0;
+    run_pipeline(threads,
+        [&](Block& block){
+            uint32_t header[2];
+            if(src.read((char*)header, sizeof(header)) != sizeof(header))
+                throw HuffmanException("file is too small");
+            if(header[0] == 0)
+                return false;
+            block.raw_size = header[0];
+            if(!read_block(src, block.in, header[1]))
+                throw HuffmanException("file is too small");
+            return true;
+        },
+        [&](Block& block){
+            block.additional_size = decode_block(block.in, block.raw_size,
+                [&](){ return block.prev_tree.get(); },
+                [&](const SharedTree& tree){ block.publish_tree(tree); },
+                block.out);
+            if(block.out.size() != block.raw_size)
+                throw HuffmanException("data format error");
+        },
+        [&](Block& block){
+            dst.write(block.out.data(), block.out.size());
+            additional_size += 2 * sizeof(uint32_t) + block.additional_size;
+        });
+
+    // Индекс при последовательном чтении не нужен, он пропускается кусками:
+    // число элементов не проверено, и буфер под весь индекс мог бы занять до 96 ГиБ
+    uint32_t count;
+    if(src.read((char*)&count, sizeof(count)) != sizeof(count))
+        throw HuffmanException("file is too small");
+    const std::size_t index_size = (std::size_t)count * sizeof(BlockIndexEntry) + sizeof(count) + sizeof(INDEX_MAGIC);
+    std::vector<char> skipped(std::min(index_size, READ_CHUNK));
+    for(std::size_t left = index_size; left > 0; ){
+        const std::size_t part = std::min(left, skipped.size());
+        if(src.read(skipped.data(), part) != part)
+            throw HuffmanException("data format error");
+        left -= part;
+        // index_size и READ_CHUNK кратны 8: последний кусок не короче 8 байт, подпись целиком в нём
+        if(left == 0 && std::memcmp(&skipped[part - sizeof(INDEX_MAGIC)], INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+            throw HuffmanException("data format error");
+    }
+    return additional_size + 2 * sizeof(uint32_t) + sizeof(count) + index_size;
+}
+
+
+std::size_t Huffman::decode_range(std::istream& src, uint64_t offset, uint64_t length, std::ostream& dst){
+    if(src.peek() == FILE_MAGIC[0]){
+        char header[FILE_HEADER_SIZE];
+        src.read(header, sizeof(header));
+        if(!src.good())
+            throw HuffmanException("file is too small");
+        check_file_header(header);
+    }
+    const std::streampos begin = src.tellg();
+    char m = src.get();
+    if(!src.good())
+        throw HuffmanException("file is too small");
+    if(m != (char)method::blocks)
+        throw HuffmanException("file is not compressed in blocks (--pipeline)");
+    const std::streampos blocks_begin = src.tellg();
+
+    // Индекс читается с конца данных
+    uint32_t count;
+    char magic[sizeof(INDEX_MAGIC)];
+    src.seekg(-(std::streamoff)(sizeof(count) + sizeof(magic)), src.end);
+    const std::streampos trailer = src.tellg();
+    src.read((char*)&count, sizeof(count));
+    src.read(magic, sizeof(magic));
+    if(!src.good() || std::memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0 || count == 0
+        || (uint64_t)(trailer - blocks_begin) < (uint64_t)count * sizeof(BlockIndexEntry))
+        throw HuffmanException("block index is damaged");
+    std::vector<BlockIndexEntry> index(count);
+    src.seekg(trailer - (std::streamoff)(count * sizeof(BlockIndexEntry)));
+    src.read((char*)index.data(), count * sizeof(BlockIndexEntry));
+    if(!src.good())
+        throw HuffmanException("block index is damaged");
+
+    // Первый блок, который заканчивается после offset
+    const uint64_t total = index.back().raw_offset;
+    offset = std::min(offset, total);
+    const uint64_t end = offset + std::min(length, total - offset);
+    auto it = std::upper_bound(index.begin(), index.end() - 1, offset,
+        [](uint64_t value, const BlockIndexEntry& e){ return value < e.raw_offset; });
+    std::size_t i = it - index.begin() - (it != index.begin());
+
+    // Читает сжатый блок i
+    auto read_block = [&](std::size_t i){
+        uint32_t header[2];
+        src.seekg(blocks_begin + (std::streamoff)index[i].packed_offset);
+        src.read((char*)header, sizeof(header));
+        if(!src.good() || header[0] != index[i + 1].raw_offset - index[i].raw_offset)
+            throw HuffmanException("block index is damaged");
+        std::string packed(header[1], 0);
+        src.read(&packed[0], packed.size());
+        if(!src.good())
+            throw HuffmanException("file is too small");
+        return packed;
+    };
+
+    // Дерево, которое повторяет блок i: номер блока с ним записан в индексе, читается только этот блок
+    auto find_tree = [&](std::size_t i) -> SharedTree{
+        const uint64_t k = index[i].tree_block;
+        if(k == NO_TREE)
+            return nullptr;
+        if(k >= i)
+            throw HuffmanException("block index is damaged");
+        std::string packed = read_block(k);
+        if(packed.size() < 2 || packed[0] != (char)method::huffman_block || packed[1] != (char)block_type::tree)
+            throw HuffmanException("block index is damaged");
+        return read_huffman_block_header(packed.data(), packed.size(), nullptr).tree;
+    };
+
+    std::size_t written = 0;
+    SharedTree tree;  // дерево предыдущего разжатого блока
+    for(bool first = true; i + 1 < index.size() && index[i].raw_offset < end; i++, first = false){
+        std::string packed = read_block(i);
+        std::string block;
+        decode_block(packed, index[i + 1].raw_offset - index[i].raw_offset,
+            [&](){ return first ? find_tree(i) : tree; },
+            [&](const SharedTree& t){ tree = t; },
+            block);
+        if(block.size() != index[i + 1].raw_offset - index[i].raw_offset)
+            throw HuffmanException("data format error");
+        const uint64_t from = std::max(offset, index[i].raw_offset) - index[i].raw_offset;
+        const uint64_t to = std::min<uint64_t>(end - index[i].raw_offset, block.size());
+        dst.write(block.data() + from, to - from);
+        written += to - from;
+    }
+    src.clear();
+    src.seekg(begin);
+    return written;
+}
+
+
+std::size_t Huffman::pipeline_encode_file(const char* src_path, const char* dst_path, const encode_options& opt, io_backend io){
+    auto src = open_reader(src_path, io);
+    auto dst = open_writer(dst_path, io);
+    char header[FILE_HEADER_SIZE + sizeof(method)];
+    std::memcpy(header, FILE_MAGIC, sizeof(FILE_MAGIC));
+    header[sizeof(FILE_MAGIC)] = (char)FILE_VERSION;
+    header[FILE_HEADER_SIZE] = (char)method::blocks;
+    dst->write(header, sizeof(header));
+    std::size_t additional_size = sizeof(header) + pipeline_encode(*src, *dst, opt);
+    dst->close();
+    return additional_size;
+}
+
+
+std::size_t Huffman::pipeline_decode_file(const char* src_path, const char* dst_path, int threads, io_backend io){
+    auto src = open_reader(src_path, io);
+    // Заголовок файла необязателен: так же разжимаются данные pipeline_encode без него
+    char header[FILE_HEADER_SIZE];
+    std::size_t header_size = 0;
+    if(src->read(header, 1) != 1)
+        throw HuffmanException("file is too small");
+    if(header[0] == FILE_MAGIC[0]){
+        if(src->read(header + 1, FILE_HEADER_SIZE - 1) != FILE_HEADER_SIZE - 1)
+            throw HuffmanException("file is too small");
+        check_file_header(header);
+        header_size = FILE_HEADER_SIZE;
+        if(src->read(header, 1) != 1)
+            throw HuffmanException("file is too small");
+    }
+    if(header[0] != (char)method::blocks)
+        throw HuffmanException("file is not compressed in blocks (--pipeline)");
+    auto dst = open_writer(dst_path, io);
+    std::size_t additional_size = header_size + sizeof(method) + pipeline_decode(*src, *dst, threads);
+    dst->close();
+    return additional_size;
+}
@@ -0,0 +1,112 @@
+#include "rle.h"
+
+using namespace Huffman;
+
+
+
+/*
+Разбирает src на символы расширенного алфавита и для каждого вызывает
+emit(символ, дополнительные биты, их число)
+*/
+template<class F>
+static void for_each_symbol(std::istream& src, F emit){
+    int prev = -1;
+    uint32_t run = 0;  // сколько раз подряд повторился prev после первого вхождения
+    auto flush_run = [&](){
+        if(run < RLE_MIN_RUN){
+            for(uint32_t k = 0; k < run; k++)
+                emit(prev, 0, 0);
+        }
+        else{
+            int c = 31 - __builtin_clz(run);
+            emit(RLE_RUN + c, run - (1u << c), c);
+        }
+        run = 0;
+    };
+    while(true){
+        char symb = src.get();
+        if(!src.good())
+            break;
+        if((byte_t)symb == prev && run != UINT32_MAX){
+            run += 1;
+            continue;
+        }
+        flush_run();
+        prev = (byte_t)symb;
+        emit(prev, 0, 0);
+    }
+    flush_run();
+    src.clear();
+}
+
+
+std::size_t Huffman::rle_encode(std::istream& src, std::ostream& dst){
+    auto state = src.rdstate();
+    auto pos = src.tellg();
+    std::map<uint16_t, double> p;
+    for_each_symbol(src, [&](uint16_t symb, uint32_t, int){
+        p[symb] += 1;
+    });
+    if(p.size() <= 1){
+        p[0] += 0;
+        p[1] += 0;
+    }
+    src.clear(state);
+    src.seekg(pos);
+    TokenHuffmanTree tree(p);
+
+    bit_oseq tree_dst(dst);
+    tree.save_compact(tree_dst, RLE_SYMBOL_BITS);
+    std::size_t tree_size = (tree_dst.size() + 7) / 8;
+    tree_dst.destroy();
+
+    bit_oseq bit_seq_dst(dst);
+    for_each_symbol(src, [&](uint16_t symb, uint32_t extra, int n){
+        tree.encode(symb, bit_seq_dst);
+        for(int k = n - 1; k >= 0; k--)
+            bit_seq_dst.write((extra >> k) & 1);
+    });
+    return 2 * sizeof(seq_size_t) + tree_size;
+}
+
+
+std::size_t Huffman::rle_decode(std::istream& src, std::ostream& dst){
+    TokenHuffmanTree tree;
+    std::size_t tree_size;
+    try{
+        bit_iseq tree_src(src);
+        tree.load_compact(tree_src, RLE_SYMBOL_BITS);
+        tree_size = (tree_src.size() + 7) / 8;
+
+        bit_iseq bit_seq_src(src);
+        int prev = -1;
+        char buffer[1 << 16];
+        while(!bit_seq_src.end_of_seq()){
+            uint16_t symb = tree.decode(bit_seq_src);
+            if(symb < RLE_RUN){
+                prev = symb;
+                dst.put((char)symb);
+                continue;
+            }
+            int c = symb - RLE_RUN;
+            if(prev == -1 || c >= RLE_RUN_CLASSES)
+                throw HuffmanException("data format error");
+            uint32_t run = 1;
+            for(int k = 0; k < c; k++)
+                run = (run << 1) | bit_seq_src.read();
+            std::fill(buffer, buffer + std::min<uint32_t>(run, sizeof(buffer)), (char)prev);
+            while(run > 0){
+                uint32_t n = std::min<uint32_t>(run, sizeof(buffer));
+                dst.write(buffer, n);
+                run -= n;
+            }
+        }
+    }
+    catch(const HuffmanException&){
+        throw;
+    }
+    catch(...){
+        throw HuffmanException("data format error");
+    }
+    return 2 * sizeof(seq_size_t) + tree_size;
+}
@@ -0,0 +1,108 @@
+#include "thread_pool.h"
+
+using namespace Huffman;
+
+
+
+// Номер рабочего потока текущего пула, -1 - поток не из пула
+static thread_local const ThreadPool* current_pool = nullptr;
+static thread_local int current_index = -1;
+
+
+ThreadPool::ThreadPool(int threads){
+    if(threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    for(int i = 0; i < threads; i++)
+        queues.push_back(std::make_unique<Queue>());
+    for(int i = 0; i < threads; i++)
+        workers.emplace_back([this, i](){ run(i); });
+}
+
+
+ThreadPool::~ThreadPool(){
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        stop = true;
+    }
+    idle.notify_all();
+    for(auto& worker : workers)
+        worker.join();
+}
+
+
+void ThreadPool::submit(std::function<void()> task){
+    std::size_t index = current_pool == this ? current_index : next_queue++ % queues.size();
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        queued++;
+        unfinished++;
+    }
+    idle.notify_one();
+}
+
+
+void ThreadPool::wait(){
+    std::unique_lock<std::mutex> lock(idle_mutex);
+    done.wait(lock, [&](){ return unfinished == 0; });
+    if(error){
+        std::exception_ptr e = error;
+        error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+
+bool ThreadPool::try_pop(int index, std::function<void()>& task){
+    {
+        Queue& own = *queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if(!own.tasks.empty()){
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for(std::size_t k = 1; k < queues.size(); k++){
+        Queue& other = *queues[(index + k) % queues.size()];
+        std::lock_guard<std::mutex> lock(other.mutex);
+        if(!other.tasks.empty()){
+            task = std::move(other.tasks.front());
+            other.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void ThreadPool::run(int index){
+    current_pool = this;
+    current_index = index;
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock(idle_mutex);
+            idle.wait(lock, [&](){ return stop || queued > 0; });
+            if(queued == 0)
+                return;
+            queued--;  // одна из задач в очередях теперь наша
+        }
+        std::function<void()> task;
+        while(!try_pop(index, task))
+            std::this_thread::yield();  // задачу уже забирают, но ещё не вынули из очереди
+        try{
+            task();
+        }
+        catch(...){
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            if(!error)
+                error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        if(--unfinished == 0)
+            done.notify_all();
+    }
+}
@@ -2,8 +2,29 @@
 #include "doctest.h"
 
 #include "huffman.h"
+#include "adaptive.h"
+#include "dictionary.h"
+#include "fse.h"
+#include "context.h"
+#include "lz77.h"
+#include "rle.h"
+#include "bwt.h"
+#include "static_code.h"
+#include "pipeline.h"
+#include "file_io.h"
+#include "thread_pool.h"
+#include "batch.h"
+#include "checksum.h"
+#include "archive.h"
+#include "huffman_block.h"
 #include <string>
 #include <map>
+#include <cstring>
+#include <functional>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <sys/stat.h>
 
 using namespace Huffman;
 
@@ -83,6 +104,129 @@ TEST_SUITE("bit_oseq") {
         for(int k = 0; k < 8; k++)
             CHECK_EQ(data[k], 1 << k);
     }
+
+    // Поток без seekp: запись в него должна идти только в конец и крупными кусками
+    struct append_only_buf : std::stringbuf{
+        int writes = 0;
+        std::streamsize xsputn(const char* s, std::streamsize n) override {
+            writes++;
+            return std::stringbuf::xsputn(s, n);
+        }
+        pos_type seekoff(off_type, std::ios_base::seekdir, std::ios_base::openmode) override {
+            return pos_type(off_type(-1));
+        }
+        pos_type seekpos(pos_type, std::ios_base::openmode) override {
+            return pos_type(off_type(-1));
+        }
+    };
+
+    TEST_CASE("append only stream"){
+        append_only_buf buf;
+        std::ostream os(&buf);
+        os << "abcde";
+        buf.writes = 0;
+        {
+            bit_oseq bos(os);
+            for(int k = 0; k < 8; k++)
+                for(int i = 0; i < 8; i++)
+                    bos.write(i == k);
+            bos.write(true);
+        }
+        CHECK(os.good());
+        CHECK_EQ(buf.writes, 2);
+
+        auto str = buf.str();
+        REQUIRE_EQ(str.size(), 5 + sizeof(seq_size_t) + 9);
+        const seq_size_t* size = (const seq_size_t*)(str.c_str() + 5);
+        const byte_t* data = (const byte_t*)(size + 1);
+        REQUIRE_EQ(*size, 8 * 8 + 1);
+        for(int k = 0; k < 8; k++)
+            CHECK_EQ(data[k], 1 << k);
+        CHECK_EQ(data[8], 1);
+
+        // Кодирование целого потока деревом тоже обходится без seekp
+        std::map<char, double> p{{'a', 1}, {'b', 2}, {'c', 4}};
+        HuffmanTree tree(p);
+        std::stringstream src("abcabcccc");
+        append_only_buf encoded_buf;
+        std::ostream encoded(&encoded_buf);
+        tree.encode(src, encoded);
+        CHECK(encoded.good());
+        std::stringstream encoded_src(encoded_buf.str()), decoded;
+        tree.decode(encoded_src, decoded);
+        CHECK_EQ(decoded.str(), "abcabcccc");
+    }
+
+    TEST_CASE("long sequence in chunks"){
+        // Больше двух кусков: в памяти не больше BIT_SEQ_CHUNK байт, куски выходят по мере заполнения
+        const std::size_t nbits = 2 * 8 * BIT_SEQ_CHUNK + 13;
+        append_only_buf buf;
+        std::ostream os(&buf);
+        {
+            bit_oseq bos(os);
+            for(std::size_t i = 0; i < nbits; i++){
+                bos.write(i % 3 == 0);
+                if(i == 8 * BIT_SEQ_CHUNK)
+                    CHECK_EQ(buf.str().size(), sizeof(seq_size_t) + BIT_SEQ_CHUNK);
+            }
+            CHECK_EQ(bos.size(), nbits);
+        }
+        CHECK_EQ(buf.writes, 6);
+        auto str = buf.str();
+        REQUIRE_EQ(str.size(), 3 * sizeof(seq_size_t) + (nbits + 7) / 8);
+        seq_size_t header;
+        std::memcpy(&header, str.data(), sizeof(header));
+        CHECK_EQ(header, BIT_SEQ_MORE | seq_size_t(8 * BIT_SEQ_CHUNK));
+        std::memcpy(&header, str.data() + 2 * (sizeof(seq_size_t) + BIT_SEQ_CHUNK), sizeof(header));
+        CHECK_EQ(header, 13);
+
+        std::stringstream ss(str);
+        bit_iseq bis(ss);
+        bool same = true;
+        for(std::size_t i = 0; i < nbits; i++)
+            same &= bis.read() == (i % 3 == 0);
+        CHECK(same);
+        CHECK(bis.end_of_seq());
+        CHECK_EQ(bis.size(), nbits);
+
+        // Целиком в память: биты кусков подряд, без заголовков
+        std::stringstream whole_src(str);
+        std::vector<byte_t> bytes;
+        std::size_t size;
+        REQUIRE_EQ(read_bit_seq(whole_src, bytes, size), decode_status::ok);
+        CHECK_EQ(size, nbits);
+        REQUIRE_EQ(bytes.size(), (nbits + 7) / 8);
+        CHECK_EQ(bytes[BIT_SEQ_CHUNK], (byte_t)str[2 * sizeof(seq_size_t) + BIT_SEQ_CHUNK]);
+
+        // Оборванный второй кусок
+        std::stringstream cut_src(str.substr(0, str.size() - 100));
+        CHECK_EQ(read_bit_seq(cut_src, bytes, size), decode_status::truncated);
+    }
+
+    TEST_CASE("sync"){
+        std::stringstream ss;
+        bit_oseq bos(ss);
+        for(int i = 0; i < 20; i++)
+            bos.write(i % 2);
+        bos.sync();
+        // Ушли два целых байта, последние 4 бита ждут следующего куска
+        REQUIRE_EQ(ss.str().size(), sizeof(seq_size_t) + 2);
+        std::stringstream partial(ss.str());
+        bit_iseq bis(partial);
+        for(int i = 0; i < 16; i++)
+            CHECK_EQ(bis.read(), i % 2);
+        bool bit;
+        CHECK_FALSE(bis.try_read(bit));
+
+        bos.write(true);
+        bos.flush();
+        std::stringstream whole(ss.str());
+        bit_iseq all(whole);
+        for(int i = 0; i < 20; i++)
+            CHECK_EQ(all.read(), i % 2);
+        CHECK(all.read());
+        CHECK(all.end_of_seq());
+    }
 }
 
 
@@ -208,6 +352,173 @@ TEST_CASE("huffman tree, decode"){
     #undef CHECK_ENCODE_DECODE
 }
 
+TEST_CASE("huffman tree: table decode with long codes and corrupt input"){
+    // Частоты Фибоначчи дают коды длиннее таблицы быстрого декодирования
+    std::map<char, double> p;
+    double a = 1, b = 1;
+    for(char c = 'a'; c <= 'r'; c++){
+        p[c] = a;
+        std::swap(a, b);
+        b += a;
+    }
+    HuffmanTree tree(p);
+    CHECK_GT(tree.codes()['a'].size(), 11);
+
+    std::string text;
+    for(int i = 0; i < 20000; i++)
+        text += 'a' + (i * i + i / 7) % 18;
+    CHECK_EQ(encode_and_decode(tree, text.c_str()), text);
+
+    std::stringstream src(text);
+    std::stringstream encoded;
+    tree.encode(src, encoded);
+    std::string bits = encoded.str();
+
+    // Последний код обрезан на один бит
+    seq_size_t size;
+    std::memcpy(&size, bits.data(), sizeof(size));
+    size -= 1;
+    std::string truncated = bits;
+    std::memcpy(truncated.data(), &size, sizeof(size));
+    std::stringstream truncated_src(truncated), dst;
+    CHECK_THROWS_AS(tree.decode(truncated_src, dst), HuffmanException);
+
+    // Размер больше, чем есть данных
+    std::stringstream short_src(bits.substr(0, bits.size() / 2));
+    CHECK_THROWS_AS(tree.decode(short_src, dst), HuffmanException);
+}
+
+TEST_CASE("huffman tree: table encode matches bit by bit encode"){
+    // Длины кодов 5, 20 и 40 бит: развёртка по 4, 2 и 1 коду на запись слова
+    for(int symbols : {20, 21, 41}){
+        std::map<char, double> p;
+        double f = 1;
+        for(int i = 0; i < symbols; i++){
+            p['A' + i] = f;
+            f *= symbols == 20? 1.01 : 2;
+        }
+        HuffmanTree tree(p);
+
+        std::string text;
+        for(int i = 0; i < 5000; i++)
+            text += 'A' + (i * 7 + i / 3) % symbols;
+
+        std::stringstream expected;
+        {
+            bit_oseq bos(expected);
+            for(char c : text)
+                tree.encode(c, bos);
+        }
+        std::string expected_bits = expected.str();
+        seq_size_t expected_size;
+        std::memcpy(&expected_size, expected_bits.data(), sizeof(expected_size));
+
+        std::stringstream src(text), encoded;
+        tree.encode(src, encoded);
+        CHECK_EQ(encoded.str(), expected_bits);
+
+        std::vector<byte_t> bits;
+        std::size_t size = tree.encode(text.data(), text.size(), bits);
+        CHECK_EQ(size, expected_size);
+        CHECK_EQ(std::string(bits.begin(), bits.end()), expected_bits.substr(sizeof(seq_size_t)));
+        std::vector<char> decoded;
+        tree.decode(bits.data(), size, decoded);
+        CHECK_EQ(std::string(decoded.begin(), decoded.end()), text);
+    }
+
+    std::map<char, double> p{{'a', 1}, {'b', 2}};
+    HuffmanTree tree(p);
+    std::vector<byte_t> bits;
+    CHECK_THROWS_AS(tree.encode("abc", 3, bits), HuffmanException);
+}
+
+TEST_CASE("huffman tree: decode without exceptions"){
+    std::map<char, double> p{{'a', 1}, {'b', 2}, {'c', 4}, {'d', 6}, {'e', 8}};
+    HuffmanTree tree(p);
+    std::stringstream src("abcdeedcba");
+    std::stringstream encoded;
+    tree.encode(src, encoded);
+    std::string bits = encoded.str();
+    seq_size_t size;
+    std::memcpy(&size, bits.data(), sizeof(size));
+    const byte_t* data = (const byte_t*)bits.data() + sizeof(size);
+
+    std::vector<char> symbols;
+    CHECK(tree.try_decode(data, size, symbols).ok());
+    CHECK_EQ(std::string(symbols.begin(), symbols.end()), "abcdeedcba");
+
+    // Код последнего 'a' обрезан: всё до него декодировано, ошибка - в конце данных
+    symbols.clear();
+    decode_result res = tree.try_decode(data, size - 1, symbols);
+    CHECK_EQ(res.status, decode_status::truncated);
+    CHECK_EQ(res.position, size - 1);
+    CHECK_EQ(std::string(symbols.begin(), symbols.end()), "abcdeedcb");
+
+    // Ссылка из корня за пределы дерева
+    std::stringstream saved;
+    tree.save(saved);
+    std::string broken = saved.str();
+    uint16_t bad_index = 999;
+    std::memcpy(&broken[broken.size() - 8], &bad_index, sizeof(bad_index));
+    std::stringstream broken_src(broken);
+    HuffmanTree broken_tree;
+    CHECK_EQ(broken_tree.try_load(broken_src), decode_status::corrupt);
+    CHECK_EQ(broken_tree.try_decode(data, size, symbols).status, decode_status::corrupt);
+
+    std::stringstream empty, unknown("\x2a"), dst;
+    std::size_t additional_size;
+    CHECK_EQ(try_decode(empty, dst, additional_size).status, decode_status::truncated);
+    CHECK_EQ(try_decode(unknown, dst, additional_size).status, decode_status::unknown_method);
+
+    std::stringstream text("some text for the container"), compressed, decompressed;
+    std::size_t encoded_size = encode(text, compressed);
+    CHECK(try_decode(compressed, decompressed, additional_size).ok());
+    CHECK_EQ(additional_size, encoded_size);
+    CHECK_EQ(decompressed.str(), text.str());
+
+    std::string cut = compressed.str();
+    cut.pop_back();
+    std::stringstream cut_src(cut);
+    res = try_decode(cut_src, dst, additional_size);
+    CHECK_EQ(res.status, decode_status::truncated);
+    CHECK_GE(res.position, 8 * (cut.size() - 1));
+
+    // Размер последовательности из заголовка не проверен: память выделяется только под то, что прочитано
+    const seq_size_t huge = BIT_SEQ_MORE - 1;
+    std::string bomb((const char*)&huge, sizeof(huge));
+    bomb += "0123456789";
+    std::stringstream bomb_src(bomb), bomb_dst;
+    std::vector<byte_t> bomb_bytes;
+    std::size_t bomb_bits;
+    CHECK_EQ(read_bit_seq(bomb_src, bomb_bytes, bomb_bits), decode_status::truncated);
+    CHECK_EQ(bomb_bits, 80);
+    CHECK_LE(bomb_bytes.capacity(), BIT_SEQ_CHUNK);
+    bomb_src.clear();
+    bomb_src.seekg(0);
+    CHECK_EQ(tree.try_decode(bomb_src, bomb_dst).status, decode_status::truncated);
+    bomb_src.clear();
+    bomb_src.seekg(0);
+    CHECK_THROWS_AS(text_code.decode(bomb_src, bomb_dst), HuffmanException);
+    std::string fse_bomb(4, '\xff');
+    fse_bomb += bomb;
+    std::stringstream fse_src(fse_bomb);
+    FseTable fse_table({{'0', 1}, {'1', 1}});
+    CHECK_THROWS_AS(fse_table.decode(fse_src, bomb_dst), HuffmanException);
+
+    // Не HuffmanException из другого способа (здесь - из потока вывода) тоже становится статусом
+    struct failing_buf : std::streambuf{
+        int_type overflow(int_type) override { throw std::bad_alloc(); }
+        std::streamsize xsputn(const char*, std::streamsize) override { throw std::bad_alloc(); }
+    } failing;
+    std::ostream failing_dst(&failing);
+    failing_dst.exceptions(std::ios::badbit);
+    encode_options opt;
+    opt.coder = method::lz77;
+    std::stringstream lz_text(text.str()), lz_compressed;
+    encode(lz_text, lz_compressed, opt);
+    CHECK_EQ(try_decode(lz_compressed, failing_dst, additional_size).status, decode_status::corrupt);
+}
+
 TEST_CASE("huffman tree: save and load"){
     std::map<char, double> p{{'a', 1}, {'b', 2}, {'c', 4}, {'d', 6}, {'e', 8}};
     HuffmanTree initial_tree(p);
@@ -219,6 +530,75 @@ TEST_CASE("huffman tree: save and load"){
 }
 
 
+TEST_CASE("huffman tree: compact save and load"){
+    std::map<char, double> p{{'a', 1}, {'b', 2}, {'c', 4}, {'d', 6}, {'e', 8}, {'\xff', 3}};
+    HuffmanTree initial_tree(p);
+    std::stringstream ss;
+    bit_oseq bos(ss);
+    initial_tree.save_compact(bos);
+    bos.destroy();
+    CHECK_LT(ss.str().size(), 6 * 2 + sizeof(seq_size_t));
+
+    bit_iseq bis(ss);
+    HuffmanTree result_tree;
+    result_tree.load_compact(bis);
+    CHECK(bis.end_of_seq());
+    CHECK_EQ(initial_tree.codes(), result_tree.codes());
+}
+
+
+TEST_CASE("huffman tree: extended alphabet"){
+    std::map<uint16_t, double> p{{'a', 5}, {'b', 1}, {300, 7}, {511, 2}};
+    TokenHuffmanTree tree(p);
+    std::stringstream ss;
+    {
+        bit_oseq bos(ss);
+        for(uint16_t symb : {300, 97, 511, 98, 300})
+            tree.encode(symb, bos);
+    }
+    bit_iseq bis(ss);
+    for(uint16_t symb : {300, 97, 511, 98, 300})
+        CHECK_EQ(tree.decode(bis), symb);
+    CHECK(bis.end_of_seq());
+
+    std::stringstream compact;
+    bit_oseq compact_dst(compact);
+    tree.save_compact(compact_dst, 9);
+    compact_dst.destroy();
+    bit_iseq compact_src(compact);
+    TokenHuffmanTree result_tree;
+    result_tree.load_compact(compact_src, 9);
+    CHECK_EQ(tree.codes(), result_tree.codes());
+}
+
+
+TEST_CASE("token huffman tree: uint16_t streams"){
+    std::vector<uint16_t> tokens;
+    for(int i = 0; i < 2000; i++)
+        tokens.push_back(i % 7 == 0 ? 40000 + i % 3 : 1000 + i % 5);
+    std::string raw((const char*)tokens.data(), tokens.size() * sizeof(uint16_t));
+
+    std::stringstream src(raw);
+    auto p = counts<uint16_t>(src);
+    CHECK_EQ(p.size(), 8);
+    CHECK_EQ(p[1000], std::count(tokens.begin(), tokens.end(), 1000));
+
+    TokenHuffmanTree tree(p);
+    std::stringstream saved;
+    tree.save(saved);
+    TokenHuffmanTree result_tree;
+    result_tree.load(saved);
+    CHECK_EQ(tree, result_tree);
+
+    std::stringstream encoded;
+    std::stringstream decoded;
+    tree.encode(src, encoded);
+    CHECK_LT(encoded.str().size(), raw.size() / 4);
+    result_tree.decode(encoded, decoded);
+    CHECK_EQ(decoded.str(), raw);
+}
+
+
 TEST_CASE("huffman counts"){
     std::stringstream ss("abbcccddddeeeee");
     std::map<char, double> expected{{'a', 1}, {'b', 2}, {'c', 3}, {'d', 4}, {'e', 5}};
@@ -258,4 +638,1359 @@ TEST_CASE("final test: encode and decode text"){
 }
 
 
+TEST_CASE("final test: file header and files of the first version"){
+    std::string many;
+    for(int i = 0; i < 3000; i++)
+        many += (char)(i * 7 % 37 + 40);  // 37 символов: 73 узла, первый байт файла 0x49 рядом с 'H'
+    for(std::string text : {std::string("ab"), std::string("text text text"), many}){
+        // Файл первой версии: дерево и код без заголовка и байта способа
+        std::stringstream src(text);
+        HuffmanTree tree(counts(src));
+        std::stringstream old_file;
+        tree.save(old_file);
+        tree.encode(src, old_file);
+        std::stringstream old_decoded;
+        CHECK_EQ(decode_file(old_file, old_decoded), tree.additional_data_size());
+        CHECK_EQ(old_decoded.str(), text);
+
+        std::stringstream initial_text(text);
+        std::stringstream encoded_text;
+        std::stringstream decoded_text;
+        std::size_t size = encode_file(initial_text, encoded_text);
+        CHECK_EQ(encoded_text.str().substr(0, FILE_HEADER_SIZE), std::string("HUF\x02", 4));
+        CHECK_EQ(decode_file(encoded_text, decoded_text), size);
+        CHECK_EQ(decoded_text.str(), text);
+
+        // Версия новее, чем знает программа
+        std::string newer = encoded_text.str();
+        newer[sizeof(FILE_MAGIC)] = FILE_VERSION + 1;
+        std::stringstream newer_src(newer), newer_dst;
+        CHECK_THROWS_AS(decode_file(newer_src, newer_dst), HuffmanException);
+    }
+
+    // "abracadabra", сжатый первой версией программы: дерево байтов сохраняется в том же виде
+    const byte_t first_version[] = {
+        0x09, 0x00, 0xff, 0xff, 0xff, 0xff, 0x08, 0x00, 0x00, 0x61, 0xff, 0xff,
+        0xff, 0xff, 0x06, 0x00, 0x00, 0x62, 0xff, 0xff, 0xff, 0xff, 0x05, 0x00,
+        0x00, 0x63, 0xff, 0xff, 0xff, 0xff, 0x05, 0x00, 0x01, 0x64, 0xff, 0xff,
+        0xff, 0xff, 0x06, 0x00, 0x01, 0x72, 0x02, 0x00, 0x03, 0x00, 0x07, 0x00,
+        0x00, 0x00, 0x01, 0x00, 0x04, 0x00, 0x07, 0x00, 0x01, 0x00, 0x05, 0x00,
+        0x06, 0x00, 0x08, 0x00, 0x01, 0x00, 0x00, 0x00, 0x07, 0x00, 0xff, 0xff,
+        0x00, 0x00, 0x17, 0x00, 0x00, 0x00, 0x76, 0x51, 0x3b,
+    };
+    const std::string first_file((const char*)first_version, sizeof(first_version));
+    std::stringstream first_src(first_file), first_decoded;
+    decode_file(first_src, first_decoded);
+    CHECK_EQ(first_decoded.str(), "abracadabra");
+    std::stringstream abracadabra("abracadabra"), saved_tree;
+    HuffmanTree(counts(abracadabra)).save(saved_tree);
+    CHECK_EQ(saved_tree.str(), first_file.substr(0, 2 + 9 * 8));
+
+    // Разжатие диапазона понимает заголовок файла
+    encode_options opt;
+    opt.pipeline = true;
+    opt.block_size = 1000;
+    std::stringstream blocks_src(many), blocks_encoded, range;
+    encode_file(blocks_src, blocks_encoded, opt);
+    CHECK_EQ(decode_range(blocks_encoded, 1500, 100, range), 100);
+    CHECK_EQ(range.str(), many.substr(1500, 100));
+}
+
+
+TEST_CASE("huffman sampled counts"){
+    std::string text(100000, 'a');
+    for(std::size_t i = 0; i < text.size(); i += 10)
+        text[i] = 'b';
+    std::stringstream ss(text);
+    auto pos = ss.tellg();
+    auto res = sampled_counts(ss, 64, 16);
+    REQUIRE_EQ(pos, ss.tellg());
+    CHECK_EQ(res.size(), 256);
+    CHECK_GT(res['a'], res['b']);
+    CHECK_GT(res['b'], res['c']);
+
+    std::stringstream small("abbccc");
+    auto exact = sampled_counts(small, 64, 16);
+    CHECK_EQ(exact.size(), 3);
+    CHECK_EQ(exact['c'], 3);
+}
+
+
+TEST_CASE("final test: encode and decode with sampled tree"){
+    std::string text(50000, 'x');
+    for(std::size_t i = 0; i < text.size(); i += 7)
+        text[i] = 'y';
+    text[text.size() / 2 + 3] = 'z';  // почти наверняка не попадёт в выборку
+    std::stringstream initial_text(text);
+    std::stringstream encoded_text;
+    std::stringstream decoded_text;
+    encode_options opt;
+    opt.sample = true;
+    opt.sample_block = 32;
+    opt.sample_blocks = 8;
+    encode(initial_text, encoded_text, opt);
+    decode(encoded_text, decoded_text);
+    CHECK_EQ(decoded_text.str(), text);
+}
+
+
+std::string adaptive_encode_and_decode(const std::string& text){
+    std::stringstream initial_text(text);
+    std::stringstream encoded_text;
+    std::stringstream decoded_text;
+    AdaptiveHuffmanTree encoder;
+    encoder.encode(initial_text, encoded_text);
+    AdaptiveHuffmanTree decoder;
+    decoder.decode(encoded_text, decoded_text);
+    return decoded_text.str();
+}
+
+
+TEST_CASE("adaptive huffman tree: encode and decode"){
+    #define CHECK_ENCODE_DECODE(text) \
+        CHECK_EQ(text, adaptive_encode_and_decode(text))
+
+    CHECK_ENCODE_DECODE("");
+    CHECK_ENCODE_DECODE("a");
+    CHECK_ENCODE_DECODE("aaaaa");
+    CHECK_ENCODE_DECODE("abracadabra");
+    CHECK_ENCODE_DECODE("eabdceabacdebdcadbceabdcbebdabce");
+
+    #undef CHECK_ENCODE_DECODE
+
+    std::string all_bytes;
+    for(int k = 0; k < 3; k++)
+        for(int b = 0; b < 256; b++)
+            all_bytes.push_back((char)(b * 7 + k));
+    CHECK_EQ(all_bytes, adaptive_encode_and_decode(all_bytes));
+}
+
+
+TEST_CASE("final test: encode and decode with adaptive coder"){
+    std::string text;
+    for(int i = 0; i < 5000; i++)
+        text += (i % 3 == 0) ? "telemetry " : std::to_string(i % 97);
+    std::stringstream initial_text(text);
+    std::stringstream encoded_text;
+    std::stringstream decoded_text;
+    encode_options opt;
+    opt.coder = method::adaptive;
+    encode(initial_text, encoded_text, opt);
+    CHECK_LT(encoded_text.str().size(), text.size());
+    decode(encoded_text, decoded_text);
+    CHECK_EQ(decoded_text.str(), text);
+
+    // Вход приходит порциями, как из канала: всё закодированное до паузы уже в выводе, а не ждёт конца входа
+    struct burst_buf : std::streambuf{
+        std::string data;
+        std::size_t pos = 0;
+        std::function<void()> on_pause;
+        int_type underflow() override{
+            if(pos == data.size())
+                return traits_type::eof();
+            if(pos >= data.size() / 2 && on_pause){
+                on_pause();
+                on_pause = nullptr;
+            }
+            std::size_t n = std::min<std::size_t>(100, data.size() - pos);
+            setg(&data[pos], &data[pos], &data[pos] + n);
+            pos += n;
+            return traits_type::to_int_type(data[pos - n]);
+        }
+    };
+    burst_buf live;
+    live.data = text;
+    std::stringstream live_encoded;
+    std::size_t written_at_pause = 0;
+    live.on_pause = [&](){ written_at_pause = live_encoded.str().size(); };
+    std::istream live_src(&live);
+    AdaptiveHuffmanTree live_tree;
+    live_tree.encode(live_src, live_encoded);
+    CHECK_GT(written_at_pause, encoded_text.str().size() / 3);
+    std::stringstream live_decoded;
+    AdaptiveHuffmanTree().decode(live_encoded, live_decoded);
+    CHECK_EQ(live_decoded.str(), text);
+}
+
+
+TEST_CASE("dictionary: encode and decode messages without header"){
+    std::stringstream corpus(
+        "{\"method\": \"get\", \"id\": 1, \"params\": [\"alpha\", \"beta\"]}\n"
+        "{\"method\": \"put\", \"id\": 2, \"params\": [\"gamma\", 42]}\n");
+    Dictionary dict = Dictionary::train(7, corpus);
+    std::stringstream saved;
+    dict.save(saved);
+
+    DictionaryRegistry registry;
+    registry.load(saved);
+    REQUIRE(registry.contains(7));
+    CHECK_FALSE(registry.contains(8));
+    CHECK_THROWS_AS(registry.get(8), HuffmanException);
+
+    std::vector<std::string> messages{
+        "",
+        "{",
+        "{\"method\": \"get\", \"id\": 3, \"params\": [\"beta\"]}",
+        std::string("\x00\xff binary ~ not in corpus", 26),
+    };
+    for(const auto& message : messages){
+        std::stringstream src(message);
+        std::stringstream encoded;
+        std::stringstream decoded;
+        registry.encode(7, src, encoded);
+        if(message.size() > 1)
+            CHECK_LT(encoded.str().size(), message.size());
+        registry.decode(7, encoded, decoded);
+        CHECK_EQ(decoded.str(), message);
+    }
+}
+
+
+std::string fse_encode_and_decode(const std::string& text){
+    std::stringstream initial_text(text);
+    std::stringstream encoded_text;
+    std::stringstream decoded_text;
+    FseTable table(counts(initial_text));
+    table.save(encoded_text);
+    table.encode(initial_text, encoded_text);
+    FseTable result_table;
+    result_table.load(encoded_text);
+    result_table.decode(encoded_text, decoded_text);
+    return decoded_text.str();
+}
+
+
+TEST_CASE("fse table: encode and decode"){
+    #define CHECK_ENCODE_DECODE(text) \
+        CHECK_EQ(text, fse_encode_and_decode(text))
+
+    CHECK_ENCODE_DECODE("");
+    CHECK_ENCODE_DECODE("a");
+    CHECK_ENCODE_DECODE("aaaaa");
+    CHECK_ENCODE_DECODE("abcde");
+    CHECK_ENCODE_DECODE("eabdceabacdebdcadbceabdcbebdabce");
+
+    #undef CHECK_ENCODE_DECODE
+
+    std::string all_bytes;
+    for(int b = 0; b < 256 * 4; b++)
+        all_bytes.push_back((char)(b * 13));
+    CHECK_EQ(all_bytes, fse_encode_and_decode(all_bytes));
+
+    // Символ, записанный дважды, и нулевая частота: сумма сходится, но таблица не задана
+    auto header = [](std::vector<std::pair<char, uint16_t>> entries){
+        std::string h = {8, (char)entries.size(), 0};
+        for(auto [symb, n] : entries){
+            h.push_back(symb);
+            h.append((const char*)&n, sizeof(n));
+        }
+        return h;
+    };
+    for(auto entries : {std::vector<std::pair<char, uint16_t>>{{'a', 128}, {'a', 128}}, {{'a', 256}, {'b', 0}}}){
+        std::stringstream src(header(entries));
+        FseTable table;
+        CHECK_THROWS_AS(table.load(src), HuffmanException);
+    }
+    std::stringstream valid(header({{'a', 128}, {'b', 128}}));
+    FseTable table;
+    table.load(valid);
+
+    // Оборванные данные - ошибка формата
+    std::string encoded;
+    {
+        std::stringstream text("abbabbbaab"), dst;
+        table.encode(text, dst);
+        encoded = dst.str();
+    }
+    std::stringstream cut(encoded.substr(0, sizeof(uint32_t) + sizeof(seq_size_t)));
+    std::stringstream dst;
+    CHECK_THROWS_AS(table.decode(cut, dst), HuffmanException);
+
+    // Несколько пакетов, последний неполный: каждый начинается со своего состояния
+    std::string long_text;
+    for(uint32_t i = 0; i < 2 * FseTable::BATCH + 1000; i++)
+        long_text += "ab"[i * 2654435761u >> 31];
+    std::stringstream long_src(long_text), long_encoded, long_decoded;
+    table.encode(long_src, long_encoded);
+    table.decode(long_encoded, long_decoded);
+    CHECK_EQ(long_decoded.str(), long_text);
+
+    // Длина сообщения не помещается в 32 бита: отказ до чтения данных, а не тихое усечение
+    struct huge_buf : std::streambuf{
+        off_type at = 0;
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode) override{
+            at = (dir == std::ios_base::beg ? 0 : dir == std::ios_base::cur ? at : off_type(UINT32_MAX) + 1) + off;
+            return pos_type(at);
+        }
+        pos_type seekpos(pos_type pos, std::ios_base::openmode) override { return pos_type(at = pos); }
+    } huge;
+    std::istream huge_src(&huge);
+    std::stringstream huge_dst;
+    CHECK_THROWS_AS(table.encode(huge_src, huge_dst), HuffmanException);
+    CHECK(huge_dst.str().empty());
+}
+
+
+TEST_CASE("final test: fse beats huffman on skewed data"){
+    std::string text(20000, '\0');
+    for(std::size_t i = 0; i < text.size(); i += 23)
+        text[i] = (char)(i % 5 + 1);
+
+    encode_options opt;
+    std::stringstream huffman_text(text);
+    std::stringstream huffman_encoded;
+    encode(huffman_text, huffman_encoded, opt);
+
+    opt.coder = method::fse;
+    std::stringstream fse_text(text);
+    std::stringstream fse_encoded;
+    std::stringstream decoded_text;
+    encode(fse_text, fse_encoded, opt);
+    CHECK_LT(fse_encoded.str().size() * 2, huffman_encoded.str().size());
+    decode(fse_encoded, decoded_text);
+    CHECK_EQ(decoded_text.str(), text);
+}
+
+
+TEST_CASE("context model: encode and decode"){
+    std::string text;
+    for(int i = 0; i < 300; i++)
+        text += "id,name,value\n" + std::to_string(i) + ",item" + std::to_string(i % 17) + ",0.5\n";
+
+    std::stringstream initial_text(text);
+    std::stringstream encoded_text;
+    std::stringstream decoded_text;
+    ContextModel model(initial_text, 4);
+    model.save(encoded_text);
+    model.encode(initial_text, encoded_text);
+
+    ContextModel result_model;
+    result_model.load(encoded_text);
+    result_model.decode(encoded_text, decoded_text);
+    CHECK_EQ(decoded_text.str(), text);
+    CHECK_EQ(model.additional_data_size(), result_model.additional_data_size());
+}
+
+
+TEST_CASE("context model: several blocks"){
+    std::string text;
+    for(int i = 0; text.size() < 2 * ContextModel::BLOCK_SIZE + 1000; i++)
+        text += "2026-10-19 INFO worker-" + std::to_string(i % 8) + " took " + std::to_string(i % 1000) + " ms\n";
+
+    std::stringstream initial_text(text);
+    std::stringstream encoded_text;
+    std::stringstream decoded_text;
+    ContextModel model(initial_text, 8);
+    model.save(encoded_text);
+    const std::size_t header = model.additional_data_size();
+    model.encode(initial_text, encoded_text);
+
+    ContextModel result_model;
+    result_model.load(encoded_text);
+    result_model.decode(encoded_text, decoded_text);
+    CHECK_EQ(decoded_text.str(), text);
+    CHECK_EQ(model.additional_data_size(), result_model.additional_data_size());
+
+    // Длина блока, не совпадающая с числом символов в последовательностях, - ошибка формата
+    const std::string encoded = encoded_text.str();
+    for(uint32_t n : {ContextModel::BLOCK_SIZE - 1, ContextModel::BLOCK_SIZE + 1, UINT32_MAX}){
+        std::string broken = encoded;
+        broken.replace(header, sizeof(n), (const char*)&n, sizeof(n));
+        std::stringstream broken_text(broken);
+        std::stringstream broken_decoded;
+        ContextModel broken_model;
+        broken_model.load(broken_text);
+        CHECK_THROWS_AS(broken_model.decode(broken_text, broken_decoded), HuffmanException);
+    }
+}
+
+
+TEST_CASE("final test: order1 beats order0 on structured text"){
+    std::string text;
+    for(int i = 0; i < 2000; i++)
+        text += "2026-10-19 INFO worker-" + std::to_string(i % 8) + " done\n";
+
+    encode_options opt;
+    std::stringstream order0_text(text);
+    std::stringstream order0_encoded;
+    encode(order0_text, order0_encoded, opt);
+
+    opt.coder = method::order1;
+    std::stringstream order1_text(text);
+    std::stringstream order1_encoded;
+    std::stringstream decoded_text;
+    encode(order1_text, order1_encoded, opt);
+    CHECK_LT(order1_encoded.str().size(), order0_encoded.str().size());
+    decode(order1_encoded, decoded_text);
+    CHECK_EQ(decoded_text.str(), text);
+
+    std::stringstream empty_text;
+    std::stringstream empty_encoded;
+    std::stringstream empty_decoded;
+    encode(empty_text, empty_encoded, opt);
+    decode(empty_encoded, empty_decoded);
+    CHECK_EQ(empty_decoded.str(), "");
+}
+
+
+TEST_CASE("lz77: parse and restore"){
+    std::vector<std::string> texts{
+        "",
+        "a",
+        "abcabcabcabcabcabc",
+        std::string(1000, 'z'),
+        "GET /index.html 200\nGET /index.html 304\nGET /about.html 200\n",
+    };
+    for(int level : {1, 6, 9})
+        for(const auto& text : texts){
+            Lz77Streams streams = Lz77(level).parse(text);
+            CHECK_EQ(streams.lengths.size(), streams.literals.size() + streams.distances.size() / 2);
+            CHECK_EQ(Lz77::restore(streams), text);
+        }
+
+    Lz77Streams streams = Lz77().parse(std::string(1000, 'z'));
+    CHECK_EQ(streams.literals, "z");
+
+    streams.distances[0] = 5;
+    CHECK_THROWS_AS(Lz77::restore(streams), HuffmanException);
+}
+
+
+TEST_CASE("final test: lz77 on repetitive text"){
+    std::string text;
+    for(int i = 0; i < 3000; i++)
+        text += "2026-10-19T12:00:00 INFO request served in " + std::to_string(i % 13) + " ms\n";
+
+    encode_options opt;
+    std::stringstream order0_text(text);
+    std::stringstream order0_encoded;
+    encode(order0_text, order0_encoded, opt);
+
+    opt.coder = method::lz77;
+    std::stringstream lz77_text(text);
+    std::stringstream lz77_encoded;
+    std::stringstream decoded_text;
+    encode(lz77_text, lz77_encoded, opt);
+    CHECK_LT(lz77_encoded.str().size() * 4, order0_encoded.str().size());
+    decode(lz77_encoded, decoded_text);
+    CHECK_EQ(decoded_text.str(), text);
+}
+
+
+std::string rle_encode_and_decode(const std::string& text, std::size_t* encoded_size = nullptr){
+    std::stringstream initial_text(text);
+    std::stringstream encoded_text;
+    std::stringstream decoded_text;
+    rle_encode(initial_text, encoded_text);
+    if(encoded_size != nullptr)
+        *encoded_size = encoded_text.str().size();
+    rle_decode(encoded_text, decoded_text);
+    return decoded_text.str();
+}
+
+
+TEST_CASE("rle: encode and decode"){
+    #define CHECK_ENCODE_DECODE(text) \
+        CHECK_EQ(text, rle_encode_and_decode(text))
+
+    CHECK_ENCODE_DECODE("");
+    CHECK_ENCODE_DECODE("a");
+    CHECK_ENCODE_DECODE("aaaa");
+    CHECK_ENCODE_DECODE("aaaaa");
+    CHECK_ENCODE_DECODE("abbbbbbbbbbbbbbbbbbbbbcccd");
+    CHECK_ENCODE_DECODE("eabdceabacdebdcadbceabdcbebdabce");
+
+    #undef CHECK_ENCODE_DECODE
+
+    std::string sparse = "header" + std::string(1 << 20, '\0') + "record" + std::string(4096, ' ') + "end";
+    std::size_t encoded_size;
+    CHECK_EQ(sparse, rle_encode_and_decode(sparse, &encoded_size));
+    CHECK_LT(encoded_size, 100);
+}
+
+
+TEST_CASE("bwt: suffix array"){
+    std::string text = "mississippi";
+    std::vector<int32_t> expected{10, 7, 4, 1, 0, 9, 8, 6, 3, 5, 2};
+    CHECK_EQ(suffix_array((const byte_t*)text.data(), text.size()), expected);
+    CHECK(suffix_array(nullptr, 0).empty());
+}
+
+
+TEST_CASE("bwt: stages round trip"){
+    std::vector<std::string> texts{
+        "",
+        "a",
+        "banana",
+        "mississippi",
+        std::string(1000, 'z'),
+        std::string("\0\0\xff\0\x01" "abab\0", 10),
+    };
+    for(const auto& text : texts){
+        uint32_t primary;
+        std::string last = bwt_forward(text, primary);
+        CHECK_EQ(last.size(), text.size());
+        CHECK_EQ(bwt_inverse(last, primary), text);
+        CHECK_EQ(mtf_decode(mtf_encode(text)), text);
+        CHECK_EQ(zrle_decode(zrle_encode(text), text.size()), text);
+    }
+
+    // Серия или символ за пределами блока: 31 цифра RUNB - это почти 2^32 нулей
+    CHECK_THROWS_AS(zrle_decode(std::vector<uint16_t>(31, ZRLE_RUNB), 1000), HuffmanException);
+    CHECK_THROWS_AS(zrle_decode(zrle_encode(std::string(6, '\0')), 5), HuffmanException);
+    CHECK_THROWS_AS(zrle_decode(zrle_encode("banana"), 5), HuffmanException);
+    CHECK_EQ(zrle_decode(zrle_encode("banana"), 100), "banana");
+
+    uint32_t primary;
+    CHECK_EQ(bwt_forward("banana", primary), "annbaa");
+    CHECK_EQ(primary, 4);
+    CHECK_EQ(zrle_encode(std::string(6, '\0')).size(), 2);
+}
+
+
+TEST_CASE("final test: bwt in several blocks and threads"){
+    std::string text;
+    for(int i = 0; i < 4000; i++)
+        text += "line " + std::to_string(i % 50) + " of the archive\n";
+
+    encode_options opt;
+    opt.coder = method::bwt;
+    opt.block_size = 10000;
+    opt.threads = 3;
+    std::stringstream initial_text(text);
+    std::stringstream encoded_text;
+    std::stringstream decoded_text;
+    encode(initial_text, encoded_text, opt);
+    CHECK_LT(encoded_text.str().size() * 10, text.size());
+    decode(encoded_text, decoded_text, 2);
+    CHECK_EQ(decoded_text.str(), text);
+
+    std::stringstream empty_text;
+    std::stringstream empty_encoded;
+    std::stringstream empty_decoded;
+    encode(empty_text, empty_encoded, opt);
+    decode(empty_encoded, empty_decoded);
+    CHECK_EQ(empty_decoded.str(), "");
+}
+
+
+// Проверка канонического кода во время компиляции: код каждого символа по дереву приводит к нему же
+template<std::size_t N, int L>
+constexpr bool static_code_is_consistent(const StaticCode<N, L>& c){
+    for(std::size_t s = 0; s < N; s++){
+        if(c.length[s] == 0)
+            continue;
+        uint16_t i = c.root;
+        for(int k = c.length[s] - 1; k >= 0; k--)
+            i = (c.code[s] >> k) & 1 ? c.nodes[i].i1 : c.nodes[i].i0;
+        if(c.nodes[i].i0 != (uint16_t)-1 || c.nodes[i].symb != s)
+            return false;
+    }
+    return true;
+}
+
+constexpr auto small_code = make_static_code<5, 8>(std::array<uint64_t, 5>{1, 2, 4, 6, 8});
+static_assert(small_code.length[0] == 4 && small_code.length[4] == 1);
+static_assert(static_code_is_consistent(small_code));
+static_assert(static_code_is_consistent(text_code));
+static_assert(text_code.root == 2 * 256 - 2);
+static_assert(text_code.decode_table[0].len <= text_code.DECODE_BITS);
+
+constexpr auto limited_code = make_static_code<6, 3>(std::array<uint64_t, 6>{1, 1, 2, 4, 8, 1000});
+static_assert(limited_code.length[0] <= 3 && limited_code.length[5] >= 1);
+
 
+TEST_CASE("static code: encode and decode"){
+    std::stringstream ss;
+    {
+        bit_oseq bos(ss);
+        for(uint16_t symb : {0, 4, 4, 3, 1, 2})
+            small_code.encode(symb, bos);
+        CHECK_THROWS_AS(small_code.encode(5, bos), HuffmanException);
+    }
+    bit_iseq bis(ss);
+    CHECK_EQ(bis.size(), 4 + 1 + 1 + 2 + 4 + 3);
+    for(uint16_t symb : {0, 4, 4, 3, 1, 2})
+        CHECK_EQ(small_code.decode(bis), symb);
+
+    std::array<uint8_t, 4> incomplete{1, 2, 3, 0};
+    CHECK_THROWS(make_static_code<4, 3>(incomplete));
+}
+
+
+TEST_CASE("final test: built-in text code"){
+    std::string text = "Hello, world! The static text code needs no tree in the output.\n";
+    encode_options opt;
+    opt.coder = method::static_text;
+    std::stringstream initial_text(text);
+    std::stringstream encoded_text;
+    std::stringstream decoded_text;
+    encode(initial_text, encoded_text, opt);
+    CHECK_LT(encoded_text.str().size(), text.size());
+    decode(encoded_text, decoded_text);
+    CHECK_EQ(decoded_text.str(), text);
+
+    // Таблица декодирования: длинные коды (редкие байты) дочитываются по дереву
+    std::string all_bytes;
+    for(int i = 0; i < 100000; i++)
+        all_bytes += i % 7 ? text[i % text.size()] : (char)(i * 131);
+    std::stringstream all_src(all_bytes), all_encoded, all_decoded;
+    text_code.encode(all_src, all_encoded);
+    std::string cut = all_encoded.str();
+    text_code.decode(all_encoded, all_decoded);
+    CHECK_EQ(all_decoded.str(), all_bytes);
+
+    // Размер последовательности обрывает последний код
+    seq_size_t size;
+    std::memcpy(&size, cut.data(), sizeof(size));
+    size -= 1;
+    std::memcpy(&cut[0], &size, sizeof(size));
+    std::stringstream cut_src(cut), cut_dst;
+    CHECK_THROWS_AS(text_code.decode(cut_src, cut_dst), HuffmanException);
+}
+
+
+TEST_CASE("final test: pipelined blocks"){
+    std::string text;
+    for(int i = 0; i < 3000; i++)
+        text += "record " + std::to_string(i * 31 % 997) + ";\n";
+
+    for(method coder : {method::huffman, method::lz77}){
+        encode_options opt;
+        opt.coder = coder;
+        opt.pipeline = true;
+        opt.block_size = 5000;
+        opt.threads = 3;
+        std::stringstream initial_text(text);
+        std::stringstream encoded_text;
+        std::stringstream decoded_text;
+        std::size_t encoded_size = encode(initial_text, encoded_text, opt);
+        CHECK_EQ(encoded_text.str()[0], (char)method::blocks);
+        CHECK_LT(encoded_text.str().size(), text.size());
+        CHECK_EQ(decode(encoded_text, decoded_text, 2), encoded_size);
+        CHECK_EQ(decoded_text.str(), text);
+
+        // Испорченный размер блока: ошибку находит рабочий поток, конвейер останавливается
+        std::string broken = encoded_text.str();
+        broken[1] ^= 1;
+        std::stringstream broken_src(broken), dst;
+        CHECK_THROWS_AS(decode(broken_src, dst, 2), HuffmanException);
+
+        // Поток блоков внутри блока не принимается: иначе каждый уровень запускал бы свой конвейер
+        const uint32_t sizes[2] = {(uint32_t)text.size(), (uint32_t)encoded_text.str().size()};
+        const uint32_t end[2] = {0, 0};
+        std::string nested(1, (char)method::blocks);
+        nested.append((const char*)sizes, sizeof(sizes));
+        nested += encoded_text.str();
+        nested.append((const char*)end, sizeof(end));
+        nested.append((const char*)end, sizeof(end));  // пустой индекс: число элементов в начале и в конце
+        nested += "HIDX";
+        std::stringstream nested_src(nested), nested_dst;
+        CHECK_THROWS_AS(decode(nested_src, nested_dst, 2), HuffmanException);
+
+        // Сжатый размер в заголовке обещает почти 4 ГиБ, а данных нет: память под них не выделяется
+        const uint32_t huge[2] = {(uint32_t)text.size(), UINT32_MAX - 1};
+        std::string truncated(1, (char)method::blocks);
+        truncated.append((const char*)huge, sizeof(huge));
+        truncated += "xx";
+        std::stringstream truncated_src(truncated), truncated_dst;
+        CHECK_THROWS_AS(decode(truncated_src, truncated_dst, 2), HuffmanException);
+
+        // Число элементов в начале индекса обещает 96 ГиБ: индекс пропускается кусками и оказывается обрезан
+        std::string no_index = encoded_text.str();
+        uint32_t count;
+        std::memcpy(&count, no_index.data() + no_index.size() - 8, sizeof(count));
+        const uint32_t forged = UINT32_MAX;
+        no_index.replace(no_index.size() - 12 - count * 24, sizeof(forged), (const char*)&forged, sizeof(forged));
+        std::stringstream no_index_src(no_index), no_index_dst;
+        CHECK_THROWS_AS(decode(no_index_src, no_index_dst, 2), HuffmanException);
+    }
+
+    encode_options opt;
+    opt.pipeline = true;
+    std::stringstream empty_text, empty_encoded, empty_decoded;
+    encode(empty_text, empty_encoded, opt);
+    decode(empty_encoded, empty_decoded);
+    CHECK_EQ(empty_decoded.str(), "");
+}
+
+
+TEST_CASE("final test: decode range by block index"){
+    std::string text;
+    for(int i = 0; i < 4000; i++)
+        text += "line " + std::to_string(i) + "\n";
+
+    encode_options opt;
+    opt.pipeline = true;
+    opt.block_size = 3000;
+    std::stringstream initial_text(text);
+    std::stringstream encoded_text;
+    encode(initial_text, encoded_text, opt);
+
+    // Внутри блока, через границы нескольких блоков, до конца и за концом данных
+    std::vector<std::pair<uint64_t, uint64_t>> ranges = {
+        {0, 10}, {2990, 20}, {2500, 9000}, {text.size() - 5, 100}, {text.size() + 10, 5}, {100, 0}, {0, UINT64_MAX}};
+    for(auto [offset, length] : ranges){
+        std::stringstream dst;
+        std::size_t written = decode_range(encoded_text, offset, length, dst);
+        std::string expected = offset < text.size() ? text.substr(offset, length) : "";
+        CHECK_EQ(written, expected.size());
+        CHECK_EQ(dst.str(), expected);
+    }
+
+    // Индекс не мешает обычному разжатию
+    std::stringstream decoded_text;
+    decode(encoded_text, decoded_text);
+    CHECK_EQ(decoded_text.str(), text);
+
+    std::string broken = encoded_text.str();
+    broken[broken.size() - 1] ^= 1;
+    std::stringstream broken_src(broken), dst;
+    CHECK_THROWS_AS(decode_range(broken_src, 0, 10, dst), HuffmanException);
+
+    std::stringstream plain_src(text), plain_encoded;
+    encode(plain_src, plain_encoded);
+    CHECK_THROWS_AS(decode_range(plain_encoded, 0, 10, dst), HuffmanException);
+}
+
+// Типы блоков Хаффмана в данных method::blocks (-1 у блоков других способов)
+static std::vector<int> huffman_block_types(const std::string& encoded){
+    std::vector<int> types;
+    std::size_t pos = 1;
+    while(true){
+        uint32_t header[2];
+        std::memcpy(header, encoded.data() + pos, sizeof(header));
+        pos += sizeof(header);
+        if(header[0] == 0)
+            break;
+        types.push_back(encoded[pos] == (char)method::huffman_block ? encoded[pos + 1] : -1);
+        pos += header[1];
+    }
+    return types;
+}
+
+
+TEST_CASE("final test: blocks repeat the previous tree"){
+    // Три похожих по частотам блока текста, затем двоичные данные с другим алфавитом
+    std::string text;
+    for(int i = 0; i < 1500; i++)
+        text += "value " + std::to_string(i * 7919 % 1000) + "\n";
+    text.resize(3 * 4000);
+    std::string binary;
+    for(int i = 0; i < 4000; i++)
+        binary += (char)(i * 37 % 256);
+
+    encode_options opt;
+    opt.pipeline = true;
+    opt.block_size = 4000;
+    opt.threads = 3;
+    std::stringstream initial_text(text + binary);
+    std::stringstream encoded_text;
+    std::size_t encoded_size = encode(initial_text, encoded_text, opt);
+    // Равномерные двоичные данные коротким блоком не сжать: они хранятся как есть
+    std::vector<int> expected = {(int)block_type::tree, (int)block_type::repeat, (int)block_type::repeat, (int)block_type::stored};
+    CHECK_EQ(huffman_block_types(encoded_text.str()), expected);
+
+    std::stringstream decoded_text;
+    CHECK_EQ(decode(encoded_text, decoded_text, 2), encoded_size);
+    CHECK_EQ(decoded_text.str(), text + binary);
+
+    // Диапазон внутри блока-повтора: дерево находится в блоке перед ним
+    std::stringstream range;
+    encoded_text.seekg(0);
+    CHECK_EQ(decode_range(encoded_text, 8100, 50, range), 50);
+    CHECK_EQ(range.str(), text.substr(8100, 50));
+
+    // Без предыдущего блока повтор разжать нельзя
+    std::string lonely = encoded_text.str();
+    const std::size_t first_payload = 1 + 2 * sizeof(uint32_t);
+    CHECK_EQ(lonely[first_payload], (char)method::huffman_block);
+    lonely[first_payload + 1] = (char)block_type::repeat;
+    std::stringstream lonely_src(lonely), dst;
+    CHECK_THROWS_AS(decode(lonely_src, dst, 2), HuffmanException);
+
+    // Номер блока с деревом записан в индексе: decode_range читает только его, повторы между ними не нужны
+    std::string skipped = encoded_text.str();
+    uint32_t first_size;
+    std::memcpy(&first_size, &skipped[1 + sizeof(uint32_t)], sizeof(first_size));
+    skipped[first_payload + first_size + 2 * sizeof(uint32_t)] = (char)method::blocks;
+    std::stringstream skipped_src(skipped), skipped_range;
+    CHECK_EQ(decode_range(skipped_src, 8100, 50, skipped_range), 50);
+    CHECK_EQ(skipped_range.str(), text.substr(8100, 50));
+
+    // Индекс, указывающий на сам блок или на блок без дерева, повреждён
+    for(uint64_t tree_block : {2, 1}){
+        std::string forged = encoded_text.str();
+        const std::size_t entry = forged.size() - sizeof(uint32_t) - 4 - (5 - 2) * 3 * sizeof(uint64_t);
+        std::memcpy(&forged[entry + 2 * sizeof(uint64_t)], &tree_block, sizeof(tree_block));
+        std::stringstream forged_src(forged), forged_range;
+        CHECK_THROWS_AS(decode_range(forged_src, 8100, 50, forged_range), HuffmanException);
+    }
+
+    // Повреждённое дерево первого блока: ошибка доходит и до блоков, которые его ждут
+    std::string broken = encoded_text.str();
+    broken[first_payload + 2] = 0;
+    broken[first_payload + 3] = 0;
+    std::stringstream broken_src(broken);
+    CHECK_THROWS_AS(decode(broken_src, dst, 3), HuffmanException);
+
+    // Оценка: повтор выбирается, только если он не длиннее нового дерева с его записью
+    std::string block = text.substr(4000, 4000);
+    auto count = byte_counts(block.data(), block.size());
+    SharedTree prev = make_block_tree(byte_counts(text.data(), 4000));
+    SharedTree fresh = make_block_tree(count);
+    CHECK_LE(prev->cost(count), fresh->cost(count) + 8 * block_tree_header_size(fresh->code_lengths()));
+    CHECK_EQ(choose_block_tree(count, fresh, prev), prev);
+    CHECK_EQ(choose_block_tree(count, fresh, nullptr), fresh);
+    auto binary_count = byte_counts(binary.data(), binary.size());
+    CHECK_EQ(prev->cost(binary_count), SIZE_MAX);
+    SharedTree binary_tree = make_block_tree(binary_count);
+    CHECK_EQ(choose_block_tree(binary_count, binary_tree, prev), binary_tree);
+}
+
+TEST_CASE("final test: splitting blocks where frequencies change"){
+    // Двоичный заголовок с верхней половиной байтов, затем текст
+    std::string data;
+    for(int i = 0; i < 40000; i++)
+        data += (char)(128 + (i * 2654435761u >> 13) % 128);
+    const std::size_t header_size = data.size();
+    for(int i = 0; data.size() < 120000; i++)
+        data += "entry " + std::to_string(i % 977) + " ok\n";
+
+    // Оценка совпадает с настоящим размером кода и записи дерева
+    auto count = byte_counts(data.data(), data.size());
+    SharedTree tree = make_block_tree(count);
+    const std::size_t overhead = estimate_block_bits(count.data()) - tree->cost(count) - 8 * block_tree_header_size(tree->code_lengths());
+    CHECK_EQ(overhead, 8 * (2 * sizeof(uint32_t) + 3 * sizeof(uint64_t) + 2 + sizeof(seq_size_t)));
+
+    std::vector<std::size_t> parts = split_block(data.data(), data.size(), 0);
+    REQUIRE_GE(parts.size(), 2);
+    // Первая граница - на ближайшей к концу заголовка границе куска
+    CHECK_LT(std::max(parts[0], header_size) - std::min(parts[0], header_size), SPLIT_UNIT);
+    std::size_t total = 0;
+    for(std::size_t part : parts)
+        total += part;
+    CHECK_EQ(total, data.size());
+
+    std::string text = data.substr(header_size);
+    CHECK_EQ(split_block(text.data(), text.size(), 0).size(), 1);
+    CHECK_EQ(split_block(data.data(), 100, 0), std::vector<std::size_t>{100});
+
+    encode_options opt;
+    opt.pipeline = true;
+    opt.block_size = data.size();
+    opt.split_min_speed = 0;
+    std::string encoded[2];
+    for(bool split : {false, true}){
+        opt.split = split;
+        std::stringstream initial_text(data);
+        std::stringstream encoded_text;
+        std::stringstream decoded_text;
+        encode(initial_text, encoded_text, opt);
+        decode(encoded_text, decoded_text);
+        CHECK_EQ(decoded_text.str(), data);
+        encoded[split] = encoded_text.str();
+    }
+    CHECK_EQ(huffman_block_types(encoded[0]).size(), 1);
+    CHECK_EQ(huffman_block_types(encoded[1]).size(), parts.size());
+    CHECK_LT(encoded[1].size(), encoded[0].size());
+
+    std::stringstream encoded_text(encoded[1]), range;
+    CHECK_EQ(decode_range(encoded_text, header_size - 10, 20, range), 20);
+    CHECK_EQ(range.str(), data.substr(header_size - 10, 20));
+}
+
+TEST_CASE("final test: incompressible data is stored"){
+    std::string noise;
+    uint32_t x = 12345;
+    for(int i = 0; i < 50000; i++){
+        x = x * 1103515245 + 12345;
+        noise += (char)(x >> 24);
+    }
+    std::string text;
+    for(int i = 0; text.size() < 50000; i++)
+        text += "line " + std::to_string(i % 100) + "\n";
+
+    std::stringstream noise_src(noise), noise_encoded, noise_decoded;
+    CHECK_EQ(encode(noise_src, noise_encoded), sizeof(method) + sizeof(uint64_t));
+    CHECK_EQ(noise_encoded.str()[0], (char)method::stored);
+    CHECK_EQ(noise_encoded.str().size(), noise.size() + sizeof(method) + sizeof(uint64_t));
+    CHECK_EQ(decode(noise_encoded, noise_decoded), sizeof(method) + sizeof(uint64_t));
+    CHECK_EQ(noise_decoded.str(), noise);
+
+    std::string cut = noise_encoded.str().substr(0, 100);
+    std::stringstream cut_src(cut), dst;
+    std::size_t additional_size;
+    CHECK_EQ(try_decode(cut_src, dst, additional_size).status, decode_status::truncated);
+
+    // Порог выигрыша: текст сжимается почти вдвое, поэтому хранится только при пороге больше этого
+    encode_options opt;
+    for(double min_gain : {0.01, 0.9}){
+        opt.min_gain = min_gain;
+        std::stringstream text_src(text), text_encoded, text_decoded;
+        encode(text_src, text_encoded, opt);
+        CHECK_EQ(text_encoded.str()[0], (char)(min_gain < 0.5 ? method::huffman : method::stored));
+        decode(text_encoded, text_decoded);
+        CHECK_EQ(text_decoded.str(), text);
+    }
+
+    // В блоках хранится только несжимаемый блок
+    opt.min_gain = 0.01;
+    opt.pipeline = true;
+    opt.block_size = 50000;
+    std::stringstream mixed_src(text + noise + text), mixed_encoded, mixed_decoded;
+    encode(mixed_src, mixed_encoded, opt);
+    std::vector<int> expected = {(int)block_type::tree, (int)block_type::stored, (int)block_type::repeat};
+    CHECK_EQ(huffman_block_types(mixed_encoded.str()), expected);
+    decode(mixed_encoded, mixed_decoded);
+    CHECK_EQ(mixed_decoded.str(), text + noise + text);
+    std::stringstream range;
+    mixed_encoded.seekg(0);
+    CHECK_EQ(decode_range(mixed_encoded, 99990, 20, range), 20);
+    CHECK_EQ(range.str(), (text + noise + text).substr(99990, 20));
+    mixed_encoded.clear();
+    mixed_encoded.seekg(0);
+    CHECK_EQ(decode_range(mixed_encoded, 49990, 20, range), 20);
+}
+
+TEST_CASE("final test: single byte and small alphabet blocks"){
+    std::string zeros(100000, '\0');
+    std::stringstream zeros_src(zeros), zeros_encoded, zeros_decoded;
+    CHECK_EQ(encode(zeros_src, zeros_encoded), sizeof(method) + sizeof(uint64_t) + 1);
+    CHECK_EQ(zeros_encoded.str().size(), sizeof(method) + sizeof(uint64_t) + 1);
+    CHECK_EQ(zeros_encoded.str()[0], (char)method::run);
+    decode(zeros_encoded, zeros_decoded);
+    CHECK_EQ(zeros_decoded.str(), zeros);
+
+    // Равномерные алфавиты из 2, 4 и 16 байтов: номера по 1, 2 и 4 бита
+    std::string bits, dna, digits;
+    for(int i = 0; i < 20000; i++){
+        bits += i * 7 % 3 ? '1' : '0';
+        dna += "ACGT"[i * 13 % 4];
+        digits += "0123456789abcdef"[i * 7 % 16];
+    }
+    CHECK_EQ(choose_block_type(byte_counts(bits.data(), bits.size()), bits.size(), 0.01), block_type::small);
+    // Неравномерный алфавит из трёх байтов код Хаффмана кодирует короче двух бит на символ
+    std::string skewed;
+    for(int i = 0; i < 20000; i++)
+        skewed += "AAB"[i % 3] + (i % 50 == 0);
+    CHECK_EQ(choose_block_type(byte_counts(skewed.data(), skewed.size()), skewed.size(), 0.01), block_type::tree);
+    CHECK_EQ(choose_block_type(byte_counts(zeros.data(), zeros.size()), zeros.size(), 0.01), block_type::single);
+    std::string text = "the quick brown fox jumps over the lazy dog, and the dog sleeps. ";
+    while(text.size() < 20000)
+        text += text;
+    CHECK_EQ(choose_block_type(byte_counts(text.data(), text.size()), text.size(), 0.01), block_type::tree);
+
+    std::string data = bits + zeros + dna + digits + text;
+    encode_options opt;
+    opt.pipeline = true;
+    opt.block_size = 20000;
+    opt.threads = 2;
+    std::stringstream initial_text(data), encoded_text, decoded_text;
+    encode(initial_text, encoded_text, opt);
+    std::vector<int> types = huffman_block_types(encoded_text.str());
+    REQUIRE_EQ(types.size(), 10);
+    CHECK_EQ(types[0], (int)block_type::small);
+    for(int k = 1; k <= 5; k++)
+        CHECK_EQ(types[k], (int)block_type::single);
+    CHECK_EQ(types[6], (int)block_type::small);
+    CHECK_EQ(types[7], (int)block_type::small);
+    CHECK_EQ(types[8], (int)block_type::tree);
+    CHECK_LT(encoded_text.str().size(), bits.size() / 8 + dna.size() / 4 + digits.size() / 2 + text.size());
+    decode(encoded_text, decoded_text, 2);
+    CHECK_EQ(decoded_text.str(), data);
+
+    std::stringstream range;
+    encoded_text.seekg(0);
+    CHECK_EQ(decode_range(encoded_text, 19995, 150010, range), 150010);
+    CHECK_EQ(range.str(), data.substr(19995, 150010));
+
+    // Длина в самом блоке, не совпадающая с размером из заголовка потока, отвергается до выделения памяти
+    auto forged_stream = [](const std::string& block, uint32_t raw_size){
+        const uint32_t sizes[2] = {raw_size, (uint32_t)block.size()};
+        const uint32_t end[2] = {0, 0};
+        std::string res(1, (char)method::blocks);
+        res.append((const char*)sizes, sizeof(sizes));
+        res += block;
+        res.append((const char*)end, sizeof(end));
+        res.append((const char*)end, sizeof(end));
+        return res + "HIDX";
+    };
+    const uint32_t huge_length = UINT32_MAX;
+    std::string single = {(char)method::huffman_block, (char)block_type::single, 'a'};
+    single.append((const char*)&huge_length, sizeof(huge_length));
+    const uint64_t huge_run = UINT64_MAX;
+    std::string run(1, (char)method::run);
+    run.append((const char*)&huge_run, sizeof(huge_run));
+    run += 'a';
+    for(const std::string& block : {single, run}){
+        std::stringstream forged_src(forged_stream(block, 10)), forged_dst;
+        CHECK_THROWS_AS(decode(forged_src, forged_dst, 2), HuffmanException);
+    }
+}
+
+TEST_CASE("final test: compact code lengths in block headers"){
+    std::string text;
+    for(int i = 0; text.size() < 64 * 1024; i++)
+        text += "Line " + std::to_string(i) + ": The Quick Brown Fox jumps over the lazy dog (again), " + std::to_string(i * 7919 % 10007) + " times!\n";
+
+    // Блок текста в 4 КиБ: запись длин кодов короче 40 байт
+    auto count = byte_counts(text.data(), 4096);
+    std::vector<uint8_t> lengths = block_code_lengths(count.data());
+    const std::size_t header = block_tree_header_size(lengths);
+    CHECK_LT(header, 40);
+    CHECK_LT(header * 20, HuffmanTree::saved_size(std::count_if(lengths.begin(), lengths.end(), [](uint8_t l){ return l != 0; })));
+
+    // Каноническое дерево восстанавливается по одним длинам
+    HuffmanTree tree;
+    REQUIRE(tree.try_construct_canonical(lengths));
+    CHECK_EQ(tree.code_lengths(), lengths);
+    CHECK_EQ(make_block_tree(count)->code_lengths(), lengths);
+
+    // Неполный, переполненный код и код из одного символа
+    std::vector<uint8_t> bad(256, 0);
+    bad['a'] = 1;
+    CHECK_FALSE(tree.try_construct_canonical(bad));
+    bad['b'] = 2;
+    CHECK_FALSE(tree.try_construct_canonical(bad));
+    bad['c'] = 1;
+    CHECK_FALSE(tree.try_construct_canonical(bad));
+    bad['c'] = 2;
+    CHECK(tree.try_construct_canonical(bad));
+
+    // Частоты Фибоначчи дали бы коды длиннее 32 бит
+    std::vector<std::size_t> fibonacci(256, 0);
+    fibonacci[0] = fibonacci[1] = 1;
+    for(int b = 2; b < 60; b++)
+        fibonacci[b] = fibonacci[b - 1] + fibonacci[b - 2];
+    std::vector<uint8_t> limited = block_code_lengths(fibonacci.data());
+    CHECK_LE(*std::max_element(limited.begin(), limited.end()), 32);
+    CHECK(tree.try_construct_canonical(limited));
+
+    encode_options opt;
+    opt.pipeline = true;
+    opt.block_size = 4096;
+    opt.threads = 3;
+    std::stringstream initial_text(text), encoded_text, decoded_text;
+    encode(initial_text, encoded_text, opt);
+    decode(encoded_text, decoded_text, 2);
+    CHECK_EQ(decoded_text.str(), text);
+    std::stringstream range;
+    encoded_text.clear();
+    encoded_text.seekg(0);
+    CHECK_EQ(decode_range(encoded_text, 30000, 5000, range), 5000);
+    CHECK_EQ(range.str(), text.substr(30000, 5000));
+
+    // Испорченная запись длин - ошибка формата, а не неверные данные
+    std::string broken = encoded_text.str();
+    const std::size_t first_payload = 2 * sizeof(uint32_t) + 1;
+    broken[first_payload + 2] = 0;
+    broken[first_payload + 3] = 0;
+    std::stringstream broken_src(broken), dst;
+    CHECK_THROWS_AS(decode(broken_src, dst, 2), HuffmanException);
+}
+
+TEST_CASE("final test: validating tree loader"){
+    std::map<char, double> p;
+    for(int b = 0; b < 40; b++)
+        p[(char)('0' + b)] = 1 + b * b % 17;
+    HuffmanTree tree(p);
+    std::stringstream saved_stream;
+    tree.save(saved_stream);
+    const std::string saved = saved_stream.str();
+    const byte_t* data = (const byte_t*)saved.data();
+    const std::size_t n = 2 * p.size() - 1;
+    REQUIRE_EQ(saved.size(), sizeof(uint16_t) + n * 8);
+
+    // Загрузка прямо из памяти
+    HuffmanTree loaded;
+    CHECK_EQ(HuffmanTree::validate_saved(data, saved.size()), decode_status::ok);
+    REQUIRE_EQ(loaded.try_load(data, saved.size()), decode_status::ok);
+    CHECK(loaded == tree);
+    for(std::size_t size = 0; size < saved.size(); size++)
+        CHECK_EQ(HuffmanTree::validate_saved(data, size), decode_status::truncated);
+
+    // Узел i записи: i0, i1, ip по 2 байта, v, символ
+    auto node_field = [](std::string& record, std::size_t i, std::size_t offset){ return &record[sizeof(uint16_t) + i * 8 + offset]; };
+    auto set_index = [&](std::string& record, std::size_t i, std::size_t offset, uint16_t value){
+        std::memcpy(node_field(record, i, offset), &value, sizeof(value));
+    };
+    auto status = [](const std::string& record){ return HuffmanTree::validate_saved((const byte_t*)record.data(), record.size()); };
+    const std::size_t root = n - 1, leaves = p.size();
+
+    std::string even = saved;
+    uint16_t count = n + 1;
+    std::memcpy(&even[0], &count, sizeof(count));
+    even.append(8, 0);
+    CHECK_EQ(status(even), decode_status::corrupt);
+
+    std::string cycle = saved;  // корень ссылается сам на себя
+    set_index(cycle, root, 0, root);
+    CHECK_EQ(status(cycle), decode_status::corrupt);
+
+    std::string forward = saved;  // внутренний узел ссылается на узел с большим номером
+    set_index(forward, leaves, 2, root);
+    CHECK_EQ(status(forward), decode_status::corrupt);
+
+    std::string shared = saved;  // два родителя у одного узла
+    uint16_t child;
+    std::memcpy(&child, node_field(shared, root, 0), sizeof(child));
+    set_index(shared, root, 2, child);
+    CHECK_EQ(status(shared), decode_status::corrupt);
+
+    std::string leaf_with_child = saved;
+    set_index(leaf_with_child, 0, 0, 1);
+    CHECK_EQ(status(leaf_with_child), decode_status::corrupt);
+
+    std::string bad_flag = saved;
+    *node_field(bad_flag, 3, 6) = 2;
+    CHECK_EQ(status(bad_flag), decode_status::corrupt);
+
+    std::string bad_root = saved;
+    set_index(bad_root, root, 4, 0);
+    CHECK_EQ(status(bad_root), decode_status::corrupt);
+
+    // Ошибка не меняет дерево, load сообщает о ней исключением
+    CHECK_EQ(loaded.try_load((const byte_t*)cycle.data(), cycle.size()), decode_status::corrupt);
+    CHECK(loaded == tree);
+    std::stringstream cycle_src(cycle);
+    CHECK_THROWS_AS(loaded.load(cycle_src), HuffmanException);
+    std::stringstream cycle_stream(cycle);
+    CHECK_EQ(loaded.try_load(cycle_stream), decode_status::corrupt);
+
+    // Любое прошедшее проверку дерево полное: случайные биты разжимаются без ошибок формата
+    std::string bits;
+    for(int i = 0; i < 3000; i++)
+        bits += (char)(i * 2654435761u >> 11);
+    for(int k = 0; k < 4000; k++){
+        std::string mutated = saved;
+        mutated[k * 7919 % mutated.size()] ^= (char)(1 << (k % 8));
+        mutated[k * 104729 % mutated.size()] ^= (char)(k * 31);
+        HuffmanTree t;
+        if(t.try_load((const byte_t*)mutated.data(), mutated.size()) != decode_status::ok)
+            continue;
+        std::vector<char> out;
+        decode_result res = t.try_decode((const byte_t*)bits.data(), 8 * bits.size() - k % 13, out);
+        CHECK_NE(res.status, decode_status::corrupt);
+    }
+}
+
+TEST_CASE("file io: readers and writers"){
+    std::string text;
+    for(int i = 0; i < 20000; i++)
+        text += (char)(i * 7 % 251);
+    auto dir = std::filesystem::temp_directory_path();
+    std::string path = (dir / "huffman_test_io.bin").string();
+    std::string packed_path = (dir / "huffman_test_io.huf").string();
+    std::string restored_path = (dir / "huffman_test_io.out").string();
+
+    for(io_backend io : {io_backend::stream, io_backend::pread, io_backend::uring}){
+        // Куски меньше записей и чтений, чтобы в полёте было несколько операций
+        auto writer = open_writer(path.c_str(), io, 1000, 3);
+        for(std::size_t i = 0; i < text.size(); i += 777)
+            writer->write(text.data() + i, std::min<std::size_t>(777, text.size() - i));
+        writer->close();
+        CHECK_EQ(std::filesystem::file_size(path), text.size());
+
+        auto reader = open_reader(path.c_str(), io, 1000, 3);
+        std::string read_text(text.size() + 10, 0);
+        std::size_t n = 0;
+        for(std::size_t got; (got = reader->read(&read_text[n], std::min<std::size_t>(1234, read_text.size() - n))) > 0; )
+            n += got;
+        read_text.resize(n);
+        CHECK_EQ(read_text, text);
+
+        encode_options opt;
+        opt.block_size = 3000;
+        opt.threads = 2;
+        pipeline_encode_file(path.c_str(), packed_path.c_str(), opt, io);
+        pipeline_decode_file(packed_path.c_str(), restored_path.c_str(), 2, io);
+        std::ifstream restored(restored_path, std::ios::binary);
+        CHECK_EQ(std::string(std::istreambuf_iterator<char>(restored), {}), text);
+    }
+    CHECK_THROWS_AS(open_reader((dir / "huffman_test_missing.bin").string().c_str(), io_backend::uring), HuffmanException);
+
+    // У канала нет размера: он читается подряд до конца данных
+    std::string fifo_path = (dir / "huffman_test_io.fifo").string();
+    for(io_backend io : {io_backend::pread, io_backend::uring}){
+        std::filesystem::remove(fifo_path);
+        REQUIRE_EQ(mkfifo(fifo_path.c_str(), 0600), 0);
+        std::thread writer([&](){
+            std::ofstream fifo(fifo_path, std::ios::binary);
+            fifo.write(text.data(), text.size());
+        });
+        auto reader = open_reader(fifo_path.c_str(), io, 1000, 3);
+        std::string read_text(text.size() + 10, 0);
+        std::size_t n = 0;
+        for(std::size_t got; (got = reader->read(&read_text[n], std::min<std::size_t>(1234, read_text.size() - n))) > 0; )
+            n += got;
+        writer.join();
+        read_text.resize(n);
+        CHECK_EQ(read_text, text);
+    }
+    std::filesystem::remove(fifo_path);
+    CHECK_THROWS_AS(pipeline_decode_file(path.c_str(), restored_path.c_str(), 1, io_backend::pread), HuffmanException);
+    std::filesystem::remove(path);
+    std::filesystem::remove(packed_path);
+    std::filesystem::remove(restored_path);
+}
+
+
+TEST_CASE("thread pool: all tasks run, errors are rethrown"){
+    ThreadPool pool(3);
+    std::atomic<int> sum(0);
+    for(int i = 0; i < 100; i++)
+        pool.submit([&, i](){
+            sum += i;
+            pool.submit([&](){ sum += 1; });  // задача из рабочего потока попадает в его очередь
+        });
+    pool.wait();
+    CHECK_EQ(sum, 99 * 100 / 2 + 100);
+
+    pool.submit([](){ throw HuffmanException("task failed"); });
+    CHECK_THROWS_AS(pool.wait(), HuffmanException);
+    pool.submit([&](){ sum = 0; });
+    pool.wait();
+    CHECK_EQ(sum, 0);
+}
+
+
+TEST_CASE("final test: batch of files"){
+    auto dir = std::filesystem::temp_directory_path() / "huffman_test_batch";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir / "in" / "sub");
+
+    std::vector<std::string> paths;
+    std::map<std::string, std::string> texts;
+    for(int i = 0; i < 40; i++){
+        std::string path = (dir / "in" / (i % 2 ? "sub" : "") / ("file" + std::to_string(i) + ".txt")).string();
+        std::string text;
+        for(int k = 0; k < (i == 7 ? 5000 : i * 3); k++)
+            text += "word" + std::to_string(k % (i + 1)) + " ";
+        std::ofstream(path, std::ios::binary) << text;
+        paths.push_back(path);
+        texts[path] = text;
+    }
+    paths.push_back((dir / "in" / "missing.txt").string());
+
+    batch_options opt;
+    opt.output_dir = (dir / "packed").string();
+    opt.threads = 3;
+    opt.pack_size = 4096;
+    batch_result res = run_batch(paths, opt);
+    CHECK_EQ(res.files, 40);
+    REQUIRE_EQ(res.errors.size(), 1);
+    CHECK_EQ(res.errors[0].first, paths.back());
+
+    std::vector<std::string> packed;
+    for(int i = 0; i < 40; i++)
+        packed.push_back(batch_output_path(paths[i], opt.output_dir, false));
+    opt.decode = true;
+    opt.output_dir = (dir / "restored").string();
+    res = run_batch(packed, opt);
+    CHECK_EQ(res.files, 40);
+    CHECK(res.errors.empty());
+    for(int i = 0; i < 40; i++){
+        std::ifstream restored(batch_output_path(packed[i], opt.output_dir, true), std::ios::binary);
+        CHECK_EQ(std::string(std::istreambuf_iterator<char>(restored), {}), texts[paths[i]]);
+    }
+
+    CHECK_EQ(expand_glob((dir / "in" / "sub" / "*.txt").string()).size(), 20);
+    std::stringstream list("a.txt\r\n\nb/c.txt\n");
+    CHECK_EQ(read_path_list(list), std::vector<std::string>{"a.txt", "b/c.txt"});
+    CHECK_EQ(batch_output_path("../x/y.txt", "out", false), "out/x/y.txt.huf");
+
+    // Разные пути с одним результатом: сжимается только первый
+    const std::string same = (dir / "in" / "." / "file4.txt").string();
+    opt.decode = false;
+    opt.output_dir = (dir / "collide").string();
+    res = run_batch({paths[4], same, paths[4]}, opt);
+    CHECK_EQ(res.files, 1);
+    REQUIRE_EQ(res.errors.size(), 2);
+    CHECK_EQ(res.errors[0].first, same);
+    CHECK_EQ(res.errors[1].first, paths[4]);
+    std::filesystem::remove_all(dir);
+}
+
+
+TEST_CASE("crc32"){
+    CHECK_EQ(crc32("123456789", 9), 0xCBF43926u);
+    CHECK_EQ(crc32("56789", 5, crc32("1234", 4)), 0xCBF43926u);
+
+    std::stringstream dst;
+    crc_ostreambuf buf(dst.rdbuf());
+    std::ostream os(&buf);
+    os.put('1');
+    os.write("23456789", 8);
+    CHECK_EQ(buf.crc(), 0xCBF43926u);
+    CHECK_EQ(buf.size(), 9);
+    CHECK_EQ(dst.str(), "123456789");
+}
+
+
+TEST_CASE("final test: archive with several members"){
+    std::vector<std::pair<std::string, std::string>> members;
+    for(int i = 0; i < 5; i++){
+        std::string text;
+        for(int k = 0; k < 300 * (i + 1); k++)
+            text += "shard " + std::to_string(i) + " line " + std::to_string(k % 17) + "\n";
+        members.push_back({"logs/shard" + std::to_string(i) + ".log", text});
+    }
+    members.push_back({"empty.log", ""});
+
+    std::stringstream archive_data;
+    {
+        ArchiveWriter writer(archive_data);
+        for(std::size_t i = 0; i < members.size(); i++){
+            encode_options opt;
+            opt.coder = i % 2 ? method::lz77 : method::huffman;
+            std::stringstream src(members[i].second);
+            writer.add(members[i].first, src, opt);
+        }
+        writer.close();
+        CHECK_EQ(writer.entries().size(), members.size());
+    }
+
+    ArchiveReader reader(archive_data);
+    REQUIRE_EQ(reader.entries().size(), members.size());
+    CHECK_EQ(reader.find("nothing"), nullptr);
+    // Члены извлекаются в любом порядке, каждый - по своему смещению
+    for(int i : {3, 0, 5, 1}){
+        std::stringstream dst;
+        reader.extract(members[i].first, dst);
+        CHECK_EQ(dst.str(), members[i].second);
+        CHECK_EQ(reader.find(members[i].first)->raw_size, members[i].second.size());
+    }
+    CHECK_THROWS_AS(reader.extract("nothing", std::cout), HuffmanException);
+
+    // Испорченный член не мешает извлекать остальные
+    std::string damaged = archive_data.str();
+    const ArchiveEntry* entry = reader.find(members[2].first);
+    damaged[entry->offset + entry->packed_size / 2] ^= 0x10;
+    std::stringstream damaged_src(damaged);
+    ArchiveReader damaged_reader(damaged_src);
+    std::stringstream dst;
+    CHECK_THROWS_AS(damaged_reader.extract(members[2].first, dst), HuffmanException);
+    std::stringstream other;
+    damaged_reader.extract(members[4].first, other);
+    CHECK_EQ(other.str(), members[4].second);
+
+    std::stringstream truncated(archive_data.str().substr(0, archive_data.str().size() - 3));
+    CHECK_THROWS_AS(ArchiveReader{truncated}, HuffmanException);
+    std::stringstream not_archive("just text, not an archive at all");
+    CHECK_THROWS_AS(ArchiveReader{not_archive}, HuffmanException);
+
+    // Член за каталогом с огромным размером: разность смещений не должна переполниться
+    std::string forged = archive_data.str();
+    uint64_t directory_offset;
+    std::memcpy(&directory_offset, &forged[forged.size() - 24], sizeof(directory_offset));
+    const std::size_t first_entry = directory_offset + sizeof(uint32_t) + sizeof(uint16_t) + members[0].first.size();
+    const uint64_t bad_offset = directory_offset + 1, bad_size = UINT64_MAX - 10;
+    std::memcpy(&forged[first_entry], &bad_offset, sizeof(bad_offset));
+    std::memcpy(&forged[first_entry + sizeof(uint64_t)], &bad_size, sizeof(bad_size));
+    const std::size_t directory_size = forged.size() - 24 - directory_offset;
+    const uint32_t directory_crc = crc32(forged.data() + directory_offset, directory_size);
+    std::memcpy(&forged[forged.size() - 8], &directory_crc, sizeof(directory_crc));
+    std::stringstream forged_src(forged);
+    CHECK_THROWS_AS(ArchiveReader{forged_src}, HuffmanException);
+}